@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Serializer.h>
+#include <rct/Set.h>
+#include <rct/StopWatch.h>
+#include <rct/String.h>
+
+/*
+ * Size and speed of Serializer::Compact against Native encoding. Compact
+ * wins on small ids and counts and loses on full width random values.
+ */
+
+namespace {
+struct Result
+{
+    size_t size;
+    unsigned long long encode, decode;
+};
+
+template <typename T>
+Result measure(const T &value, Serializer::Encoding encoding, int iterations)
+{
+    Result ret = { 0, 0, 0 };
+    String data;
+    for (int i=0; i<iterations; ++i) {
+        data.clear();
+        String out;
+        StopWatch sw(StopWatch::Microsecond);
+        {
+            Serializer s(out);
+            s.setEncoding(encoding);
+            s << value;
+        }
+        ret.encode += sw.elapsed();
+        data = std::move(out);
+    }
+    ret.size = data.size();
+    for (int i=0; i<iterations; ++i) {
+        T decoded;
+        StopWatch sw(StopWatch::Microsecond);
+        Deserializer d(data);
+        d.setEncoding(encoding);
+        d >> decoded;
+        ret.decode += sw.elapsed();
+        if (!d.atEnd()) {
+            fprintf(stderr, "decode didn't consume everything\n");
+            exit(1);
+        }
+        String again;
+        Serializer s(again);
+        s.setEncoding(encoding);
+        s << decoded;
+        if (again != data) {
+            fprintf(stderr, "round trip failed\n");
+            exit(1);
+        }
+    }
+    return ret;
+}
+
+template <typename T>
+void run(const char *name, const T &value, int iterations)
+{
+    const Result native = measure(value, Serializer::Native, iterations);
+    const Result compact = measure(value, Serializer::Compact, iterations);
+    printf("%-28s %8.1f KB -> %8.1f KB (%3.0f%%)  encode %7.2f -> %7.2f ms  decode %7.2f -> %7.2f ms\n",
+           name, native.size / 1024.0, compact.size / 1024.0, 100.0 * compact.size / native.size,
+           native.encode / 1000.0 / iterations, compact.encode / 1000.0 / iterations,
+           native.decode / 1000.0 / iterations, compact.decode / 1000.0 / iterations);
+}
+}
+
+int main(int argc, char **argv)
+{
+    const int iterations = argc > 1 ? atoi(argv[1]) : 10;
+    srand(1);
+
+    List<unsigned int> ids(1024 * 1024);
+    for (size_t i=0; i<ids.size(); ++i)
+        ids[i] = rand() % 10000;
+    run("List<uint> ids < 10000", ids, iterations);
+
+    List<int> deltas(1024 * 1024);
+    for (size_t i=0; i<deltas.size(); ++i)
+        deltas[i] = rand() % 200 - 100;
+    run("List<int> +-100", deltas, iterations);
+
+    List<unsigned long long> times(512 * 1024);
+    for (size_t i=0; i<times.size(); ++i)
+        times[i] = 1700000000000ull + rand();
+    run("List<uint64> ms timestamps", times, iterations);
+
+    // e.g. symbol -> files referencing it
+    Map<unsigned int, Set<unsigned int> > references;
+    for (unsigned int i=0; i<50000; ++i) {
+        Set<unsigned int> &files = references[i];
+        for (int j=rand() % 16; j>=0; --j)
+            files.insert(rand() % 5000);
+    }
+    run("Map<uint, Set<uint>>", references, iterations);
+
+    Map<String, int> strings;
+    for (int i=0; i<200000; ++i)
+        strings[String::format<32>("key%d", rand())] = i;
+    run("Map<String, int>", strings, iterations);
+
+    List<int> random(1024 * 1024);
+    for (size_t i=0; i<random.size(); ++i)
+        random[i] = rand();
+    run("List<int> random", random, iterations);
+    return 0;
+}
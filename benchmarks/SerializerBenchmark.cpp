@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Serializer.h>
+#include <rct/StopWatch.h>
+#include <rct/String.h>
+
+/*
+ * Compares the Serializer with what it used to do: every write going
+ * through a virtual Buffer and containers of native types encoded and
+ * decoded one element at a time.
+ */
+
+namespace {
+class VirtualStringBuffer : public Serializer::Buffer
+{
+public:
+    VirtualStringBuffer(String &out)
+        : mString(out)
+    {}
+    virtual bool write(const void *data, int len) override
+    {
+        mString.append(static_cast<const char *>(data), len);
+        return true;
+    }
+    virtual int pos() const override { return mString.size(); }
+private:
+    String &mString;
+};
+
+template <typename T>
+void encodeLegacy(Serializer &s, const List<T> &list)
+{
+    s << static_cast<uint32_t>(list.size());
+    serializeElements(s, list, std::false_type());
+}
+
+template <typename T>
+void decodeLegacy(Deserializer &s, List<T> &list)
+{
+    uint32_t size;
+    s >> size;
+    list.resize(size);
+    deserializeElements(s, list, std::false_type());
+}
+
+template <typename Key, typename Value>
+void encodeLegacy(Serializer &s, const Map<Key, Value> &map)
+{
+    s << map;
+}
+
+template <typename Key, typename Value>
+void decodeLegacy(Deserializer &s, Map<Key, Value> &map)
+{
+    s >> map;
+}
+
+template <typename Key, typename Value>
+void encodeLegacy(Serializer &s, const Map<Key, List<Value> > &map)
+{
+    s << static_cast<uint32_t>(map.size());
+    for (const auto &it : map) {
+        s << it.first;
+        encodeLegacy(s, it.second);
+    }
+}
+
+template <typename Key, typename Value>
+void decodeLegacy(Deserializer &s, Map<Key, List<Value> > &map)
+{
+    uint32_t size;
+    s >> size;
+    map.clear();
+    Key key;
+    List<Value> value;
+    for (uint32_t i=0; i<size; ++i) {
+        s >> key;
+        decodeLegacy(s, value);
+        map[key] = std::move(value);
+    }
+}
+
+double rate(size_t bytes, unsigned long long us)
+{
+    return us ? (bytes / (1024.0 * 1024.0)) / (us / 1000000.0) : 0;
+}
+
+// each variant runs on its own so they all see the allocator in the same state
+template <typename Encode>
+unsigned long long encodeLoop(int iterations, String &out, Encode encode)
+{
+    unsigned long long ret = 0;
+    for (int i=0; i<iterations; ++i) {
+        String data;
+        StopWatch sw(StopWatch::Microsecond);
+        encode(data);
+        ret += sw.elapsed();
+        if (!i)
+            out = data;
+    }
+    return ret;
+}
+
+template <typename T, typename Decode>
+unsigned long long decodeLoop(int iterations, const String &data, Decode decode)
+{
+    unsigned long long ret = 0;
+    for (int i=0; i<iterations; ++i) {
+        T out;
+        StopWatch sw(StopWatch::Microsecond);
+        Deserializer d(data);
+        decode(d, out);
+        ret += sw.elapsed();
+        String again;
+        Serializer s(again);
+        s << out;
+        if (again != data) {
+            fprintf(stderr, "round trip failed\n");
+            exit(1);
+        }
+    }
+    return ret;
+}
+
+template <typename T>
+void run(const char *name, const T &value, int iterations)
+{
+    String legacy, current, reserved;
+    const unsigned long long legacyEncode = encodeLoop(iterations, legacy, [&value](String &out) {
+            Serializer s(std::unique_ptr<Serializer::Buffer>(new VirtualStringBuffer(out)));
+            encodeLegacy(s, value);
+        });
+    const unsigned long long encode = encodeLoop(iterations, current, [&value](String &out) {
+            Serializer s(out);
+            s << value;
+        });
+    // the size pre-pass only pays off when it's cheap to compute
+    const unsigned long long reservedEncode = encodeLoop(iterations, reserved, [&value](String &out) {
+            Serializer s(out);
+            s.reserve(encodedSizeOf(value));
+            s << value;
+        });
+    if (legacy != current || reserved != current) {
+        fprintf(stderr, "%s: encodings differ\n", name);
+        exit(1);
+    }
+    const unsigned long long legacyDecode = decodeLoop<T>(iterations, current, [](Deserializer &d, T &out) {
+            decodeLegacy(d, out);
+        });
+    const unsigned long long decode = decodeLoop<T>(iterations, current, [](Deserializer &d, T &out) {
+            d >> out;
+        });
+
+    const size_t total = current.size() * iterations;
+    printf("%-22s %5.1f MB  encode %6.0f -> %6.0f MB/s (%4.1fx), reserved %6.0f MB/s  decode %6.0f -> %6.0f MB/s (%4.1fx)\n",
+           name, current.size() / (1024.0 * 1024.0),
+           rate(total, legacyEncode), rate(total, encode), encode ? static_cast<double>(legacyEncode) / encode : 0,
+           rate(total, reservedEncode),
+           rate(total, legacyDecode), rate(total, decode), decode ? static_cast<double>(legacyDecode) / decode : 0);
+}
+}
+
+int main(int argc, char **argv)
+{
+    const int iterations = argc > 1 ? atoi(argv[1]) : 10;
+    srand(1);
+
+    List<int> ints(4 * 1024 * 1024);
+    for (size_t i=0; i<ints.size(); ++i)
+        ints[i] = rand();
+    run("List<int>", ints, iterations);
+
+    List<double> doubles(2 * 1024 * 1024);
+    for (size_t i=0; i<doubles.size(); ++i)
+        doubles[i] = rand() / 3.0;
+    run("List<double>", doubles, iterations);
+
+    Map<String, int> strings;
+    for (int i=0; i<200000; ++i)
+        strings[String::format<32>("key%d", rand())] = i;
+    run("Map<String, int>", strings, iterations);
+
+    Map<int, List<unsigned int> > lists;
+    for (int i=0; i<5000; ++i) {
+        List<unsigned int> &list = lists[i];
+        list.resize(rand() % 512);
+        for (size_t j=0; j<list.size(); ++j)
+            list[j] = rand();
+    }
+    run("Map<int, List<uint>>", lists, iterations);
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rct/List.h>
+#include <rct/Rct.h>
+#include <rct/StopWatch.h>
+#include <rct/String.h>
+#include <rct/StringSearch.h>
+
+/*
+ * String searching, case folding and JSON escaping with the portable loops
+ * against the SSE2 and AVX2 ones, on a log to grep through and a list of
+ * paths.
+ */
+
+namespace {
+const char *names[] = { "portable", "sse2", "avx2" };
+
+template <typename Func>
+void run(const char *name, int iterations, Func func)
+{
+    printf("%-32s", name);
+    size_t expected = 0;
+    for (StringSearch::Instructions instructions : { StringSearch::Portable, StringSearch::SSE2, StringSearch::AVX2 }) {
+        if (!StringSearch::setInstructions(instructions)) {
+            printf(" %8s      n/a", names[instructions]);
+            continue;
+        }
+        size_t result = 0;
+        StopWatch sw(StopWatch::Microsecond);
+        for (int i=0; i<iterations; ++i)
+            result += func();
+        printf(" %8s %7.2f ms", names[instructions], sw.elapsed() / 1000.0 / iterations);
+        if (instructions == StringSearch::Portable) {
+            expected = result;
+        } else if (result != expected) {
+            fprintf(stderr, "\n%s: results differ\n", name);
+            exit(1);
+        }
+    }
+    printf("\n");
+}
+}
+
+int main(int argc, char **argv)
+{
+    const int iterations = argc > 1 ? atoi(argv[1]) : 10;
+    const StringSearch::Instructions best = StringSearch::instructions();
+    srand(1);
+
+    const char *levels[] = { "Debug", "Info", "Warning", "Error" };
+    String log;
+    while (log.size() < 16 * 1024 * 1024) {
+        log += String::format<256>("2024-01-%02d %02d:%02d:%02d [%s] Indexed /home/user/src/project/module%d/file%d.cpp in %dms\n",
+                                   rand() % 28 + 1, rand() % 24, rand() % 60, rand() % 60,
+                                   levels[rand() % 4], rand() % 100, rand() % 1000, rand() % 500);
+    }
+
+    List<String> paths;
+    for (int i=0; i<200000; ++i)
+        paths.append(String::format<128>("/home/user/src/Project/Module%d/SubDir%d/File%d.cpp", rand() % 100, rand() % 20, rand() % 1000));
+
+    run("log: count '\\n'", iterations, [&log]() {
+            size_t count = 0;
+            for (size_t pos = log.indexOf('\n'); pos != String::npos; pos = log.indexOf('\n', pos + 1))
+                ++count;
+            return count;
+        });
+    run("log: grep \"[Error]\"", iterations, [&log]() {
+            size_t count = 0;
+            for (size_t pos = log.indexOf("[Error]"); pos != String::npos; pos = log.indexOf("[Error]", pos + 1))
+                ++count;
+            return count;
+        });
+    run("log: grep -i \"warning\"", iterations, [&log]() {
+            const String needle = "warning";
+            size_t count = 0;
+            for (size_t pos = log.indexOf(needle, 0, String::CaseInsensitive); pos != String::npos;
+                 pos = log.indexOf(needle, pos + 1, String::CaseInsensitive))
+                ++count;
+            return count;
+        });
+    run("log: last \"module42\"", iterations, [&log]() {
+            return log.lastIndexOf("module42/file999.cpp");
+        });
+    run("log: toLower", iterations, [&log]() {
+            return log.toLower().size();
+        });
+    run("paths: endsWith -i \".CPP\"", iterations, [&paths]() {
+            size_t count = 0;
+            for (const String &path : paths)
+                count += path.endsWith(String(".CPP"), String::CaseInsensitive);
+            return count;
+        });
+    run("paths: contains -i \"module4\"", iterations, [&paths]() {
+            size_t count = 0;
+            for (const String &path : paths)
+                count += path.contains("module4", String::CaseInsensitive);
+            return count;
+        });
+    run("paths: lastIndexOf '/'", iterations, [&paths]() {
+            size_t total = 0;
+            for (const String &path : paths)
+                total += path.lastIndexOf('/');
+            return total;
+        });
+    run("paths: jsonEscape", iterations, [&paths]() {
+            size_t total = 0;
+            for (const String &path : paths)
+                total += Rct::jsonEscape(path).size();
+            return total;
+        });
+    run("log: jsonEscape", iterations, [&log]() {
+            return Rct::jsonEscape(log).size();
+        });
+    StringSearch::setInstructions(best);
+    return 0;
+}
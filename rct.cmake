@@ -38,6 +38,12 @@ check_cxx_symbol_exists(MSG_NOSIGNAL "sys/types.h;sys/socket.h" HAVE_NOSIGNAL)
 check_cxx_symbol_exists(GetLogicalProcessorInformation "windows.h" HAVE_PROCESSORINFORMATION)
 check_cxx_symbol_exists(SCHED_IDLE "pthread.h" HAVE_SCHEDIDLE)
 check_cxx_symbol_exists(SHM_DEST "sys/types.h;sys/ipc.h;sys/shm.h" HAVE_SHMDEST)
+check_cxx_symbol_exists(accept4 "sys/types.h;sys/socket.h" HAVE_ACCEPT4)
+check_cxx_symbol_exists(memfd_create "sys/mman.h" HAVE_MEMFD_CREATE)
+check_cxx_symbol_exists(eventfd "sys/eventfd.h" HAVE_EVENTFD)
+check_cxx_symbol_exists(TCP_INFO "netinet/tcp.h" HAVE_TCP_INFO)
+check_cxx_symbol_exists(fallocate "fcntl.h" HAVE_FALLOCATE)
+check_cxx_symbol_exists(fdatasync "unistd.h" HAVE_FDATASYNC)
 
 if (CYGWIN)
   message("-- Using win32 FileSystemWatcher")
@@ -115,14 +121,38 @@ else ()
     message("OPENSSL Can't be found. Rct configured without openssl support")
 endif ()
 
+find_path(LZ4_INCLUDE_DIR lz4.h)
+find_library(LZ4_LIBRARY lz4)
+if (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+    set(LZ4_FOUND TRUE)
+    set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_HAVE_LZ4)
+    list(APPEND RCT_SYSTEM_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+else ()
+    message("LZ4 Can't be found. Rct configured without lz4 support")
+endif ()
+
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY zstd)
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+    set(ZSTD_FOUND TRUE)
+    set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_HAVE_ZSTD)
+    list(APPEND RCT_SYSTEM_INCLUDE_DIRS ${ZSTD_INCLUDE_DIR})
+else ()
+    message("ZSTD Can't be found. Rct configured without zstd support")
+endif ()
+
 list(APPEND RCT_INCLUDE_DIRS ${CMAKE_CURRENT_LIST_DIR} ${RCT_INCLUDE_DIR})
 
 set(RCT_SOURCES
   ${RCT_SOURCES}
   ${CMAKE_CURRENT_LIST_DIR}/rct/Buffer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Compression.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Config.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Connection.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ConnectionPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/CpuUsage.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Crc32c.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/DataFile.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Date.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/EventLoop.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/FileSystemWatcher.cpp
@@ -133,12 +163,15 @@ set(RCT_SOURCES
   ${CMAKE_CURRENT_LIST_DIR}/rct/Path.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Plugin.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Rct.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/RecordLog.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ReadWriteLock.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Semaphore.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemory.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemoryChannel.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketClient.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketServer.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/String.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/StringSearch.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Thread.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ThreadPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Timer.cpp
@@ -209,6 +242,12 @@ endif()
 if(OPENSSL_FOUND)
     list(APPEND RCT_LIBRARIES ${OPENSSL_CRYPTO_LIBRARY})
 endif()
+if(LZ4_FOUND)
+    list(APPEND RCT_LIBRARIES ${LZ4_LIBRARY})
+endif()
+if(ZSTD_FOUND)
+    list(APPEND RCT_LIBRARIES ${ZSTD_LIBRARY})
+endif()
 if (CMAKE_SYSTEM_NAME MATCHES "Linux")
   list(APPEND RCT_LIBRARIES dl rt)
 endif ()
@@ -222,7 +261,6 @@ endif ()
 if (NOT RCT_NO_LIBRARY)
     target_link_libraries(rct ${RCT_LIBRARIES})
     set_target_properties(rct PROPERTIES INTERFACE_LINK_LIBRARIES "${RCT_LIBRARIES}")
-    set_target_properties(rct PROPERTIES LINK_INTERFACE_LIBRARIES "${RCT_LIBRARIES}")
 endif ()
 
 if (NOT RCT_NO_INSTALL)
@@ -327,14 +365,22 @@ if (RCT_WITH_TESTS)
 
 endif ()
 
+if (RCT_WITH_BENCHMARKS)
+    add_subdirectory(${CMAKE_CURRENT_LIST_DIR}/benchmarks)
+endif ()
+
 if (NOT RCT_NO_INSTALL)
   install(FILES
     ${CMAKE_CURRENT_BINARY_DIR}/include/rct/rct-config.h
     rct/AES256CBC.h
     rct/Apply.h
     rct/Buffer.h
+    rct/ChunkMessage.h
+    rct/Compression.h
     rct/Config.h
     rct/Connection.h
+    rct/ConnectionPool.h
+    rct/Crc32c.h
     rct/EventLoop.h
     rct/FileSystemWatcher.h
     rct/List.h
@@ -346,6 +392,7 @@ if (NOT RCT_NO_INSTALL)
     rct/Path.h
     rct/Plugin.h
     rct/Point.h
+    rct/PoolAllocator.h
     rct/Process.h
     rct/Rct.h
     rct/ReadLocker.h
@@ -357,13 +404,17 @@ if (NOT RCT_NO_INSTALL)
     rct/Serializer.h
     rct/Set.h
     rct/SharedMemory.h
+    rct/SharedMemoryChannel.h
+    rct/SharedMemoryMessage.h
     rct/SignalSlot.h
     rct/Size.h
     rct/SocketClient.h
     rct/SocketServer.h
     rct/StopWatch.h
     rct/String.h
+    rct/StringSearch.h
     rct/StringTokenizer.h
+    rct/StringView.h
     rct/Thread.h
     rct/ThreadLocal.h
     rct/ThreadPool.h
@@ -6,6 +6,7 @@
 #include <rct/LinkedList.h>
 #include <rct/String.h>
 #include <string.h>
+#include <memory>
 #include <utility>
 
 class Buffer
@@ -107,15 +108,20 @@ public:
     {}
     void push(Buffer &&buf)
     {
-        mBuffers.append(std::forward<Buffer>(buf));
+        mBuffers.append(std::make_shared<Buffer>(std::forward<Buffer>(buf)));
     }
     size_t size() const
     {
         size_t ret = 0;
         for (const auto &buf : mBuffers)
-            ret += buf.size();
+            ret += buf->size();
         return ret - mBufferOffset;
     }
+    void clear()
+    {
+        mBuffers.clear();
+        mBufferOffset = 0;
+    }
     size_t read(void *outPtr, size_t size)
     {
         if (!size)
@@ -125,10 +131,10 @@ public:
         size_t read = 0, remaining = size;
         while (!mBuffers.empty()) {
             const auto &buf = mBuffers.front();
-            const size_t bufferSize = buf.size() - mBufferOffset;
+            const size_t bufferSize = buf->size() - mBufferOffset;
 
             if (remaining <= bufferSize) {
-                memcpy(out + read, buf.data() + mBufferOffset, remaining);
+                memcpy(out + read, buf->data() + mBufferOffset, remaining);
                 if (remaining == bufferSize) {
                     mBufferOffset = 0;
                     mBuffers.pop_front();
@@ -138,7 +144,7 @@ public:
                 read += remaining;
                 break;
             }
-            memcpy(out + read, buf.data() + mBufferOffset, bufferSize);
+            memcpy(out + read, buf->data() + mBufferOffset, bufferSize);
             read += bufferSize;
             mBufferOffset = 0;
             remaining -= bufferSize;
@@ -147,11 +153,41 @@ public:
         }
         return read;
     }
+
+    /**
+     * Consumes \a size bytes and returns a pointer to them. If they're
+     * contiguous in the first buffer no copy is made and \a owner shares
+     * that buffer, otherwise they're copied into a new buffer. The pointer
+     * stays valid for as long as \a owner is alive.
+     */
+    const unsigned char *readShared(size_t size, std::shared_ptr<Buffer> &owner)
+    {
+        assert(size && size <= Buffers::size());
+        const std::shared_ptr<Buffer> &front = mBuffers.front();
+        const size_t bufferSize = front->size() - mBufferOffset;
+        if (size <= bufferSize) {
+            owner = front;
+            const unsigned char *ret = front->data() + mBufferOffset;
+            if (size == bufferSize) {
+                mBufferOffset = 0;
+                mBuffers.pop_front();
+            } else {
+                mBufferOffset += size;
+            }
+            return ret;
+        }
+        owner = std::make_shared<Buffer>();
+        owner->resize(size);
+        const size_t r = read(owner->data(), size);
+        assert(r == size);
+        (void)r;
+        return owner->data();
+    }
 private:
     Buffers(const Buffers &) = delete;
     Buffers &operator=(const Buffers &) = delete;
 
-    LinkedList<Buffer> mBuffers;
+    LinkedList<std::shared_ptr<Buffer> > mBuffers;
     size_t mBufferOffset;
 };
 
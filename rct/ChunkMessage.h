@@ -0,0 +1,69 @@
+#ifndef ChunkMessage_h
+#define ChunkMessage_h
+
+#include <rct/Message.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+
+/**
+ * One piece of a stream sent with Connection::sendStream(). Chunks of a
+ * stream share a stream id and arrive in sequence order, the last one has
+ * isLast() set. They're delivered through Connection::chunk() rather than
+ * Connection::newMessage().
+ */
+class ChunkMessage : public Message
+{
+public:
+    enum { MessageId = ChunkMessageId };
+
+    ChunkMessage(uint32_t streamId = 0, uint32_t sequence = 0, const String &data = String(), bool last = false)
+        : Message(MessageId), mStreamId(streamId), mSequence(sequence), mLast(last), mData(data)
+    {}
+
+    ChunkMessage(uint32_t streamId, uint32_t sequence, const char *data, bool last = false)
+        : ChunkMessage(streamId, sequence, String(data), last)
+    {}
+
+    /**
+     * Doesn't copy \a data, it has to stay alive until the message has been
+     * sent.
+     */
+    ChunkMessage(uint32_t streamId, uint32_t sequence, const StringView &data, bool last)
+        : Message(MessageId), mStreamId(streamId), mSequence(sequence), mLast(last), mView(data)
+    {}
+
+    uint32_t streamId() const { return mStreamId; }
+    uint32_t sequence() const { return mSequence; }
+    bool isLast() const { return mLast; }
+
+    /**
+     * When received over a Connection this points into the receive buffer
+     * which is kept alive by the message.
+     */
+    StringView data() const { return mView.data() ? mView : StringView(mData); }
+
+    virtual size_t encodedSize() const override
+    {
+        return sizeof(mStreamId) + sizeof(mSequence) + sizeof(mLast) + sizeof(uint32_t) + data().size();
+    }
+    virtual void encode(Serializer &s) const override { s << mStreamId << mSequence << mLast << data(); }
+    virtual void decode(Deserializer &d) override
+    {
+        d >> mStreamId >> mSequence >> mLast;
+        mOwner = d.owner();
+        if (mOwner) {
+            d >> mView;
+        } else {
+            d >> mData;
+            mView = StringView();
+        }
+    }
+private:
+    uint32_t mStreamId, mSequence;
+    bool mLast;
+    String mData;
+    StringView mView;
+    std::shared_ptr<Buffer> mOwner;
+};
+
+#endif
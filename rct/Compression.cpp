@@ -0,0 +1,221 @@
+#include "Compression.h"
+
+#include <assert.h>
+#include <string.h>
+#include <atomic>
+
+#ifdef RCT_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RCT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "rct/Log.h"
+
+namespace {
+std::atomic<size_t> sMaxUncompressedSize(256 * 1024 * 1024);
+
+struct Entry
+{
+    Compression::Compressor compressor;
+    Compression::Decompressor decompressor;
+};
+
+#ifdef RCT_HAVE_ZLIB
+bool zlibCompress(const char *data, size_t size, int level, String &out)
+{
+    const String compressed = String::compress(data, size, level);
+    if (compressed.isEmpty())
+        return false;
+    out.append(compressed);
+    return true;
+}
+
+bool zlibUncompress(const char *data, size_t size, String &out)
+{
+    out = String::uncompress(data, size, Compression::maxUncompressedSize());
+    return !out.isEmpty();
+}
+#endif
+
+#if defined(RCT_HAVE_LZ4) || defined(RCT_HAVE_ZSTD)
+// LZ4 and Zstd payloads start with the uncompressed size
+void appendSize(String &out, uint32_t size)
+{
+    out.append(reinterpret_cast<const char *>(&size), sizeof(size));
+}
+
+bool readSize(const char *&data, size_t &size, uint32_t &uncompressed)
+{
+    if (size < sizeof(uncompressed))
+        return false;
+    memcpy(&uncompressed, data, sizeof(uncompressed));
+    if (uncompressed > Compression::maxUncompressedSize()) {
+        error() << "Uncompressed size" << uncompressed << "exceeds" << Compression::maxUncompressedSize();
+        return false;
+    }
+    data += sizeof(uncompressed);
+    size -= sizeof(uncompressed);
+    return true;
+}
+#endif
+
+#ifdef RCT_HAVE_LZ4
+bool lz4Compress(const char *data, size_t size, int level, String &out)
+{
+    if (size > static_cast<size_t>(LZ4_MAX_INPUT_SIZE))
+        return false;
+    const size_t pos = out.size();
+    appendSize(out, size);
+    const int bound = LZ4_compressBound(size);
+    out.resize(pos + sizeof(uint32_t) + bound);
+    const int ret = LZ4_compress_fast(data, out.data() + pos + sizeof(uint32_t), size, bound, level < 1 ? 1 : level);
+    if (ret <= 0) {
+        out.resize(pos);
+        return false;
+    }
+    out.resize(pos + sizeof(uint32_t) + ret);
+    return true;
+}
+
+bool lz4Uncompress(const char *data, size_t size, String &out)
+{
+    uint32_t uncompressed;
+    if (!readSize(data, size, uncompressed))
+        return false;
+    out.resize(uncompressed);
+    const int ret = LZ4_decompress_safe(data, out.data(), size, uncompressed);
+    return ret >= 0 && static_cast<uint32_t>(ret) == uncompressed;
+}
+#endif
+
+#ifdef RCT_HAVE_ZSTD
+bool zstdCompress(const char *data, size_t size, int level, String &out)
+{
+    const size_t pos = out.size();
+    appendSize(out, size);
+    const size_t bound = ZSTD_compressBound(size);
+    out.resize(pos + sizeof(uint32_t) + bound);
+    const size_t ret = ZSTD_compress(out.data() + pos + sizeof(uint32_t), bound, data, size, level);
+    if (ZSTD_isError(ret)) {
+        out.resize(pos);
+        return false;
+    }
+    out.resize(pos + sizeof(uint32_t) + ret);
+    return true;
+}
+
+bool zstdUncompress(const char *data, size_t size, String &out)
+{
+    uint32_t uncompressed;
+    if (!readSize(data, size, uncompressed))
+        return false;
+    out.resize(uncompressed);
+    const size_t ret = ZSTD_decompress(out.data(), uncompressed, data, size);
+    return !ZSTD_isError(ret) && ret == uncompressed;
+}
+#endif
+
+// entries don't change once they're set, so they're used without locking
+struct Registry
+{
+    Registry()
+    {
+        for (std::atomic<const Entry *> &e : entries)
+            e.store(nullptr, std::memory_order_relaxed);
+#ifdef RCT_HAVE_ZLIB
+        entries[Compression::Zlib].store(new Entry { zlibCompress, zlibUncompress }, std::memory_order_relaxed);
+#endif
+#ifdef RCT_HAVE_LZ4
+        entries[Compression::LZ4].store(new Entry { lz4Compress, lz4Uncompress }, std::memory_order_relaxed);
+#endif
+#ifdef RCT_HAVE_ZSTD
+        entries[Compression::Zstd].store(new Entry { zstdCompress, zstdUncompress }, std::memory_order_relaxed);
+#endif
+    }
+    ~Registry()
+    {
+        for (std::atomic<const Entry *> &e : entries)
+            delete e.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<const Entry *> entries[256];
+};
+
+Registry &registry()
+{
+    static Registry sRegistry;
+    return sRegistry;
+}
+
+const Entry &entry(uint8_t codec)
+{
+    static const Entry sNone;
+    const Entry *e = registry().entries[codec].load(std::memory_order_acquire);
+    return e ? *e : sNone;
+}
+}
+
+bool Compression::registerCodec(uint8_t codec, const Compressor &compressor, const Decompressor &decompressor)
+{
+    assert(codec != None);
+    assert(compressor && decompressor);
+    const Entry *e = new Entry { compressor, decompressor };
+    const Entry *expected = nullptr;
+    if (registry().entries[codec].compare_exchange_strong(expected, e, std::memory_order_acq_rel))
+        return true;
+    delete e;
+    error() << "Compression codec" << static_cast<int>(codec) << "is already registered";
+    return false;
+}
+
+bool Compression::isSupported(uint8_t codec)
+{
+    const Entry &e = entry(codec);
+    return e.compressor && e.decompressor;
+}
+
+void Compression::setMaxUncompressedSize(size_t size)
+{
+    sMaxUncompressedSize.store(size, std::memory_order_relaxed);
+}
+
+size_t Compression::maxUncompressedSize()
+{
+    return sMaxUncompressedSize.load(std::memory_order_relaxed);
+}
+
+bool Compression::compress(uint8_t codec, int level, const char *data, size_t size, String &out)
+{
+    const Entry &e = entry(codec);
+    return e.compressor && e.compressor(data, size, level, out);
+}
+
+bool Compression::uncompress(uint8_t codec, const char *data, size_t size, String &out)
+{
+    const Entry &e = entry(codec);
+    if (!e.decompressor) {
+        error() << "Unsupported compression codec" << static_cast<int>(codec);
+        return false;
+    }
+    return e.decompressor(data, size, out);
+}
+
+bool Compression::compress(const Policy &policy, const char *data, size_t size, String &out)
+{
+    if (size < policy.minSize || policy.codec == None)
+        return false;
+    out.clear();
+    out.append(static_cast<char>(policy.codec));
+    if (!compress(policy.codec, policy.level, data, size, out))
+        return false;
+    return out.size() < size * policy.maxRatio;
+}
+
+bool Compression::uncompressTagged(const char *data, size_t size, String &out)
+{
+    if (!size)
+        return false;
+    return uncompress(static_cast<uint8_t>(*data), data + 1, size - 1, out);
+}
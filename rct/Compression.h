@@ -0,0 +1,76 @@
+#ifndef Compression_h
+#define Compression_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+#include <rct/String.h>
+
+/**
+ * Registry of the codecs messages can be compressed with. Zlib is always
+ * available when rct is built with zlib, LZ4 and Zstd when they were found
+ * at configure time. Custom codecs can be added with registerCodec() using
+ * ids from UserCodec and up.
+ */
+class Compression
+{
+public:
+    enum Codec {
+        None = 0,
+        Zlib = 1,
+        LZ4 = 2,
+        Zstd = 3,
+        UserCodec = 128
+    };
+
+    /**
+     * Decides if and how a message payload is compressed. Payloads smaller
+     * than minSize are sent as is and so are payloads that don't compress
+     * to less than maxRatio of their size. What level means depends on the
+     * codec, for LZ4 it's the acceleration factor.
+     */
+    struct Policy {
+        uint8_t codec = Zlib;
+        int level = 6;
+        size_t minSize = 256;
+        double maxRatio = 0.9;
+    };
+
+    /**
+     * Compressors append to \a out, decompressors replace its contents.
+     * Both return false on failure.
+     */
+    typedef std::function<bool(const char *data, size_t size, int level, String &out)> Compressor;
+    typedef std::function<bool(const char *data, size_t size, String &out)> Decompressor;
+
+    /**
+     * Codecs can't be replaced once registered, registering one for a
+     * \a codec that's taken fails.
+     */
+    static bool registerCodec(uint8_t codec, const Compressor &compressor, const Decompressor &decompressor);
+    static bool isSupported(uint8_t codec);
+
+    static bool compress(uint8_t codec, int level, const char *data, size_t size, String &out);
+    static bool uncompress(uint8_t codec, const char *data, size_t size, String &out);
+
+    /**
+     * The built-in decompressors fail rather than produce more than this
+     * many bytes, the size comes from the peer. Defaults to 256MB.
+     */
+    static void setMaxUncompressedSize(size_t size);
+    static size_t maxUncompressedSize();
+
+    /**
+     * Compresses \a size bytes at \a data according to \a policy into
+     * \a out, prefixed with the codec id. Returns false if the data should
+     * be sent uncompressed.
+     */
+    static bool compress(const Policy &policy, const char *data, size_t size, String &out);
+    /**
+     * Reverses compress(const Policy &, ...).
+     */
+    static bool uncompressTagged(const char *data, size_t size, String &out);
+};
+
+#endif
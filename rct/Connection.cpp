@@ -2,12 +2,15 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <algorithm>
 #include <utility>
 
 #include "EventLoop.h"
 #include "Message.h"
+#include "Rct.h"
 #include "Serializer.h"
-#include "StackBuffer.h"
+#include "SharedMemoryChannel.h"
+#include "SharedMemoryMessage.h"
 #include "Timer.h"
 #include "rct/FinishMessage.h"
 #include "rct/SocketClient.h"
@@ -15,7 +18,10 @@
 
 Connection::Connection(int version)
     : mPendingRead(0), mPendingWrite(0), mTimeoutTimer(0), mCheckTimer(0), mFinishStatus(0),
-      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false)
+      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false), mStreamPumpScheduled(false),
+      mMaxIncomingStreams(1024), mNextStreamId(1), mNextRequestId(1), mMaxPendingRequests(0), mCoalesce(false),
+      mFlushScheduled(false), mCoalesceMaxSize(0), mCoalesceDelayUs(0), mFlushTimer(0),
+      mHasCompressionPolicy(false), mPeerTraceCapable(false), mSharedMemoryRead(false), mSharedMemoryWrite(false)
 {
 }
 
@@ -26,13 +32,33 @@ Connection::~Connection()
             eventLoop->unregisterTimer(mTimeoutTimer);
         if (mCheckTimer)
             eventLoop->unregisterTimer(mCheckTimer);
+        if (mFlushTimer)
+            eventLoop->unregisterTimer(mFlushTimer);
+        if (mPacing && mPacing->timer)
+            eventLoop->unregisterTimer(mPacing->timer);
     }
+    if (mPacing) {
+        for (const PacedFrame &paced : mPacing->queue)
+            mBatch.append(*paced.frame);
+    }
+    // detach before flushing, a failing write emits error() and we can't
+    // hand out shared_from_this() while being destroyed
+    const std::shared_ptr<SocketClient> client = mSocketClient;
     disconnect();
+    if (client && !mBatch.isEmpty()) {
+        if (mSharedMemoryWrite) {
+            mSharedMemory->write(mBatch.constData(), mBatch.size());
+        } else {
+            client->write(mBatch);
+        }
+    }
+    closeSharedMemory();
 }
 
 void Connection::disconnect()
 {
     if (mSocketClient) {
+        mSocketClient->connected().disconnect();
         mSocketClient->disconnected().disconnect();
         mSocketClient->readyRead().disconnect();
         mSocketClient->bytesWritten().disconnect();
@@ -47,6 +73,8 @@ void Connection::connect(const std::shared_ptr<SocketClient> &client)
     mSocketClient = client;
     mIsConnected = true;
     assert(client->isConnected());
+    if (mStatistics && !client->isStatisticsEnabled())
+        client->setStatisticsEnabled(true);
     mSocketClient->disconnected().connect(std::bind(&Connection::onClientDisconnected, this, std::placeholders::_1));
     mSocketClient->readyRead().connect(std::bind(&Connection::onDataAvailable, this, std::placeholders::_1, std::placeholders::_2));
     mSocketClient->bytesWritten().connect(std::bind(&Connection::onDataWritten, this, std::placeholders::_1, std::placeholders::_2));
@@ -79,6 +107,8 @@ bool Connection::connectUnix(const Path &socketFile, int timeout)
     mSocketClient->readyRead().connect(std::bind(&Connection::onDataAvailable, this, std::placeholders::_1, std::placeholders::_2));
     mSocketClient->bytesWritten().connect(std::bind(&Connection::onDataWritten, this, std::placeholders::_1, std::placeholders::_2));
     mSocketClient->error().connect(std::bind(&Connection::onSocketError, this, std::placeholders::_1, std::placeholders::_2));
+    if (mStatistics)
+        mSocketClient->setStatisticsEnabled(true);
     if (!mSocketClient->connect(socketFile)) {
         mSocketClient.reset();
         return false;
@@ -105,6 +135,8 @@ bool Connection::connectTcp(const String &host, uint16_t port, int timeout)
     mSocketClient->readyRead().connect(std::bind(&Connection::onDataAvailable, this, std::placeholders::_1, std::placeholders::_2));
     mSocketClient->bytesWritten().connect(std::bind(&Connection::onDataWritten, this, std::placeholders::_1, std::placeholders::_2));
     mSocketClient->error().connect(std::bind(&Connection::onSocketError, this, std::placeholders::_1, std::placeholders::_2));
+    if (mStatistics)
+        mSocketClient->setStatisticsEnabled(true);
     if (!mSocketClient->connect(host, port)) {
         mSocketClient.reset();
         return false;
@@ -117,12 +149,42 @@ int Connection::pendingWrite() const
     return mPendingWrite;
 }
 
-void Connection::onDataAvailable(const std::shared_ptr<SocketClient> &client, Buffer&& buf)
+void Connection::onDataAvailable(const std::shared_ptr<SocketClient> &, Buffer&& buf)
+{
+#ifndef _WIN32
+    if (mSharedMemoryRead) {
+        // messages come through shared memory now, the socket only
+        // carries file descriptors
+        if (mAwaitingFileDescriptors && mSocketClient->hasFileDescriptors())
+            readMessages(Buffer());
+        return;
+    }
+#endif
+    readMessages(std::forward<Buffer>(buf));
+}
+
+void Connection::readMessages(Buffer &&buf)
 {
     auto that = shared_from_this();
+    const uint64_t readAt = mTracing ? Rct::monoUs() : 0;
     while (true) {
-        if (!buf.empty())
+        if (!buf.empty()) {
+            if (mTracing && !mBuffers.size())
+                mTracing->unreadSince = readAt;
             mBuffers.push(std::forward<Buffer>(buf));
+        }
+
+#ifndef _WIN32
+        if (mAwaitingFileDescriptors) {
+            if (!mSocketClient->hasFileDescriptors())
+                break;
+            std::shared_ptr<Message> message = std::move(mAwaitingFileDescriptors);
+            mAwaitingFileDescriptors.reset();
+            message->mFileDescriptors = mSocketClient->takeFileDescriptors();
+            dispatch(message);
+            continue;
+        }
+#endif
 
         unsigned int available = mBuffers.size();
         if (!available)
@@ -137,6 +199,8 @@ void Connection::onDataAvailable(const std::shared_ptr<SocketClient> &client, Bu
             const int read = mBuffers.read(b, 4);
             assert(read == 4);
             mPendingRead = pending;
+            if (mTracing)
+                mTracing->frameRead = mTracing->unreadSince;
             assert(mPendingRead > 0);
             available -= read;
         }
@@ -144,39 +208,196 @@ void Connection::onDataAvailable(const std::shared_ptr<SocketClient> &client, Bu
         if (available < static_cast<unsigned int>(mPendingRead))
             break;
 
-        StackBuffer<1024 * 16> buffer(mPendingRead);
-        const int read = mBuffers.read(buffer.buffer(), mPendingRead);
-        assert(read == mPendingRead);
+        // decode straight out of the receive buffer when the frame is contiguous
+        std::shared_ptr<Buffer> frame;
+        const char *data = reinterpret_cast<const char *>(mBuffers.readShared(mPendingRead, frame));
+        const int read = mPendingRead;
         mPendingRead = 0;
         Message::MessageError error;
-        std::shared_ptr<Message> message = Message::create(mVersion, buffer, read, &error);
+        Message::TraceStamps stamps;
+        MessageTrace trace;
+        if (mTracing) {
+            trace.read = mTracing->frameRead;
+            trace.framed = Rct::monoUs();
+            // what's left arrived with this read at the latest
+            mTracing->unreadSince = readAt;
+        }
+        std::shared_ptr<Message> message = Message::create(mVersion, frame, data, read, &error, &stamps);
+        if (message && message->messageId() == ChunkMessage::MessageId) {
+            std::shared_ptr<ChunkMessage> chunk = std::static_pointer_cast<ChunkMessage>(message);
+            if (validateChunk(*chunk, error)) {
+                mChunk(chunk, that);
+                continue;
+            }
+            message.reset();
+        }
         if (message) {
-            if (message->messageId() == FinishMessage::MessageId) {
-                mFinishStatus = std::static_pointer_cast<FinishMessage>(message)->status();
-                mFinished(that, mFinishStatus);
+#ifndef _WIN32
+            if (message->flags() & Message::FileDescriptors) {
+                if (mSharedMemoryRead && !mSocketClient->hasFileDescriptors()) {
+                    // they're sent over the socket and may still be on their way
+                    mAwaitingFileDescriptors = message;
+                    break;
+                }
+                message->mFileDescriptors = mSocketClient->takeFileDescriptors();
+            }
+#endif
+            if (message->mFlags & Message::TraceCapable)
+                mPeerTraceCapable = true;
+            if (mTracing && message->mFlags & Message::Traced) {
+                trace.decoded = Rct::monoUs();
+                trace.incoming = true;
+                trace.messageId = message->messageId();
+                trace.id = stamps.id;
+                trace.size = read + sizeof(uint32_t);
+                trace.sent = stamps.sent;
+                trace.encoded = stamps.encoded;
+                dispatch(message, &trace);
             } else {
-                newMessage()(message, that);
+                dispatch(message);
             }
         } else if (mErrorHandler) {
-            mErrorHandler(client, std::move(error));
+            mErrorHandler(mSocketClient, std::move(error));
         } else {
             ::error() << "Unable to create message from data" << error.type << error.text << read;
         }
-        if (!message)
-            client->close();
+        if (!message && mSocketClient)
+            mSocketClient->close();
+    }
+}
+
+void Connection::dispatch(const std::shared_ptr<Message> &message, MessageTrace *trace)
+{
+    if (mStatistics)
+        ++mStatistics->messagesReceived;
+    if (trace)
+        trace->dispatched = Rct::monoUs();
+    if (message->messageId() == FinishMessage::MessageId) {
+        mFinishStatus = std::static_pointer_cast<FinishMessage>(message)->status();
+        mFinished(shared_from_this(), mFinishStatus);
+    } else if (message->messageId() == SharedMemoryMessage::MessageId) {
+        onSharedMemoryMessage(std::static_pointer_cast<SharedMemoryMessage>(message));
+    } else if (message->isReply()) {
+        onReply(message);
+    } else {
+        newMessage()(message, shared_from_this());
+    }
+    if (trace && mTracing) {
+        trace->handled = Rct::monoUs();
+        if (mTracing->sameClock == -1) {
+            mTracing->sameClock = mSharedMemoryRead || mSocketClient->mode() & SocketClient::Unix;
+            if (!mTracing->sameClock) {
+                const String peer = mSocketClient->peerName();
+                mTracing->sameClock = peer.startsWith("127.") || peer == "::1";
+            }
+        }
+        trace->sameClock = mTracing->sameClock;
+        mTracing->handler(shared_from_this(), *trace);
     }
 }
 
+bool Connection::validateChunk(const ChunkMessage &chunk, Message::MessageError &error)
+{
+    if (!chunk.sequence() && !chunk.isLast() && mMaxIncomingStreams && mIncomingStreams.size() >= mMaxIncomingStreams
+        && !mIncomingStreams.contains(chunk.streamId())) {
+        error.type = Message::Message_SequenceError;
+        error.text = String::format<128>("Too many open streams, stream %u would be %zu",
+                                         chunk.streamId(), mIncomingStreams.size() + 1);
+        return false;
+    }
+    uint32_t &expected = mIncomingStreams[chunk.streamId()];
+    if (chunk.sequence() != expected) {
+        error.type = Message::Message_SequenceError;
+        error.text = String::format<128>("Unexpected chunk for stream %u. Got sequence %u, expected %u",
+                                         chunk.streamId(), chunk.sequence(), expected);
+        mIncomingStreams.remove(chunk.streamId());
+        return false;
+    }
+    if (chunk.isLast()) {
+        mIncomingStreams.remove(chunk.streamId());
+    } else {
+        ++expected;
+    }
+    return true;
+}
+
 void Connection::onDataWritten(const std::shared_ptr<SocketClient>&, int bytes)
 {
     assert(mPendingWrite >= bytes);
     mPendingWrite -= bytes;
+    if (mTracing)
+        traceWritten(bytes);
     // ::error() << "wrote some bytes" << mPendingWrite << bytes;
+    if (!mOutgoingStreams.isEmpty())
+        schedulePumpStreams();
     if (!mPendingWrite) {
         mSendFinished(shared_from_this());
     }
 }
 
+uint32_t Connection::sendStream(const StreamProducer &producer, size_t chunkSize, int maxInFlight)
+{
+    assert(producer);
+    assert(chunkSize > 0 && maxInFlight > 0);
+    if (!isConnected()) {
+        warning("Trying to send stream to unconnected client");
+        return 0;
+    }
+    std::shared_ptr<OutgoingStream> stream = std::make_shared<OutgoingStream>();
+    stream->id = mNextStreamId++;
+    if (!mNextStreamId)
+        mNextStreamId = 1;
+    stream->sequence = 0;
+    stream->chunkSize = chunkSize;
+    stream->maxInFlight = maxInFlight;
+    stream->producer = producer;
+    mOutgoingStreams.append(stream);
+    schedulePumpStreams();
+    return stream->id;
+}
+
+void Connection::schedulePumpStreams()
+{
+    // Bytes written are reported from inside SocketClient::write() so we
+    // can't send from there
+    if (mStreamPumpScheduled)
+        return;
+    mStreamPumpScheduled = true;
+    std::weak_ptr<Connection> weak = shared_from_this();
+    EventLoop::eventLoop()->callLater([weak]() {
+            if (std::shared_ptr<Connection> that = weak.lock()) {
+                that->mStreamPumpScheduled = false;
+                that->pumpStreams();
+            }
+        });
+}
+
+void Connection::pumpStreams()
+{
+    std::shared_ptr<Connection> that = shared_from_this();
+    bool progress = true;
+    while (progress && !mOutgoingStreams.isEmpty()) {
+        progress = false;
+        const List<std::shared_ptr<OutgoingStream> > streams = mOutgoingStreams;
+        for (const std::shared_ptr<OutgoingStream> &stream : streams) {
+            if (static_cast<size_t>(mPendingWrite) >= stream->chunkSize * stream->maxInFlight)
+                continue;
+            stream->buffer.clear();
+            const bool more = stream->producer(stream->buffer, stream->chunkSize);
+            assert(!more || !stream->buffer.isEmpty());
+            const ChunkMessage chunk(stream->id, stream->sequence++, StringView(stream->buffer), !more);
+            const bool sent = send(chunk);
+            if (!more || !sent) {
+                mOutgoingStreams.remove(stream);
+            } else {
+                progress = true;
+            }
+        }
+        if (!isConnected())
+            mOutgoingStreams.clear();
+    }
+}
+
 class SocketClientBuffer : public Serializer::Buffer
 {
 public:
@@ -202,7 +423,35 @@ private:
     int mWritten;
 };
 
+class SharedMemoryChannelBuffer : public Serializer::Buffer
+{
+public:
+    SharedMemoryChannelBuffer(SharedMemoryChannel *channel)
+        : mChannel(channel), mWritten(0)
+    {}
+
+    virtual bool write(const void *data, int len) override
+    {
+        mChannel->write(data, len);
+        mWritten += len;
+        return true;
+    }
+
+    virtual int pos() const override
+    {
+        return mWritten;
+    }
+private:
+    SharedMemoryChannel *mChannel;
+    int mWritten;
+};
+
 bool Connection::send(const Message &message)
+{
+    return send(message, 0);
+}
+
+bool Connection::send(const Message &message, uint32_t requestId)
 {
     // ::error() << getpid() << "sending message" << static_cast<int>(message.messageId());
     if (!mSocketClient || !mSocketClient->isConnected()) {
@@ -213,25 +462,649 @@ bool Connection::send(const Message &message)
         return false;
     }
 
+    Message::TraceStamps stamps;
+    if (mTracing && mPeerTraceCapable && !--mTracing->countdown) {
+        mTracing->countdown = mTracing->interval;
+        stamps.id = mTracing->nextId++;
+        stamps.sent = Rct::monoUs();
+    }
+
     mAboutToSend(shared_from_this(), &message);
 
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     const size_t size = String::npos;
 #else
-    const size_t size = message.encodedSize();
+    const size_t size = message.encodedValueSize();
 #endif
 
-    if (size == String::npos || message.mFlags & Message::MessageCache) {
+    const Compression::Policy *policy = compressionPolicy();
+    // the cached frame can't carry our per-connection flags
+    if (message.mFlags & Message::MessageCache && !requestId && !policy && !mTracing)
+        return sendEncoded(nullptr, message.encodeShared(mVersion));
+    if (mStatistics)
+        ++mStatistics->messagesSent;
+
+    uint8_t flags = message.mFlags & ~Message::TransportFlags;
+    if (requestId)
+        flags |= Message::Correlated;
+    if (mTracing)
+        flags |= Message::TraceCapable;
+
+    if (size == String::npos || message.mFlags & (Message::MessageCache | Message::Compressed)
+        || policy || Message::hasCompressionPolicy(message.mMessageId) || mPacing || stamps.id) {
         String header, value;
-        message.prepare(mVersion, header, value);
+        message.prepare(mVersion, header, value, policy);
+        if (stamps.id) {
+            flags |= Message::Traced;
+            stamps.encoded = Rct::monoUs();
+        }
+        if (flags & (Message::Correlated | Message::Traced | Message::TraceCapable)) {
+            header.clear();
+            Serializer serializer(header);
+            message.encodeHeader(serializer, value.size(), mVersion,
+                                 message.mPreparedFlags | (flags & (Message::Correlated | Message::Traced | Message::TraceCapable)),
+                                 requestId, stamps.id ? &stamps : nullptr);
+        }
         mPendingWrite += header.size() + value.size();
-        assert(size == String::npos || size == (header.size() + value.size() - 4));
-        return (mSocketClient->write(header) && (value.empty() || mSocketClient->write(value)));
+        if (stamps.id)
+            traceSent(stamps, message.messageId(), header.size() + value.size());
+        assert(size == String::npos || message.mPreparedFlags & Message::Compressed || size == value.size());
+        if (mPacing) {
+            header.append(value);
+            return pace(std::make_shared<const String>(std::move(header)));
+        }
+        if (stamps.id) {
+            // one write, a separate small header would skew what we measure
+            header.append(value);
+            return writeData(header);
+        }
+        return (writeData(header) && (value.empty() || writeData(value)));
+    } else if (mCoalesce) {
+        mPendingWrite += (size + Message::headerExtra(flags)) + sizeof(int);
+        {
+            Serializer serializer(mBatch);
+            message.encodeHeader(serializer, size, mVersion, flags, requestId);
+            message.encode(serializer);
+        }
+        if (mBatch.size() >= mCoalesceMaxSize)
+            return flush();
+        scheduleFlush();
+        return true;
     } else {
-        mPendingWrite += (size + Message::HeaderExtra) + sizeof(int);
-        Serializer serializer(std::unique_ptr<SocketClientBuffer>(new SocketClientBuffer(mSocketClient)));
-        message.encodeHeader(serializer, size, mVersion);
+        mPendingWrite += (size + Message::headerExtra(flags)) + sizeof(int);
+        std::unique_ptr<Serializer::Buffer> buffer;
+        if (mSharedMemoryWrite) {
+            buffer.reset(new SharedMemoryChannelBuffer(mSharedMemory.get()));
+        } else {
+            buffer.reset(new SocketClientBuffer(mSocketClient));
+        }
+        Serializer serializer(std::move(buffer));
+        message.encodeHeader(serializer, size, mVersion, flags, requestId);
         message.encode(serializer);
+        if (mSharedMemoryWrite)
+            sharedMemoryWritten();
         return !serializer.hasError();
     }
 }
+
+bool Connection::writeData(const String &data)
+{
+    if (!mCoalesce)
+        return writeOut(data);
+    mBatch.append(data);
+    if (mBatch.size() >= mCoalesceMaxSize)
+        return flush();
+    scheduleFlush();
+    return true;
+}
+
+void Connection::setWriteCoalescing(bool on, size_t maxBatchSize, int delayUs)
+{
+    if (!on)
+        flush();
+    mCoalesce = on;
+    mCoalesceMaxSize = maxBatchSize;
+    mCoalesceDelayUs = delayUs;
+}
+
+void Connection::scheduleFlush()
+{
+    if (mFlushScheduled)
+        return;
+    mFlushScheduled = true;
+    std::weak_ptr<Connection> weak = shared_from_this();
+    auto callback = [weak]() {
+        if (std::shared_ptr<Connection> that = weak.lock()) {
+            that->mFlushTimer = 0;
+            that->flush();
+        }
+    };
+    if (mCoalesceDelayUs > 0) {
+        mFlushTimer = EventLoop::eventLoop()->registerTimer([callback](int) { callback(); },
+                                                            (mCoalesceDelayUs + 999) / 1000, Timer::SingleShot);
+    } else {
+        EventLoop::eventLoop()->callLater(std::move(callback));
+    }
+}
+
+bool Connection::flush()
+{
+    mFlushScheduled = false;
+    if (mFlushTimer) {
+        EventLoop::eventLoop()->unregisterTimer(mFlushTimer);
+        mFlushTimer = 0;
+    }
+    if (mBatch.isEmpty())
+        return true;
+    if (!mSocketClient || !mSocketClient->isConnected()) {
+        assert(mPendingWrite >= static_cast<int>(mBatch.size()));
+        mPendingWrite -= mBatch.size();
+        mBatch.clear();
+        return false;
+    }
+    String batch;
+    std::swap(batch, mBatch);
+    return writeOut(batch);
+}
+
+void Connection::setRateLimit(size_t bytesPerSecond, size_t messagesPerSecond, size_t burstBytes, size_t burstMessages)
+{
+    if (!bytesPerSecond && !messagesPerSecond) {
+        if (mPacing) {
+            if (mPacing->timer)
+                EventLoop::eventLoop()->unregisterTimer(mPacing->timer);
+            releasePaced(true);
+            mPacing.reset();
+        }
+        return;
+    }
+    if (!mPacing) {
+        mPacing.reset(new Pacing);
+        mPacing->refilled = mPacing->windowStart = Rct::monoMs();
+    }
+    mPacing->bytes.rate = bytesPerSecond;
+    mPacing->bytes.burst = mPacing->bytes.tokens = burstBytes ? burstBytes : bytesPerSecond;
+    mPacing->messages.rate = messagesPerSecond;
+    mPacing->messages.burst = mPacing->messages.tokens = burstMessages ? burstMessages : messagesPerSecond;
+    releasePaced(false);
+}
+
+Connection::PacingStats Connection::pacingStats() const
+{
+    if (!mPacing)
+        return PacingStats();
+    PacingStats ret = mPacing->stats;
+    ret.queuedMessages = mPacing->queue.size();
+    if (!mPacing->queue.empty())
+        ret.queueDelay = Rct::monoMs() - mPacing->queue.front().queued;
+    return ret;
+}
+
+bool Connection::takePacingTokens(size_t bytes)
+{
+    const uint64_t now = Rct::monoMs();
+    const double elapsed = now - mPacing->refilled;
+    mPacing->refilled = now;
+    for (TokenBucket *bucket : { &mPacing->bytes, &mPacing->messages })
+        bucket->tokens = std::min(bucket->burst, bucket->tokens + elapsed * bucket->rate / 1000.0);
+
+    // frames bigger than the burst go out once the bucket is full and
+    // leave it in debt
+    if (mPacing->bytes.rate && mPacing->bytes.tokens < std::min<double>(bytes, mPacing->bytes.burst))
+        return false;
+    if (mPacing->messages.rate && mPacing->messages.tokens < 1.0)
+        return false;
+    if (mPacing->bytes.rate)
+        mPacing->bytes.tokens -= bytes;
+    if (mPacing->messages.rate)
+        mPacing->messages.tokens -= 1.0;
+
+    // measure what actually went out, per second
+    if (now - mPacing->windowStart >= 1000) {
+        const double seconds = (now - mPacing->windowStart) / 1000.0;
+        mPacing->stats.bytesPerSecond = mPacing->windowBytes / seconds;
+        mPacing->stats.messagesPerSecond = mPacing->windowMessages / seconds;
+        mPacing->windowStart = now;
+        mPacing->windowBytes = mPacing->windowMessages = 0;
+    }
+    mPacing->windowBytes += bytes;
+    ++mPacing->windowMessages;
+    return true;
+}
+
+bool Connection::pace(const std::shared_ptr<const String> &frame)
+{
+    if (mPacing->queue.empty() && takePacingTokens(frame->size()))
+        return writeData(*frame);
+    mPacing->queue.push_back({ frame, Rct::monoMs() });
+    mPacing->stats.queuedBytes += frame->size();
+    ++mPacing->stats.delayedMessages;
+    schedulePacing();
+    return true;
+}
+
+void Connection::schedulePacing()
+{
+    if (mPacing->timer || mPacing->queue.empty())
+        return;
+    // wait until the bucket that's short has refilled enough for the next frame
+    const size_t bytes = mPacing->queue.front().frame->size();
+    double wait = 0;
+    if (mPacing->bytes.rate)
+        wait = (std::min<double>(bytes, mPacing->bytes.burst) - mPacing->bytes.tokens) * 1000.0 / mPacing->bytes.rate;
+    if (mPacing->messages.rate)
+        wait = std::max(wait, (1.0 - mPacing->messages.tokens) * 1000.0 / mPacing->messages.rate);
+    std::weak_ptr<Connection> weak = shared_from_this();
+    mPacing->timer = EventLoop::eventLoop()->registerTimer([weak](int) {
+            if (std::shared_ptr<Connection> that = weak.lock()) {
+                that->mPacing->timer = 0;
+                that->releasePaced(false);
+            }
+        }, std::max(1, static_cast<int>(wait + 0.999)), Timer::SingleShot);
+}
+
+void Connection::releasePaced(bool all)
+{
+    const uint64_t now = Rct::monoMs();
+    while (!mPacing->queue.empty()) {
+        const PacedFrame &paced = mPacing->queue.front();
+        if (!all && !takePacingTokens(paced.frame->size()))
+            break;
+        const std::shared_ptr<const String> frame = paced.frame;
+        mPacing->stats.queuedBytes -= frame->size();
+        mPacing->stats.totalDelay += now - paced.queued;
+        mPacing->queue.pop_front();
+        if (!writeData(*frame)) {
+            // none of it will be written
+            mPendingWrite -= mPacing->stats.queuedBytes;
+            mPacing->queue.clear();
+            mPacing->stats.queuedBytes = 0;
+            return;
+        }
+    }
+    schedulePacing();
+}
+
+void Connection::setTracing(double sampleRate, const TraceHandler &handler)
+{
+    if (sampleRate <= 0 || !handler) {
+        mTracing.reset();
+        return;
+    }
+    if (!mTracing) {
+        mTracing.reset(new Tracing);
+        // whatever is buffered started arriving before now
+        mTracing->unreadSince = mTracing->frameRead = Rct::monoUs();
+    }
+    mTracing->handler = handler;
+    mTracing->interval = mTracing->countdown = std::max<uint32_t>(1, static_cast<uint32_t>(1.0 / std::min(sampleRate, 1.0) + 0.5));
+}
+
+void Connection::traceSent(const Message::TraceStamps &stamps, uint8_t messageId, size_t size)
+{
+    MessageTrace trace;
+    trace.messageId = messageId;
+    trace.id = stamps.id;
+    trace.size = size;
+    trace.sent = stamps.sent;
+    trace.encoded = stamps.encoded;
+    // everything queued so far, this message included, has to be written
+    // before it's out
+    mTracing->outgoing.push_back(std::make_pair(mTracing->written + mPendingWrite, trace));
+}
+
+void Connection::traceWritten(int bytes)
+{
+    mTracing->written += bytes;
+    if (mTracing->outgoing.empty())
+        return;
+    const uint64_t now = Rct::monoUs();
+    std::shared_ptr<Connection> that = shared_from_this();
+    while (mTracing && !mTracing->outgoing.empty() && mTracing->outgoing.front().first <= mTracing->written) {
+        MessageTrace trace = mTracing->outgoing.front().second;
+        mTracing->outgoing.pop_front();
+        trace.written = now;
+        mTracing->handler(that, trace);
+    }
+}
+
+void Connection::setStatisticsEnabled(bool on)
+{
+    mStatistics.reset(on ? new Statistics : nullptr);
+    if (mSocketClient)
+        mSocketClient->setStatisticsEnabled(on);
+}
+
+Connection::Statistics Connection::statistics() const
+{
+    if (!mStatistics)
+        return Statistics();
+    Statistics ret = *mStatistics;
+    if (mSocketClient)
+        ret.socket = mSocketClient->statistics();
+    return ret;
+}
+
+bool Connection::writeOut(const String &data)
+{
+    if (mSharedMemoryWrite) {
+        mSharedMemory->write(data.constData(), data.size());
+        sharedMemoryWritten();
+        return mSharedMemory != nullptr;
+    }
+    return mSocketClient->write(data);
+}
+
+bool Connection::sendEncoded(const std::shared_ptr<const String> &encoded)
+{
+    return sendEncoded(nullptr, encoded);
+}
+
+bool Connection::sendEncoded(const Message *message, const std::shared_ptr<const String> &encoded)
+{
+    if (!mSocketClient || !mSocketClient->isConnected()) {
+        if (!mWarned) {
+            mWarned = true;
+            warning("Trying to send message to unconnected client");
+        }
+        return false;
+    }
+    assert(encoded && encoded->size() > sizeof(uint32_t));
+    if (message)
+        mAboutToSend(shared_from_this(), message);
+    if (mStatistics)
+        ++mStatistics->messagesSent;
+    if (!flush())
+        return false;
+    mPendingWrite += encoded->size();
+    if (mPacing)
+        return pace(encoded);
+    if (mSharedMemoryWrite)
+        return writeOut(*encoded);
+    return mSocketClient->write(encoded);
+}
+
+size_t Connection::broadcast(const Message &message, const List<std::shared_ptr<Connection> > &connections,
+                             int maxPendingWrite, SlowConnectionPolicy policy)
+{
+    Map<int, std::shared_ptr<const String> > encoded;
+    size_t ret = 0;
+    for (const std::shared_ptr<Connection> &connection : connections) {
+        if (!connection->isConnected())
+            continue;
+        if (maxPendingWrite > 0 && connection->mPendingWrite > maxPendingWrite) {
+            if (policy == DropSlowConnections)
+                connection->close();
+            continue;
+        }
+        if (connection->mTracing) {
+            if (connection->send(message))
+                ++ret;
+            continue;
+        }
+        std::shared_ptr<const String> &frame = encoded[connection->mVersion];
+        if (!frame)
+            frame = message.encodeShared(connection->mVersion);
+        if (connection->sendEncoded(&message, frame))
+            ++ret;
+    }
+    return ret;
+}
+
+uint32_t Connection::request(const Message &message, const ReplyCallback &callback)
+{
+    if (!isConnected()) {
+        warning("Trying to send request to unconnected client (%d)", message.messageId());
+        return 0;
+    }
+    const uint32_t id = mNextRequestId;
+    mNextRequestId = (mNextRequestId + 1) & ~Message::ReplyBit;
+    if (!mNextRequestId)
+        mNextRequestId = 1;
+
+    if (mMaxPendingRequests > 0 && mPendingRequests.size() >= static_cast<size_t>(mMaxPendingRequests)) {
+        mAboutToSend(shared_from_this(), &message);
+        QueuedRequest queued;
+        queued.id = id;
+        queued.callback = callback;
+        message.prepare(mVersion, queued.header, queued.value, compressionPolicy());
+        queued.header.clear();
+        Serializer serializer(queued.header);
+        message.encodeHeader(serializer, queued.value.size(), mVersion, message.mPreparedFlags | Message::Correlated, id);
+        mQueuedRequests.append(std::move(queued));
+        return id;
+    }
+
+    mPendingRequests[id] = callback;
+    if (!send(message, id)) {
+        mPendingRequests.remove(id);
+        return 0;
+    }
+    return id;
+}
+
+bool Connection::reply(uint32_t requestId, const Message &message)
+{
+    assert(requestId && !(requestId & Message::ReplyBit));
+    return send(message, requestId | Message::ReplyBit);
+}
+
+void Connection::setMaxPendingRequests(int max)
+{
+    mMaxPendingRequests = max;
+    sendQueuedRequests();
+}
+
+void Connection::onReply(const std::shared_ptr<Message> &message)
+{
+    ReplyCallback callback;
+    if (!mPendingRequests.remove(message->requestId(), &callback)) {
+        ::warning() << "Got reply for unknown request" << message->requestId();
+        return;
+    }
+    sendQueuedRequests();
+    if (callback)
+        callback(message);
+}
+
+void Connection::sendQueuedRequests()
+{
+    while (!mQueuedRequests.isEmpty()
+           && (mMaxPendingRequests <= 0 || mPendingRequests.size() < static_cast<size_t>(mMaxPendingRequests))) {
+        if (!isConnected())
+            return;
+        QueuedRequest queued = mQueuedRequests.takeFirst();
+        mPendingRequests[queued.id] = std::move(queued.callback);
+        mPendingWrite += queued.header.size() + queued.value.size();
+        if (mStatistics)
+            ++mStatistics->messagesSent;
+        if (mPacing) {
+            queued.header.append(queued.value);
+            if (!pace(std::make_shared<const String>(std::move(queued.header))))
+                return;
+        } else if (!writeData(queued.header) || (!queued.value.empty() && !writeData(queued.value))) {
+            return;
+        }
+    }
+}
+
+void Connection::failPendingRequests()
+{
+    if (mPendingRequests.isEmpty() && mQueuedRequests.isEmpty())
+        return;
+    Map<uint32_t, ReplyCallback> pending = std::move(mPendingRequests);
+    List<QueuedRequest> queued = std::move(mQueuedRequests);
+    mPendingRequests.clear();
+    mQueuedRequests.clear();
+    for (const auto &request : pending) {
+        if (request.second)
+            request.second(std::shared_ptr<Message>());
+    }
+    for (const QueuedRequest &request : queued) {
+        if (request.callback)
+            request.callback(std::shared_ptr<Message>());
+    }
+}
+
+#ifndef _WIN32
+bool Connection::sendFileDescriptors(const Message &message, const List<int> &fileDescriptors)
+{
+    if (!mSocketClient || !mSocketClient->isConnected() || !(mSocketClient->mode() & SocketClient::Unix)) {
+        warning("Trying to send file descriptors to unconnected or non-unix client (%d)", message.messageId());
+        return false;
+    }
+    if (fileDescriptors.isEmpty())
+        return send(message);
+
+    mAboutToSend(shared_from_this(), &message);
+    if (mStatistics)
+        ++mStatistics->messagesSent;
+
+    String header, value;
+    message.prepare(mVersion, header, value, compressionPolicy());
+    header.clear();
+    {
+        Serializer serializer(header);
+        message.encodeHeader(serializer, value.size(), mVersion, message.mPreparedFlags | Message::FileDescriptors);
+    }
+    // the descriptors have to go out with the first byte of this message
+    if (mPacing)
+        releasePaced(true);
+    if (!flush())
+        return false;
+    mPendingWrite += header.size() + value.size();
+    if (mSharedMemoryWrite) {
+        // a byte to carry them over the socket, the receiver holds the
+        // message back until they've arrived
+        ++mPendingWrite;
+        if (!mSocketClient->write(String(1, '\0'), fileDescriptors))
+            return false;
+        return writeOut(header) && (value.empty() || writeData(value));
+    }
+    return (mSocketClient->write(header, fileDescriptors) && (value.empty() || writeData(value)));
+}
+
+bool Connection::enableSharedMemory(size_t ringSize)
+{
+    if (mSharedMemory || !isConnected() || !(mSocketClient->mode() & SocketClient::Unix))
+        return false;
+    std::unique_ptr<SharedMemoryChannel> channel = SharedMemoryChannel::create(ringSize);
+    if (!channel)
+        return false;
+    const SharedMemoryMessage setup(SharedMemoryMessage::Setup, channel->ringSize());
+    if (!sendFileDescriptors(setup, channel->fileDescriptors()) || !flush())
+        return false;
+    // we keep writing to the socket until the peer has accepted, a peer
+    // that doesn't want it never looks at the rings
+    mSharedMemory = std::move(channel);
+    return true;
+}
+#endif
+
+void Connection::onSharedMemoryMessage(const std::shared_ptr<SharedMemoryMessage> &message)
+{
+    switch (message->type()) {
+    case SharedMemoryMessage::Setup: {
+        std::unique_ptr<SharedMemoryChannel> channel = SharedMemoryChannel::attach(message->takeFileDescriptors(),
+                                                                                  message->ringSize());
+        if (!channel || mSharedMemory) {
+            send(SharedMemoryMessage(SharedMemoryMessage::Reject));
+            break;
+        }
+        mSharedMemory = std::move(channel);
+        // everything up to and including the answer goes over the socket,
+        // we read from it until the peer answers in turn
+        send(SharedMemoryMessage(SharedMemoryMessage::Accept));
+        startSharedMemoryWrite();
+        break; }
+    case SharedMemoryMessage::Accept:
+        if (mSharedMemory && !mSharedMemoryRead) {
+            startSharedMemoryRead();
+            if (!mSharedMemoryWrite) {
+                // our setup was accepted, the peer switches to the rings
+                // once it sees this
+                send(SharedMemoryMessage(SharedMemoryMessage::Accept));
+                startSharedMemoryWrite();
+            }
+        }
+        break;
+    case SharedMemoryMessage::Reject:
+        if (mSharedMemory && !mSharedMemoryWrite) {
+            warning("Peer rejected shared memory, staying on the socket");
+            closeSharedMemory();
+        }
+        break;
+    }
+}
+
+void Connection::startSharedMemoryRead()
+{
+    // the peer won't send anything but file descriptors over the socket
+    // after the message we just got
+    assert(!mPendingRead);
+    mBuffers.clear();
+    mSharedMemoryRead = true;
+    std::weak_ptr<Connection> weak = shared_from_this();
+    EventLoop::eventLoop()->registerSocket(mSharedMemory->eventFd(), EventLoop::SocketRead, [weak](int, unsigned int) {
+            if (std::shared_ptr<Connection> that = weak.lock())
+                that->onSharedMemoryEvent();
+        });
+}
+
+void Connection::startSharedMemoryWrite()
+{
+    // the peer only looks at the rings once it has read our Accept from
+    // the socket, so it can't be left behind in the pacing queue
+    if (mPacing)
+        releasePaced(true);
+    flush();
+    mSharedMemoryWrite = true;
+}
+
+void Connection::onSharedMemoryEvent()
+{
+    std::shared_ptr<Connection> that = shared_from_this();
+    mSharedMemory->clearEvent();
+    bool more = true;
+    while (more && mSharedMemory) {
+        Buffer buffer;
+        more = mSharedMemory->process(buffer);
+        sharedMemoryWritten();
+        if (!buffer.isEmpty()) {
+            if (mStatistics)
+                mStatistics->sharedMemoryBytesRead += buffer.size();
+            readMessages(std::move(buffer));
+        }
+    }
+}
+
+void Connection::sharedMemoryWritten()
+{
+    if (!mSharedMemory)
+        return;
+    if (mSharedMemory->hasError()) {
+        // there's no telling what made it across
+        closeSharedMemory();
+        if (mSocketClient)
+            mSocketClient->close();
+        return;
+    }
+    if (const size_t written = mSharedMemory->takeBytesWritten()) {
+        if (mStatistics)
+            mStatistics->sharedMemoryBytesWritten += written;
+        onDataWritten(mSocketClient, written);
+    }
+}
+
+void Connection::closeSharedMemory()
+{
+    if (!mSharedMemory)
+        return;
+    if (mSharedMemoryRead) {
+        if (std::shared_ptr<EventLoop> eventLoop = EventLoop::eventLoop())
+            eventLoop->unregisterSocket(mSharedMemory->eventFd());
+    }
+    mSharedMemory.reset();
+    mSharedMemoryRead = mSharedMemoryWrite = false;
+    mAwaitingFileDescriptors.reset();
+}
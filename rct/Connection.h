@@ -2,6 +2,7 @@
 #define CONNECTION_H
 
 #include <rct/Buffer.h>
+#include <rct/LinkedList.h>
 #include <rct/ResponseMessage.h>
 #include <rct/SignalSlot.h>
 #include <rct/SocketClient.h>
@@ -14,6 +15,7 @@
 #include <map>
 #include <memory>
 
+#include "ChunkMessage.h"
 #include "FinishMessage.h"
 #include "rct/Buffer.h"
 #include "rct/Log.h"
@@ -24,6 +26,8 @@
 class ConnectionPrivate;
 class Event;
 class Message;
+class SharedMemoryChannel;
+class SharedMemoryMessage;
 class SocketClient;
 
 class Connection : public std::enable_shared_from_this<Connection>
@@ -47,6 +51,19 @@ public:
     void setErrorHandler(std::function<void(const std::shared_ptr<SocketClient> &, Message::MessageError &&)> handler) { mErrorHandler = handler; }
     std::function<void(const std::shared_ptr<SocketClient> &, Message::MessageError &&)> errorHandler() const { return mErrorHandler; }
 
+    /**
+     * Compress messages sent on this connection according to \a policy,
+     * unless their type has a policy of its own, see
+     * Message::setCompressionPolicy(). Peers decode any codec they support.
+     */
+    void setCompressionPolicy(const Compression::Policy &policy)
+    {
+        mCompressionPolicy = policy;
+        mHasCompressionPolicy = true;
+    }
+    void clearCompressionPolicy() { mHasCompressionPolicy = false; }
+    const Compression::Policy *compressionPolicy() const { return mHasCompressionPolicy ? &mCompressionPolicy : nullptr; }
+
     void setSilent(bool on) { mSilent = on; }
     bool isSilent() const { return mSilent; }
 
@@ -57,9 +74,204 @@ public:
 
     int pendingWrite() const;
 
+    /**
+     * When on, encoded messages are collected and handed to the socket in
+     * one write. The batch is flushed once it reaches \a maxBatchSize bytes,
+     * after \a delayUs microseconds if that's set (timers have millisecond
+     * resolution so it's rounded up) and otherwise on the next event loop
+     * iteration. Messages are still delivered in order.
+     */
+    void setWriteCoalescing(bool on, size_t maxBatchSize = 64 * 1024, int delayUs = 0);
+    bool isWriteCoalescing() const { return mCoalesce; }
+    /**
+     * Writes out messages held back by write coalescing.
+     */
+    bool flush();
+
+    /**
+     * Paces sends to \a bytesPerSecond and \a messagesPerSecond, 0 means
+     * no limit on that. Up to \a burstBytes and \a burstMessages can go out
+     * at once after a quiet period, they default to one second's worth.
+     * Messages over the limit are queued and written in order by a timer as
+     * the budget refills, send() still returns true for them. Messages with
+     * file descriptors aren't held back, whatever is queued ahead of them
+     * is written first. Calling it with no limits turns pacing off and
+     * writes out the queue.
+     */
+    void setRateLimit(size_t bytesPerSecond, size_t messagesPerSecond = 0,
+                      size_t burstBytes = 0, size_t burstMessages = 0);
+    bool isRateLimited() const { return mPacing != nullptr; }
+
+    struct PacingStats {
+        double bytesPerSecond = 0;    // sent over the last second
+        double messagesPerSecond = 0;
+        size_t queuedBytes = 0;
+        size_t queuedMessages = 0;
+        uint64_t queueDelay = 0;      // ms the oldest queued message has waited
+        uint64_t delayedMessages = 0; // messages that had to wait, in total
+        uint64_t totalDelay = 0;      // ms they waited, in total
+    };
+    PacingStats pacingStats() const;
+
+    /**
+     * Statistics for this connection, off by default. Enabling them also
+     * enables them on the socket, including sockets connected later. Bytes
+     * that go through the shared memory transport don't show up in the
+     * socket's counters and are counted separately.
+     */
+    struct Statistics {
+        SocketClient::Statistics socket;
+        uint64_t messagesSent = 0;
+        uint64_t messagesReceived = 0;
+        uint64_t sharedMemoryBytesWritten = 0;
+        uint64_t sharedMemoryBytesRead = 0;
+    };
+    void setStatisticsEnabled(bool on);
+    bool isStatisticsEnabled() const { return mStatistics != nullptr; }
+    Statistics statistics() const;
+
+    /**
+     * Where a traced message spent its time, see setTracing(). Stamps are
+     * microseconds on the monotonic clock, 0 where they don't apply. sent
+     * and encoded of incoming messages are the peer's and only comparable
+     * with ours if sameClock is set, i.e. the peer is on this host.
+     */
+    struct MessageTrace {
+        bool incoming = false;
+        bool sameClock = false;
+        uint8_t messageId = 0;
+        uint32_t id = 0;
+        size_t size = 0;
+        uint64_t sent = 0;       // send() was called
+        uint64_t encoded = 0;    // the frame was encoded
+        uint64_t written = 0;    // outgoing: the last byte was handed to the kernel
+        uint64_t read = 0;       // incoming: the first byte was read
+        uint64_t framed = 0;     // incoming: the whole frame had been read
+        uint64_t decoded = 0;    // incoming: the message was created
+        uint64_t dispatched = 0; // incoming: handlers were called
+        uint64_t handled = 0;    // incoming: handlers returned
+
+        uint64_t encodeTime() const { return encoded - sent; }
+        // write batches, pacing and the socket's write queue
+        uint64_t queueTime() const { return written ? written - encoded : 0; }
+        // the peer's queueing plus the kernel
+        uint64_t transitTime() const { return incoming && sameClock && read > encoded ? read - encoded : 0; }
+        uint64_t framingTime() const { return framed - read; }
+        uint64_t decodeTime() const { return decoded - framed; }
+        uint64_t dispatchTime() const { return dispatched - decoded; }
+        uint64_t handlerTime() const { return handled - dispatched; }
+    };
+    typedef std::function<void(const std::shared_ptr<Connection> &, const MessageTrace &)> TraceHandler;
+
+    /**
+     * Traces one in every 1 / \a sampleRate messages passed to send() and
+     * calls \a handler for each once the last byte was written. Traced
+     * messages carry the sender's stamps in their header, the receiving
+     * side calls its handler once its newMessage() slots have returned.
+     * Both sides have to enable tracing: stamps are only sent once the
+     * peer has sent a message that says it understands them, so older
+     * peers are unaffected. A \a sampleRate of 0 turns tracing off.
+     */
+    void setTracing(double sampleRate, const TraceHandler &handler);
+    bool isTracing() const { return mTracing != nullptr; }
+
     bool send(const Message &message);
     bool send(Message &&message){ return send(message); }
 
+    /**
+     * Sends a frame from Message::encodeShared(), which must have been
+     * encoded for this connection's version(). The data is queued without
+     * copying.
+     */
+    bool sendEncoded(const std::shared_ptr<const String> &encoded);
+
+    enum SlowConnectionPolicy {
+        SkipSlowConnections,
+        DropSlowConnections
+    };
+    /**
+     * Sends \a message to all of \a connections, encoding it once per
+     * protocol version. Connections with more than \a maxPendingWrite bytes
+     * not yet written are skipped or closed according to \a policy, 0
+     * means no limit. Returns the number of connections it was sent to.
+     */
+    static size_t broadcast(const Message &message, const List<std::shared_ptr<Connection> > &connections,
+                            int maxPendingWrite = 0, SlowConnectionPolicy policy = SkipSlowConnections);
+
+    /**
+     * Called with the reply to a request, or with a null message if the
+     * connection went away before the reply arrived.
+     */
+    typedef std::function<void(std::shared_ptr<Message>)> ReplyCallback;
+
+    /**
+     * Sends \a message tagged with a new request id and calls \a callback
+     * once the peer answers it with reply(). Any number of requests can be
+     * outstanding on one connection and replies may arrive in any order.
+     * Returns the request id or 0 if not connected.
+     */
+    uint32_t request(const Message &message, const ReplyCallback &callback);
+    /**
+     * Answers the request \a requestId, see Message::requestId().
+     */
+    bool reply(uint32_t requestId, const Message &message);
+
+    /**
+     * Limits how many requests may be waiting for replies. Further requests
+     * are queued locally and sent as replies come in. 0 means no limit.
+     */
+    void setMaxPendingRequests(int max);
+    int maxPendingRequests() const { return mMaxPendingRequests; }
+    int pendingRequests() const { return mPendingRequests.size() + mQueuedRequests.size(); }
+
+#ifndef _WIN32
+    /**
+     * Sends \a message along with \a fileDescriptors over a UNIX socket. The
+     * receiving Connection attaches them to the decoded message, see
+     * Message::takeFileDescriptors(). A listening socket can be adopted with
+     * SocketServer::listenFD() and a connected one with
+     * SocketClient(int fd, mode).
+     */
+    bool sendFileDescriptors(const Message &message, const List<int> &fileDescriptors);
+
+    /**
+     * Moves the traffic of a connection over a UNIX socket into a pair of
+     * shared memory rings of \a ringSize bytes, one per direction. The
+     * socket stays open to notice the peer going away and to pass file
+     * descriptors, wakeups go through eventfds and are only needed when a
+     * side is idle. Messages keep their order across the switch. Returns
+     * false if this platform or connection doesn't support it. If the
+     * peer turns it down the connection carries on over the socket, a peer
+     * built without shared memory support drops the connection instead.
+     */
+    bool enableSharedMemory(size_t ringSize = 1024 * 1024);
+    bool isSharedMemory() const { return mSharedMemoryRead && mSharedMemoryWrite; }
+#endif
+
+    /**
+     * Fills \a chunk with at most \a maxSize bytes and returns false once
+     * this was the last chunk. At least one byte must be added unless false
+     * is returned.
+     */
+    typedef std::function<bool(String &chunk, size_t maxSize)> StreamProducer;
+
+    /**
+     * Sends the data produced by \a producer as a series of ChunkMessages
+     * without encoding the whole payload up front. The producer is called
+     * lazily, only as long as fewer than \a maxInFlight chunks worth of
+     * bytes are waiting to be written. Returns the stream id, or 0 if not
+     * connected. The receiver gets the chunks through chunk().
+     */
+    uint32_t sendStream(const StreamProducer &producer, size_t chunkSize = 64 * 1024, int maxInFlight = 4);
+
+    /**
+     * Limits how many streams the peer may have open on this connection at
+     * once, the connection is closed when it opens more. 0 means no limit,
+     * defaults to 1024.
+     */
+    void setMaxIncomingStreams(size_t max) { mMaxIncomingStreams = max; }
+    size_t maxIncomingStreams() const { return mMaxIncomingStreams; }
+
     template <int StaticBufSize>
     bool write(const char *format, ...) RCT_PRINTF_WARNING(2, 3);
     bool write(const String &out, ResponseMessage::Type type = ResponseMessage::Stdout)
@@ -81,7 +293,14 @@ public:
 
     int finishStatus() const { return mFinishStatus; }
 
-    void close() { assert(mSocketClient); mSocketClient->close(); }
+    void close()
+    {
+        assert(mSocketClient);
+        if (mPacing)
+            releasePaced(true);
+        flush();
+        mSocketClient->close();
+    }
 
     bool isConnected() const { return mSocketClient && mSocketClient->isConnected(); }
 
@@ -92,6 +311,11 @@ public:
     Signal<std::function<void(std::shared_ptr<Connection>, int)> > &finished() { return mFinished; }
     Signal<std::function<void(std::shared_ptr<Connection>, const Message *)> > &aboutToSend() { return mAboutToSend; }
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)> > &newMessage() { return mNewMessage; }
+    /**
+     * Emitted for each ChunkMessage, in sequence order per stream. Chunks
+     * arriving out of order are treated like undecodable messages.
+     */
+    Signal<std::function<void(std::shared_ptr<ChunkMessage>, std::shared_ptr<Connection>)> > &chunk() { return mChunk; }
     std::shared_ptr<SocketClient> client() const { return mSocketClient; }
 
 private:
@@ -99,26 +323,130 @@ private:
     void disconnect();
     void connect(const std::shared_ptr<SocketClient> &client);
     void onClientConnected(const std::shared_ptr<SocketClient>&) { mIsConnected = true; mConnected(shared_from_this()); }
-    void onClientDisconnected(const std::shared_ptr<SocketClient>&) { mIsConnected = false; mDisconnected(shared_from_this()); }
+    void onClientDisconnected(const std::shared_ptr<SocketClient>&)
+    {
+        mIsConnected = false;
+        // the peer may have written to shared memory right before leaving
+        if (mSharedMemoryRead)
+            onSharedMemoryEvent();
+        closeSharedMemory();
+        failPendingRequests();
+        mDisconnected(shared_from_this());
+    }
     void onDataAvailable(const std::shared_ptr<SocketClient>&, Buffer&& buffer);
     void onDataWritten(const std::shared_ptr<SocketClient>&, int);
     void onSocketError(const std::shared_ptr<SocketClient>&, SocketClient::Error error)
     {
         ::warning() << "Socket error" << error << errno << Rct::strerror();
+        closeSharedMemory();
+        failPendingRequests();
         mError(shared_from_this());
         mDisconnected(shared_from_this());
     }
     void checkData();
+    void readMessages(Buffer &&buffer);
+    void dispatch(const std::shared_ptr<Message> &message, MessageTrace *trace = nullptr);
+    bool send(const Message &message, uint32_t requestId);
+    bool writeData(const String &data);
+    bool writeOut(const String &data);
+    bool sendEncoded(const Message *message, const std::shared_ptr<const String> &encoded);
+    void scheduleFlush();
+    bool pace(const std::shared_ptr<const String> &frame);
+    bool takePacingTokens(size_t bytes);
+    void schedulePacing();
+    void releasePaced(bool all);
+    void onReply(const std::shared_ptr<Message> &message);
+    void sendQueuedRequests();
+    void traceSent(const Message::TraceStamps &stamps, uint8_t messageId, size_t size);
+    void traceWritten(int bytes);
+    void failPendingRequests();
+    void schedulePumpStreams();
+    void pumpStreams();
+    bool validateChunk(const ChunkMessage &chunk, Message::MessageError &error);
+    void onSharedMemoryMessage(const std::shared_ptr<SharedMemoryMessage> &message);
+    void startSharedMemoryRead();
+    void startSharedMemoryWrite();
+    void onSharedMemoryEvent();
+    void sharedMemoryWritten();
+    void closeSharedMemory();
 
     std::shared_ptr<SocketClient> mSocketClient;
     Buffers mBuffers;
     int mPendingRead, mPendingWrite, mTimeoutTimer, mCheckTimer, mFinishStatus, mVersion;
 
-    bool mSilent, mIsConnected, mWarned;
+    bool mSilent, mIsConnected, mWarned, mStreamPumpScheduled;
+
+    struct OutgoingStream {
+        uint32_t id, sequence;
+        size_t chunkSize;
+        int maxInFlight;
+        StreamProducer producer;
+        String buffer;
+    };
+    List<std::shared_ptr<OutgoingStream> > mOutgoingStreams;
+    Map<uint32_t, uint32_t> mIncomingStreams;
+    size_t mMaxIncomingStreams;
+    uint32_t mNextStreamId;
+
+    struct QueuedRequest {
+        uint32_t id;
+        String header, value;
+        ReplyCallback callback;
+    };
+    Map<uint32_t, ReplyCallback> mPendingRequests;
+    List<QueuedRequest> mQueuedRequests;
+    uint32_t mNextRequestId;
+    int mMaxPendingRequests;
+
+    bool mCoalesce, mFlushScheduled;
+    size_t mCoalesceMaxSize;
+    int mCoalesceDelayUs, mFlushTimer;
+    String mBatch;
+
+    Compression::Policy mCompressionPolicy;
+    bool mHasCompressionPolicy;
+
+    struct TokenBucket {
+        double rate = 0, burst = 0, tokens = 0;
+    };
+    struct PacedFrame {
+        std::shared_ptr<const String> frame;
+        uint64_t queued;
+    };
+    struct Pacing {
+        TokenBucket bytes, messages;
+        uint64_t refilled = 0;
+        int timer = 0;
+        LinkedList<PacedFrame> queue;
+        PacingStats stats;
+        uint64_t windowStart = 0;
+        size_t windowBytes = 0, windowMessages = 0;
+    };
+    std::unique_ptr<Pacing> mPacing;
+    std::unique_ptr<Statistics> mStatistics;
+
+    struct Tracing {
+        TraceHandler handler;
+        uint32_t interval = 1, countdown = 1, nextId = 1;
+        int sameClock = -1;
+        // bytes written since tracing was turned on, outgoing traces are
+        // keyed by the offset of their last byte
+        uint64_t written = 0;
+        LinkedList<std::pair<uint64_t, MessageTrace> > outgoing;
+        // when the oldest unread byte and the current frame's first byte arrived
+        uint64_t unreadSince = 0, frameRead = 0;
+    };
+    std::unique_ptr<Tracing> mTracing;
+    bool mPeerTraceCapable;
+
+    std::unique_ptr<SharedMemoryChannel> mSharedMemory;
+    bool mSharedMemoryRead, mSharedMemoryWrite;
+    std::shared_ptr<Message> mAwaitingFileDescriptors;
 
     std::function<void(const std::shared_ptr<SocketClient> &, Message::MessageError &&)> mErrorHandler;
 
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)> > mNewMessage;
+    Signal<std::function<void(std::shared_ptr<ChunkMessage>, std::shared_ptr<Connection>)> > mChunk;
     Signal<std::function<void(std::shared_ptr<Connection>)> > mConnected, mDisconnected, mError, mSendFinished;
     Signal<std::function<void(std::shared_ptr<Connection>, int)> > mFinished;
     Signal<std::function<void(std::shared_ptr<Connection>, const Message *)> > mAboutToSend;
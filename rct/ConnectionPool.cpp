@@ -0,0 +1,239 @@
+#include "ConnectionPool.h"
+
+#include <errno.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+#include "EventLoop.h"
+#include "Rct.h"
+#include "SocketClient.h"
+#include "Timer.h"
+#include "rct/Log.h"
+
+ConnectionPool::ConnectionPool()
+    : ConnectionPool(Options())
+{
+}
+
+ConnectionPool::ConnectionPool(const Options &options)
+    : mOptions(options), mTimer(0)
+{
+    std::shared_ptr<EventLoop> eventLoop = EventLoop::eventLoop();
+    assert(eventLoop);
+    const int interval = std::max(std::min(mOptions.idleTimeout / 2, 1000), 10);
+    mTimer = eventLoop->registerTimer([this](int) { onTimer(); }, interval);
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    if (std::shared_ptr<EventLoop> eventLoop = EventLoop::eventLoop())
+        eventLoop->unregisterTimer(mTimer);
+    for (const auto &connecting : mConnecting)
+        reset(connecting.second);
+    for (const auto &endpoint : mEndpoints) {
+        for (const Idle &idle : endpoint.second->idle) {
+            reset(idle.connection);
+            idle.connection->close();
+        }
+    }
+}
+
+std::shared_ptr<ConnectionPool::Endpoint> ConnectionPool::endpoint(const String &host, uint16_t port, int version)
+{
+    std::shared_ptr<Endpoint> &ret = mEndpoints[String::format<256>("%s:%u:%d", host.constData(), port, version)];
+    if (!ret) {
+        ret = std::make_shared<Endpoint>();
+        ret->host = host;
+        ret->port = port;
+        ret->version = version;
+        ret->active = ret->connecting = ret->acquiring = 0;
+        ret->failing = false;
+    }
+    return ret;
+}
+
+void ConnectionPool::acquire(const String &host, uint16_t port, int version, const AcquireCallback &callback)
+{
+    assert(callback);
+    const std::shared_ptr<Endpoint> ep = endpoint(host, port, version);
+    // most recently used first, it's the least likely to have timed out
+    while (!ep->idle.isEmpty()) {
+        const std::shared_ptr<Connection> connection = ep->idle.takeLast().connection;
+        reset(connection);
+        if (!isAlive(connection)) {
+            ++mStats.discarded;
+            if (connection->isConnected())
+                connection->close();
+            continue;
+        }
+        ++mStats.reused;
+        ++ep->active;
+        mActive[connection.get()] = { ep, connection };
+        fill(ep);
+        callback(connection);
+        return;
+    }
+    // connects for earlier acquires will be handed out too
+    if (mOptions.maxActive && ep->active + ep->acquiring >= mOptions.maxActive) {
+        ++mStats.refused;
+        callback(std::shared_ptr<Connection>());
+        return;
+    }
+    connect(ep, callback);
+}
+
+void ConnectionPool::release(const std::shared_ptr<Connection> &connection)
+{
+    Active active;
+    if (!mActive.remove(connection.get(), &active)) {
+        warning("Releasing connection that doesn't belong to the pool");
+        return;
+    }
+    const std::shared_ptr<Endpoint> &ep = active.endpoint;
+    --ep->active;
+    reset(connection);
+    if (!connection->isConnected() || connection->pendingRequests() || ep->idle.size() >= mOptions.maxIdle) {
+        ++mStats.discarded;
+        if (connection->isConnected())
+            connection->close();
+        return;
+    }
+    addIdle(ep, connection);
+}
+
+void ConnectionPool::prewarm(const String &host, uint16_t port, int version)
+{
+    fill(endpoint(host, port, version));
+}
+
+ConnectionPool::Stats ConnectionPool::stats() const
+{
+    Stats ret = mStats;
+    for (const auto &endpoint : mEndpoints) {
+        ret.idle += endpoint.second->idle.size();
+        ret.active += endpoint.second->active;
+        ret.connecting += endpoint.second->connecting;
+    }
+    return ret;
+}
+
+void ConnectionPool::connect(const std::shared_ptr<Endpoint> &ep, const AcquireCallback &callback)
+{
+    std::shared_ptr<Connection> connection = Connection::create(ep->version);
+    auto failed = [this, ep, callback](const std::shared_ptr<Connection> &conn) {
+        // error() is followed by disconnected()
+        if (!mConnecting.remove(conn.get()))
+            return;
+        --ep->connecting;
+        ep->failing = true;
+        reset(conn);
+        ++mStats.failed;
+        if (callback) {
+            --ep->acquiring;
+            callback(std::shared_ptr<Connection>());
+        }
+    };
+    connection->connected().connect([this, ep, callback](const std::shared_ptr<Connection> &conn) {
+            if (!mConnecting.remove(conn.get()))
+                return;
+            --ep->connecting;
+            ep->failing = false;
+            reset(conn);
+            ++mStats.created;
+            if (callback) {
+                --ep->acquiring;
+                ++ep->active;
+                mActive[conn.get()] = { ep, conn };
+                callback(conn);
+            } else {
+                addIdle(ep, conn);
+            }
+        });
+    connection->disconnected().connect(failed);
+    connection->error().connect(failed);
+    mConnecting[connection.get()] = connection;
+    ++ep->connecting;
+    if (callback)
+        ++ep->acquiring;
+    if (!connection->connectTcp(ep->host, ep->port, mOptions.connectTimeout))
+        failed(connection);
+}
+
+void ConnectionPool::addIdle(const std::shared_ptr<Endpoint> &ep, const std::shared_ptr<Connection> &connection)
+{
+    const Connection *key = connection.get();
+    auto gone = [this, ep, key](const std::shared_ptr<Connection> &) {
+        ++mStats.discarded;
+        removeIdle(ep, key);
+    };
+    connection->disconnected().connect(gone);
+    connection->error().connect(gone);
+    ep->idle.append({ connection, Rct::monoMs() });
+}
+
+void ConnectionPool::removeIdle(const std::shared_ptr<Endpoint> &ep, const Connection *connection)
+{
+    for (size_t i=0; i<ep->idle.size(); ++i) {
+        if (ep->idle.at(i).connection.get() == connection) {
+            reset(ep->idle.at(i).connection);
+            ep->idle.removeAt(i);
+            return;
+        }
+    }
+}
+
+void ConnectionPool::fill(const std::shared_ptr<Endpoint> &ep)
+{
+    for (size_t count = ep->idle.size() + ep->connecting; count < mOptions.minIdle; ++count)
+        connect(ep, AcquireCallback());
+}
+
+void ConnectionPool::onTimer()
+{
+    const uint64_t now = Rct::monoMs();
+    for (const auto &endpoint : mEndpoints) {
+        const std::shared_ptr<Endpoint> &ep = endpoint.second;
+        while (ep->idle.size() > mOptions.minIdle
+               && now - ep->idle.first().since >= static_cast<uint64_t>(mOptions.idleTimeout)) {
+            const std::shared_ptr<Connection> connection = ep->idle.takeFirst().connection;
+            reset(connection);
+            connection->close();
+            ++mStats.evicted;
+        }
+        // don't keep hammering a backend that's down, the next acquire()
+        // will try again
+        if (!ep->failing)
+            fill(ep);
+    }
+}
+
+bool ConnectionPool::isAlive(const std::shared_ptr<Connection> &connection)
+{
+    if (!connection->isConnected())
+        return false;
+#ifndef _WIN32
+    // a peer that went away shows up as readable with nothing to read
+    char byte;
+    ssize_t ret;
+    eintrwrap(ret, ::recv(connection->client()->socket(), &byte, 1, MSG_PEEK | MSG_DONTWAIT));
+    if (!ret || (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK))
+        return false;
+#endif
+    return true;
+}
+
+void ConnectionPool::reset(const std::shared_ptr<Connection> &connection)
+{
+    connection->sendFinished().disconnect();
+    connection->connected().disconnect();
+    connection->disconnected().disconnect();
+    connection->error().disconnect();
+    connection->finished().disconnect();
+    connection->aboutToSend().disconnect();
+    connection->newMessage().disconnect();
+    connection->chunk().disconnect();
+    connection->setErrorHandler(nullptr);
+}
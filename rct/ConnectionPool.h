@@ -0,0 +1,132 @@
+#ifndef ConnectionPool_h
+#define ConnectionPool_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+
+#include <rct/Connection.h>
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/String.h>
+
+/**
+ * Keeps TCP connections to backends open between uses. Connections are
+ * pooled per host, port and protocol version. acquire() hands out an idle
+ * connection if there is a live one and only connects otherwise, release()
+ * gives it back once the caller is done with it, typically after the
+ * FinishMessage arrived.
+ *
+ * Must be used from the thread of the event loop it was created on.
+ */
+class ConnectionPool
+{
+public:
+    struct Options {
+        /**
+         * Idle connections kept open per endpoint once it has been used,
+         * including ones opened in advance.
+         */
+        size_t minIdle = 0;
+        /**
+         * Released connections beyond this are closed.
+         */
+        size_t maxIdle = 8;
+        /**
+         * Connections handed out at the same time per endpoint, 0 means no
+         * limit.
+         */
+        size_t maxActive = 0;
+        /**
+         * Idle connections above minIdle are closed after this many ms.
+         */
+        int idleTimeout = 60000;
+        int connectTimeout = 0;
+    };
+
+    struct Stats {
+        uint64_t created = 0;   // connections opened
+        uint64_t reused = 0;    // acquires served from the idle list
+        uint64_t failed = 0;    // connects that didn't succeed
+        uint64_t refused = 0;   // acquires over maxActive
+        uint64_t evicted = 0;   // idle connections closed by the pool
+        uint64_t discarded = 0; // connections found dead or released unusable
+        size_t idle = 0;
+        size_t active = 0;
+        size_t connecting = 0;
+    };
+
+    ConnectionPool();
+    ConnectionPool(const Options &options);
+    ~ConnectionPool();
+
+    const Options &options() const { return mOptions; }
+
+    /**
+     * Called with a connected Connection, or with null if none could be
+     * made.
+     */
+    typedef std::function<void(const std::shared_ptr<Connection> &)> AcquireCallback;
+
+    /**
+     * Calls \a callback with a connection to \a host and \a port. Idle
+     * connections are checked for liveness and handed out right away,
+     * from inside this call. Otherwise a new connection is made and
+     * \a callback is called once it's up. The pool holds on to the
+     * connection until it's released.
+     */
+    void acquire(const String &host, uint16_t port, int version, const AcquireCallback &callback);
+    /**
+     * Returns \a connection to the pool. Signal connections and the error
+     * handler are reset, other settings are kept. Connections that aren't
+     * connected or still wait for replies are closed instead.
+     */
+    void release(const std::shared_ptr<Connection> &connection);
+
+    /**
+     * Opens connections to \a host and \a port until minIdle of them are
+     * idle.
+     */
+    void prewarm(const String &host, uint16_t port, int version = 0);
+
+    Stats stats() const;
+
+private:
+    struct Idle {
+        std::shared_ptr<Connection> connection;
+        uint64_t since;
+    };
+    struct Endpoint;
+    struct Active {
+        std::shared_ptr<Endpoint> endpoint;
+        std::shared_ptr<Connection> connection;
+    };
+    struct Endpoint {
+        String host;
+        uint16_t port;
+        int version;
+        List<Idle> idle;
+        // connecting includes acquiring, the connects someone waits for
+        size_t active, connecting, acquiring;
+        bool failing;
+    };
+
+    std::shared_ptr<Endpoint> endpoint(const String &host, uint16_t port, int version);
+    void connect(const std::shared_ptr<Endpoint> &endpoint, const AcquireCallback &callback);
+    void addIdle(const std::shared_ptr<Endpoint> &endpoint, const std::shared_ptr<Connection> &connection);
+    void removeIdle(const std::shared_ptr<Endpoint> &endpoint, const Connection *connection);
+    void fill(const std::shared_ptr<Endpoint> &endpoint);
+    void onTimer();
+    static bool isAlive(const std::shared_ptr<Connection> &connection);
+    static void reset(const std::shared_ptr<Connection> &connection);
+
+    Options mOptions;
+    Stats mStats;
+    int mTimer;
+    Map<String, std::shared_ptr<Endpoint> > mEndpoints;
+    Map<const Connection *, Active> mActive;
+    Map<const Connection *, std::shared_ptr<Connection> > mConnecting;
+};
+
+#endif
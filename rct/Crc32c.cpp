@@ -0,0 +1,116 @@
+#include "Crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define RCT_CRC32C_SSE42
+#endif
+
+namespace {
+struct Tables
+{
+    Tables()
+    {
+        for (uint32_t i=0; i<256; ++i) {
+            uint32_t crc = i;
+            for (int j=0; j<8; ++j)
+                crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            table[0][i] = crc;
+        }
+        for (uint32_t i=0; i<256; ++i) {
+            for (int j=1; j<8; ++j)
+                table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+        }
+    }
+
+    uint32_t table[8][256];
+};
+
+const Tables &tables()
+{
+    static const Tables sTables;
+    return sTables;
+}
+
+uint32_t extendTable(uint32_t crc, const unsigned char *bytes, size_t size)
+{
+    const uint32_t (&table)[8][256] = tables().table;
+    crc = ~crc;
+    // slicing by 8, the words are read little endian
+    while (size >= 8) {
+        uint32_t low, high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        low = __builtin_bswap32(low);
+        high = __builtin_bswap32(high);
+#endif
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff]
+            ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24]
+            ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff]
+            ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *bytes++) & 0xff];
+    return ~crc;
+}
+
+#ifdef RCT_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+uint32_t extendSse42(uint32_t crc, const unsigned char *bytes, size_t size)
+{
+    uint64_t ret = ~crc;
+    while (size && reinterpret_cast<uintptr_t>(bytes) & 7) {
+        ret = _mm_crc32_u8(ret, *bytes++);
+        --size;
+    }
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        ret = _mm_crc32_u64(ret, word);
+        bytes += 8;
+        size -= 8;
+    }
+    while (size--)
+        ret = _mm_crc32_u8(ret, *bytes++);
+    return ~static_cast<uint32_t>(ret);
+}
+#endif
+
+typedef uint32_t (*ExtendFunction)(uint32_t, const unsigned char *, size_t);
+
+ExtendFunction resolve()
+{
+#ifdef RCT_CRC32C_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return extendSse42;
+#endif
+    return extendTable;
+}
+}
+
+uint32_t Crc32c::extend(uint32_t crc, const void *data, size_t size)
+{
+    static const ExtendFunction sExtend = resolve();
+    return sExtend(crc, static_cast<const unsigned char *>(data), size);
+}
+
+bool Crc32c::isHardwareAccelerated()
+{
+#ifdef RCT_CRC32C_SSE42
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+uint32_t Crc32c::extendPortable(uint32_t crc, const void *data, size_t size)
+{
+    return extendTable(crc, static_cast<const unsigned char *>(data), size);
+}
@@ -0,0 +1,41 @@
+#ifndef Crc32c_h
+#define Crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC-32C (Castagnoli), the checksum used by iSCSI, ext4 and most
+ * storage formats. Either feed data incrementally with update() or use
+ * the static checksum(). Uses the SSE4.2 crc32 instruction when the CPU
+ * has it.
+ */
+class Crc32c
+{
+public:
+    Crc32c()
+        : mCrc(0)
+    {}
+
+    void update(const void *data, size_t size) { mCrc = extend(mCrc, data, size); }
+    uint32_t value() const { return mCrc; }
+    void reset() { mCrc = 0; }
+
+    /**
+     * Returns the checksum of \a crc's data followed by \a size bytes at
+     * \a data.
+     */
+    static uint32_t extend(uint32_t crc, const void *data, size_t size);
+    static uint32_t checksum(const void *data, size_t size) { return extend(0, data, size); }
+
+    static bool isHardwareAccelerated();
+    /**
+     * The table driven fallback, for testing.
+     */
+    static uint32_t extendPortable(uint32_t crc, const void *data, size_t size);
+
+private:
+    uint32_t mCrc;
+};
+
+#endif
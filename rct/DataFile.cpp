@@ -0,0 +1,786 @@
+#include "DataFile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "Crc32c.h"
+#include "Rct.h"
+#include "ThreadPool.h"
+#include "rct/rct-config.h"
+
+namespace {
+class FunctionJob : public ThreadPool::Job
+{
+public:
+    FunctionJob(std::function<void()> &&function)
+        : mFunction(std::move(function))
+    {}
+
+    // runs the job here if no pool thread has taken it yet, waiting for a
+    // queued job from a pool thread deadlocks once every thread does it
+    static void finish(ThreadPool *pool, const std::shared_ptr<FunctionJob> &job)
+    {
+        if (pool->remove(job)) {
+            job->mFunction();
+        } else {
+            job->waitForState(Finished);
+        }
+    }
+protected:
+    virtual void run() override { mFunction(); }
+private:
+    const std::function<void()> mFunction;
+};
+
+// a block that is compressed, or still being compressed, but not written
+struct PendingBlock
+{
+    String data, compressed;
+    bool isCompressed;
+    std::shared_ptr<FunctionJob> job;
+};
+}
+
+// buffers writes to the temp file and checksums them in bulk, once for
+// the current section and once for the file. Large uncompressed writes
+// skip the buffer once it's flushed. With compression the buffer
+// is cut into blocks that are compressed on the thread pool and written
+// in order, pos() stays the uncompressed position.
+class DataFile::Writer : public Serializer::Buffer
+{
+public:
+    enum {
+        BufferSize = 1024 * 1024,
+        DirectWriteSize = BufferSize / 4
+    };
+
+    Writer(int fd)
+        : mFd(fd), mFlushed(0), mWriteOffset(0), mChecksummed(0), mErrno(0), mCapacity(BufferSize),
+          mBlockSize(0), mPool(nullptr)
+    {
+        mBuffer.reserve(BufferSize);
+    }
+
+    ~Writer()
+    {
+        // a pending job still references its block
+        for (const std::shared_ptr<PendingBlock> &block : mPending) {
+            if (!mPool->remove(block->job))
+                block->job->waitForState(ThreadPool::Job::Finished);
+        }
+        close();
+    }
+
+    void setCompression(const Compression::Policy &policy, size_t blockSize)
+    {
+        mPolicy = policy;
+        mBlockSize = blockSize;
+        mCapacity = std::max<size_t>(BufferSize, blockSize);
+        mPool = ThreadPool::instance();
+    }
+
+    virtual bool write(const void *data, int len) override
+    {
+        if (mErrno)
+            return false;
+        const char *bytes = static_cast<const char *>(data);
+        size_t remaining = len;
+        // large payloads aren't worth copying, once the header is out
+        if (!mBlockSize && mFlushed && remaining >= DirectWriteSize) {
+            if (!flushBuffer())
+                return false;
+            sectionCrc.update(bytes, remaining);
+            fileCrc.update(bytes, remaining);
+            if (!writeAll(bytes, remaining))
+                return false;
+            mFlushed += remaining;
+            mChecksummed = mFlushed;
+            return true;
+        }
+        while (mBuffer.size() + remaining > mCapacity) {
+            const size_t chunk = mCapacity - mBuffer.size();
+            mBuffer.append(bytes, chunk);
+            if (!flushBuffer())
+                return false;
+            bytes += chunk;
+            remaining -= chunk;
+        }
+        mBuffer.append(bytes, remaining);
+        return true;
+    }
+
+    virtual int pos() const override
+    {
+        return static_cast<int>(mFlushed + mBuffer.size());
+    }
+
+    // brings the checksums up to date
+    void checksum()
+    {
+        const size_t offset = mChecksummed - mFlushed;
+        sectionCrc.update(mBuffer.constData() + offset, mBuffer.size() - offset);
+        fileCrc.update(mBuffer.constData() + offset, mBuffer.size() - offset);
+        mChecksummed = pos();
+    }
+
+    // writes the header as is, it's neither checksummed nor compressed
+    bool writeHeader()
+    {
+        assert(!mFlushed);
+        if (!writeAll(mBuffer.constData(), mBuffer.size()))
+            return false;
+        mFlushed = mChecksummed = mBuffer.size();
+        mBuffer.clear();
+        return true;
+    }
+
+    // with compression only whole blocks are written, unless it's the end
+    bool flushBuffer(bool final = false)
+    {
+        checksum();
+        if (!mBlockSize) {
+            if (!writeAll(mBuffer.constData(), mBuffer.size()))
+                return false;
+            mFlushed += mBuffer.size();
+            mBuffer.clear();
+            return true;
+        }
+        size_t consumed = 0;
+        while (mBuffer.size() - consumed >= mBlockSize || (final && consumed < mBuffer.size())) {
+            const size_t size = std::min(mBlockSize, mBuffer.size() - consumed);
+            if (!compressBlock(mBuffer.constData() + consumed, size))
+                return false;
+            consumed += size;
+        }
+        mBuffer.remove(0, consumed);
+        mFlushed += consumed;
+        return true;
+    }
+
+    // writes what's left and, with compression, the block index
+    bool finish()
+    {
+        if (!flushBuffer(true))
+            return false;
+        if (!mBlockSize)
+            return true;
+        while (!mPending.isEmpty()) {
+            if (!writeBlock(mPending.takeFirst()))
+                return false;
+        }
+        const uint32_t indexOffset = mWriteOffset;
+        String index, trailer;
+        {
+            Serializer serializer(index);
+            serializer << static_cast<uint32_t>(mBlockSize) << static_cast<uint32_t>(mFlushed)
+                       << static_cast<uint32_t>(mBlocks.size());
+            for (const Block &block : mBlocks)
+                serializer << block.offset << block.size << block.compressed;
+        }
+        {
+            Serializer serializer(trailer);
+            serializer << indexOffset << Crc32c::checksum(index.constData(), index.size());
+        }
+        return writeAll(index.constData(), index.size()) && writeAll(trailer.constData(), trailer.size());
+    }
+
+    // the size of the file, once finished
+    size_t size() const { return mWriteOffset; }
+
+    // overwrites already written data
+    bool patch(size_t offset, const String &data)
+    {
+        assert(mBuffer.isEmpty());
+        return writeAll(data.constData(), data.size(), offset);
+    }
+
+    void preallocate(size_t size)
+    {
+#ifdef HAVE_FALLOCATE
+        // don't change the size, we might write less
+        if (fallocate(mFd, FALLOC_FL_KEEP_SIZE, 0, size) == -1)
+            debug() << "fallocate failed" << Rct::strerror();
+#else
+        (void)size;
+#endif
+    }
+
+    bool sync()
+    {
+#if defined(HAVE_FDATASYNC)
+        const int ret = fdatasync(mFd);
+#elif !defined(_WIN32)
+        const int ret = fsync(mFd);
+#else
+        const int ret = 0;
+#endif
+        if (ret == -1)
+            mErrno = errno;
+        return !ret;
+    }
+
+    bool close()
+    {
+        if (mFd == -1)
+            return !mErrno;
+        int ret;
+        eintrwrap(ret, ::close(mFd));
+        mFd = -1;
+        if (ret == -1 && !mErrno)
+            mErrno = errno;
+        return !mErrno;
+    }
+
+    int error() const { return mErrno; }
+
+    Crc32c sectionCrc, fileCrc;
+private:
+    bool compressBlock(const char *data, size_t size)
+    {
+        std::shared_ptr<PendingBlock> block = std::make_shared<PendingBlock>();
+        block->data.assign(data, size);
+        const Compression::Policy policy = mPolicy;
+        PendingBlock *b = block.get();
+        block->job = std::make_shared<FunctionJob>([b, policy]() {
+                b->isCompressed = Compression::compress(policy, b->data.constData(), b->data.size(),
+                                                        b->compressed);
+            });
+        mPool->start(block->job);
+        mPending.append(block);
+        // keep the number of blocks in memory bounded
+        const size_t maxPending = std::max(ThreadPool::idealThreadCount(), 1) * 2;
+        while (mPending.size() > maxPending) {
+            if (!writeBlock(mPending.takeFirst()))
+                return false;
+        }
+        return true;
+    }
+
+    bool writeBlock(const std::shared_ptr<PendingBlock> &pending)
+    {
+        FunctionJob::finish(mPool, pending->job);
+        const String &data = pending->isCompressed ? pending->compressed : pending->data;
+        Block block;
+        block.offset = mWriteOffset;
+        block.size = data.size();
+        block.compressed = pending->isCompressed;
+        block.loaded = false;
+        mBlocks.append(block);
+        return writeAll(data.constData(), data.size());
+    }
+
+    bool writeAll(const void *data, size_t len)
+    {
+        return writeAll(data, len, mWriteOffset);
+    }
+
+    bool writeAll(const void *data, size_t len, size_t &offset)
+    {
+        const char *bytes = static_cast<const char *>(data);
+        while (len) {
+            ssize_t ret;
+            eintrwrap(ret, ::pwrite(mFd, bytes, len, offset));
+            if (ret <= 0) {
+                mErrno = ret ? errno : EIO;
+                return false;
+            }
+            bytes += ret;
+            len -= ret;
+            offset += ret;
+        }
+        return true;
+    }
+
+    int mFd;
+    // mFlushed counts the uncompressed bytes that left the buffer
+    size_t mFlushed, mWriteOffset, mChecksummed;
+    String mBuffer;
+    int mErrno;
+    size_t mCapacity;
+    Compression::Policy mPolicy;
+    size_t mBlockSize;
+    ThreadPool *mPool;
+    List<std::shared_ptr<PendingBlock> > mPending;
+    List<Block> mBlocks;
+};
+
+// the index is followed by its offset and its checksum
+enum { TrailerSize = Serializer::sizeOf<uint32_t>() * 2 };
+
+static bool syncDirectory(const Path &dir)
+{
+#ifndef _WIN32
+    const int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    const int ret = fsync(fd);
+    int closed;
+    eintrwrap(closed, ::close(fd));
+    return !ret;
+#else
+    (void)dir;
+    return true;
+#endif
+}
+
+DataFile::DataFile(const Path &path, int version, Serializer::Encoding encoding)
+    : mSizeOffset(-1), mWriter(nullptr), mPath(path), mVersion(version), mEncoding(encoding),
+      mDurability(NoSync), mInSection(false), mChecksummed(false), mContentEnd(0), mBlockSize(0),
+      mUncompressedSize(0)
+{
+    assert(!(version & (CompactVersion | SectionedVersion | ChecksummedVersion | BlockCompressedVersion)));
+}
+
+DataFile::~DataFile()
+{
+    mDeserializer.reset();
+    if (mWriter)
+        flush();
+}
+
+void DataFile::setCompression(const Compression::Policy &policy, size_t blockSize)
+{
+    assert(!mWriter);
+    assert(blockSize);
+    mCompression = policy;
+    mBlockSize = blockSize;
+}
+
+void DataFile::preallocate(size_t size)
+{
+    if (mWriter)
+        mWriter->preallocate(size);
+}
+
+bool DataFile::flush()
+{
+    if (!mWriter)
+        return false;
+    if (mInSection)
+        endSection();
+    mSerializer->setEncoding(Serializer::Native);
+    int version = ChecksummedVersion;
+    if (mEncoding == Serializer::Compact)
+        version |= CompactVersion;
+    if (mBlockSize)
+        version |= BlockCompressedVersion;
+    if (!mSections.isEmpty()) {
+        version |= SectionedVersion;
+        const uint32_t indexOffset = mWriter->pos();
+        String index;
+        {
+            Serializer serializer(index);
+            serializer << static_cast<uint32_t>(mSections.size());
+            for (const Section &section : mSections)
+                serializer << section.name << section.offset << section.length << section.checksum;
+        }
+        mSerializer->write(index);
+        operator<<(indexOffset) << Crc32c::checksum(index.constData(), index.size());
+    }
+    mWriter->checksum();
+    operator<<(mWriter->fileCrc.value());
+
+    bool ok = !mSerializer->hasError() && mWriter->finish();
+    if (ok) {
+        String header, size;
+        {
+            Serializer serializer(header);
+            serializer << (mVersion | version);
+        }
+        {
+            Serializer serializer(size);
+            serializer << static_cast<int>(mWriter->size());
+        }
+        ok = mWriter->patch(0, header) && mWriter->patch(mSizeOffset, size);
+    }
+    if (ok && mDurability != NoSync)
+        ok = mWriter->sync();
+    ok = mWriter->close() && ok;
+    const int err = mWriter->error();
+    mSerializer.reset();
+    mWriter = nullptr;
+    if (!ok) {
+        Path::rm(mTempFilePath);
+        mError = String::format<128>("write error: %d %s", err, strerror(err));
+        return false;
+    }
+    if (rename(mTempFilePath.c_str(), mPath.c_str())) {
+        Path::rm(mTempFilePath);
+        mError = String::format<128>("rename error: %d %s", errno, Rct::strerror().c_str());
+        return false;
+    }
+    if (mDurability == SyncFileAndDirectory && !syncDirectory(mPath.parentDir())) {
+        mError = String::format<128>("fsync error: %d %s", errno, Rct::strerror().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool DataFile::open(Mode mode)
+{
+    assert(!mWriter);
+    if (mode == Write) {
+        if (!Path::mkdir(mPath.parentDir()))
+            return false;
+        mTempFilePath = mPath + "XXXXXX";
+        const int ret = mkstemp(&mTempFilePath[0]);
+        if (ret == -1) {
+            mError = String::format<128>("mkstemp failure %d (%s)", errno, Rct::strerror().c_str());
+            return false;
+        }
+        mWriter = new Writer(ret);
+        mSerializer.reset(new Serializer(std::unique_ptr<Serializer::Buffer>(mWriter)));
+        // both are written again by flush()
+        operator<<(mVersion);
+        mSizeOffset = mWriter->pos();
+        operator<<(static_cast<int>(0));
+        if (mBlockSize)
+            mWriter->setCompression(mCompression, mBlockSize);
+        if (!mWriter->writeHeader()) {
+            mError = String::format<128>("write error: %d %s", mWriter->error(), strerror(mWriter->error()));
+            mSerializer.reset();
+            mWriter = nullptr;
+            Path::rm(mTempFilePath);
+            return false;
+        }
+        mSerializer->setEncoding(mEncoding);
+        return true;
+    }
+
+    if (!mPath.exists())
+        return false;
+    if (!mMapping.open(mPath) || !mMapping.size()) {
+        mError = "Read error " + mPath;
+        return false;
+    }
+    const char *data = mMapping.filePtr<char>();
+    const size_t fileSize = mMapping.size();
+    const size_t headerSize = Serializer::sizeOf<int>() * 2;
+    if (fileSize < headerSize) {
+        mError = String::format<128>("%s seems to be corrupted. Size is only %zu", mPath.c_str(), fileSize);
+        return false;
+    }
+    int version, fs;
+    {
+        Deserializer header(data, headerSize);
+        header >> version >> fs;
+    }
+    mEncoding = version & CompactVersion ? Serializer::Compact : Serializer::Native;
+    const bool sectioned = version & SectionedVersion;
+    mChecksummed = version & ChecksummedVersion;
+    const bool blockCompressed = version & BlockCompressedVersion;
+    version &= ~(CompactVersion | SectionedVersion | ChecksummedVersion | BlockCompressedVersion);
+    if (version != mVersion) {
+        mError = String::format<128>("Wrong database version. Expected %d, got %d for %s",
+                                     mVersion, version, mPath.c_str());
+        return false;
+    }
+    if (static_cast<size_t>(fs) != fileSize) {
+        mError = String::format<128>("%s seems to be corrupted. Size should have been %zu but was %d",
+                                     mPath.c_str(), fileSize, fs);
+        return false;
+    }
+    mBlocks.clear();
+    mUncompressed.reset();
+    mContentEnd = fileSize;
+    if (blockCompressed) {
+        if (!readBlockIndex(headerSize))
+            return false;
+        mContentEnd = mUncompressedSize;
+    }
+    if (mChecksummed) {
+        if (mContentEnd < headerSize + Serializer::sizeOf<uint32_t>()) {
+            mError = String::format<128>("%s seems to be corrupted. No checksum", mPath.c_str());
+            return false;
+        }
+        mContentEnd -= Serializer::sizeOf<uint32_t>();
+    }
+    if (sectioned) {
+        if (!readIndex(headerSize))
+            return false;
+    } else {
+        // most files are read front to back, once
+        mMapping.advise(MemoryMappedFile::SEQUENTIAL);
+        if (!verify())
+            return false;
+        const char *content = contents(headerSize, mContentEnd - headerSize);
+        if (!content)
+            return false;
+        mDeserializer.reset(new Deserializer(content, mContentEnd - headerSize));
+    }
+    mDeserializer->setEncoding(mEncoding);
+    return true;
+}
+
+bool DataFile::verify()
+{
+    assert(mMapping.isOpen());
+    if (!mChecksummed)
+        return true;
+    const size_t headerSize = Serializer::sizeOf<int>() * 2;
+    const size_t checksumSize = Serializer::sizeOf<uint32_t>();
+    const char *data = contents(headerSize, mContentEnd + checksumSize - headerSize);
+    if (!data)
+        return false;
+    uint32_t checksum;
+    {
+        Deserializer trailer(data + mContentEnd - headerSize, checksumSize);
+        trailer >> checksum;
+    }
+    if (Crc32c::checksum(data, mContentEnd - headerSize) != checksum) {
+        mError = String::format<128>("%s seems to be corrupted. Checksum mismatch", mPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool DataFile::readIndex(size_t headerSize)
+{
+    if (mContentEnd < headerSize + TrailerSize) {
+        mError = String::format<128>("%s seems to be corrupted. No section index", mPath.c_str());
+        return false;
+    }
+    const char *data = contents(mContentEnd - TrailerSize, TrailerSize);
+    if (!data)
+        return false;
+    uint32_t indexOffset, indexChecksum;
+    {
+        Deserializer trailer(data, TrailerSize);
+        trailer >> indexOffset >> indexChecksum;
+    }
+    const size_t indexEnd = mContentEnd - TrailerSize;
+    if (indexOffset < headerSize || indexOffset > indexEnd
+        || !(data = contents(indexOffset, indexEnd - indexOffset))
+        || Crc32c::checksum(data, indexEnd - indexOffset) != indexChecksum) {
+        mError = String::format<128>("%s seems to be corrupted. Invalid section index", mPath.c_str());
+        return false;
+    }
+    Deserializer index(data, indexEnd - indexOffset);
+    uint32_t count;
+    index >> count;
+    // values written before the first section
+    size_t streamEnd = indexOffset;
+    mSections.clear();
+    for (uint32_t i=0; i<count; ++i) {
+        Section section;
+        index >> section.name >> section.offset >> section.length >> section.checksum;
+        section.verified = false;
+        if (section.offset < headerSize || section.offset > indexOffset
+            || section.length > indexOffset - section.offset) {
+            mError = String::format<128>("%s seems to be corrupted. Section %s is out of bounds",
+                                         mPath.c_str(), section.name.constData());
+            mSections.clear();
+            return false;
+        }
+        streamEnd = std::min<size_t>(streamEnd, section.offset);
+        mSections.append(std::move(section));
+    }
+    data = contents(headerSize, streamEnd - headerSize);
+    if (!data)
+        return false;
+    mDeserializer.reset(new Deserializer(data, streamEnd - headerSize));
+    return true;
+}
+
+bool DataFile::readBlockIndex(size_t headerSize)
+{
+    const char *data = mMapping.filePtr<char>();
+    const size_t fileSize = mMapping.size();
+    bool ok = fileSize >= headerSize + TrailerSize;
+    uint32_t indexOffset = 0, indexChecksum = 0;
+    if (ok) {
+        Deserializer trailer(data + fileSize - TrailerSize, TrailerSize);
+        trailer >> indexOffset >> indexChecksum;
+        const size_t indexEnd = fileSize - TrailerSize;
+        ok = indexOffset >= headerSize && indexOffset <= indexEnd
+            && Crc32c::checksum(data + indexOffset, indexEnd - indexOffset) == indexChecksum;
+    }
+    uint32_t blockSize = 0, uncompressedSize = 0, count = 0;
+    if (ok) {
+        Deserializer index(data + indexOffset, fileSize - TrailerSize - indexOffset);
+        index >> blockSize >> uncompressedSize >> count;
+        ok = blockSize && uncompressedSize >= headerSize
+            && count == (uncompressedSize - headerSize + blockSize - 1) / blockSize;
+        mBlocks.reserve(count);
+        for (uint32_t i=0; ok && i<count; ++i) {
+            Block block;
+            index >> block.offset >> block.size >> block.compressed;
+            block.loaded = false;
+            ok = block.offset >= headerSize && block.offset <= indexOffset
+                && block.size <= indexOffset - block.offset;
+            mBlocks.append(block);
+        }
+    }
+    if (!ok) {
+        mError = String::format<128>("%s seems to be corrupted. Invalid block index", mPath.c_str());
+        mBlocks.clear();
+        return false;
+    }
+    mBlockSize = blockSize;
+    mUncompressedSize = uncompressedSize;
+    // only the pages of blocks that are decompressed get touched
+    mUncompressed.reset(new char[uncompressedSize]);
+    memcpy(mUncompressed.get(), data, headerSize);
+    return true;
+}
+
+const char *DataFile::contents(size_t offset, size_t length)
+{
+    if (!mUncompressed)
+        return mMapping.filePtr<char>() + offset;
+    assert(offset + length <= mUncompressedSize);
+    if (!loadBlocks(offset, length))
+        return nullptr;
+    return mUncompressed.get() + offset;
+}
+
+bool DataFile::loadBlocks(size_t offset, size_t length)
+{
+    const size_t headerSize = Serializer::sizeOf<int>() * 2;
+    if (offset + length <= headerSize)
+        return true;
+    const size_t first = (std::max(offset, headerSize) - headerSize) / mBlockSize;
+    const size_t last = (offset + length - headerSize - 1) / mBlockSize;
+    List<size_t> missing;
+    for (size_t i=first; i<=last; ++i) {
+        if (!mBlocks.at(i).loaded)
+            missing.append(i);
+    }
+    if (missing.isEmpty())
+        return true;
+
+    bool ok = true;
+    if (missing.size() > 1) {
+        ThreadPool *pool = ThreadPool::instance();
+        // every block goes to its own part of mUncompressed
+        List<std::shared_ptr<FunctionJob> > jobs;
+        std::unique_ptr<bool[]> results(new bool[missing.size()]);
+        for (size_t i=1; i<missing.size(); ++i) {
+            bool *result = &results[i];
+            const size_t block = missing.at(i);
+            jobs.append(std::make_shared<FunctionJob>([this, result, block]() { *result = loadBlock(block); }));
+            pool->start(jobs.last());
+        }
+        results[0] = loadBlock(missing.first());
+        for (const std::shared_ptr<FunctionJob> &job : jobs)
+            FunctionJob::finish(pool, job);
+        for (size_t i=0; i<missing.size(); ++i)
+            ok = ok && results[i];
+    } else {
+        for (size_t block : missing) {
+            if (!loadBlock(block)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (!ok) {
+        mError = String::format<128>("%s seems to be corrupted. Can't decompress", mPath.c_str());
+        return false;
+    }
+    for (size_t block : missing)
+        mBlocks[block].loaded = true;
+    return true;
+}
+
+bool DataFile::loadBlock(size_t index)
+{
+    const size_t headerSize = Serializer::sizeOf<int>() * 2;
+    const Block &block = mBlocks.at(index);
+    const size_t offset = headerSize + index * mBlockSize;
+    const size_t size = std::min<size_t>(mBlockSize, mUncompressedSize - offset);
+    const char *data = mMapping.filePtr<char>() + block.offset;
+    if (!block.compressed) {
+        if (block.size != size)
+            return false;
+        memcpy(mUncompressed.get() + offset, data, size);
+        return true;
+    }
+    String uncompressed;
+    if (!Compression::uncompressTagged(data, block.size, uncompressed) || uncompressed.size() != size)
+        return false;
+    memcpy(mUncompressed.get() + offset, uncompressed.constData(), size);
+    return true;
+}
+
+bool DataFile::beginSection(const String &name)
+{
+    assert(mSerializer);
+    assert(!mInSection);
+    if (sectionIndex(name) != -1) {
+        mError = String::format<128>("Section %s already exists in %s", name.constData(), mPath.c_str());
+        return false;
+    }
+    Section section;
+    section.name = name;
+    section.offset = mWriter->pos();
+    section.length = section.checksum = 0;
+    section.verified = true;
+    mSections.append(std::move(section));
+    mWriter->checksum();
+    mWriter->sectionCrc.reset();
+    mInSection = true;
+    return true;
+}
+
+bool DataFile::endSection()
+{
+    assert(mInSection);
+    mWriter->checksum();
+    Section &section = mSections.last();
+    section.length = mWriter->pos() - section.offset;
+    section.checksum = mWriter->sectionCrc.value();
+    mInSection = false;
+    return !mSerializer->hasError();
+}
+
+List<String> DataFile::sections() const
+{
+    List<String> ret;
+    ret.reserve(mSections.size());
+    for (const Section &section : mSections)
+        ret.append(section.name);
+    return ret;
+}
+
+int DataFile::sectionIndex(const String &name) const
+{
+    for (size_t i=0; i<mSections.size(); ++i) {
+        if (mSections.at(i).name == name)
+            return i;
+    }
+    return -1;
+}
+
+bool DataFile::openSection(const String &name)
+{
+    assert(mMapping.isOpen());
+    const int idx = sectionIndex(name);
+    if (idx == -1) {
+        mError = String::format<128>("No section %s in %s", name.constData(), mPath.c_str());
+        return false;
+    }
+    Section &section = mSections[idx];
+    const char *data = contents(section.offset, section.length);
+    if (!data)
+        return false;
+    if (!section.verified) {
+        if (Crc32c::checksum(data, section.length) != section.checksum) {
+            mError = String::format<128>("%s seems to be corrupted. Checksum mismatch in section %s",
+                                         mPath.c_str(), name.constData());
+            return false;
+        }
+        section.verified = true;
+    }
+    mDeserializer.reset(new Deserializer(data, section.length));
+    mDeserializer->setEncoding(mEncoding);
+    return true;
+}
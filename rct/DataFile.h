@@ -1,101 +1,100 @@
 #ifndef DataFile_h
 #define DataFile_h
 
-#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#include <memory>
+
+#include "Compression.h"
+#include "List.h"
+#include "MemoryMappedFile.h"
 #include "Path.h"
 #include "Serializer.h"
 
+/**
+ * Files written with Serializer::Compact have CompactVersion set in the
+ * stored version, reading picks the encoding up from there.
+ *
+ * Files are read through a read-only mapping rather than loaded into
+ * memory, so only the pages that are touched are read and the kernel can
+ * drop them again under memory pressure.
+ *
+ * Data can be split into named sections that are written one after the
+ * other and read back in any order. Their offsets, lengths and checksums
+ * are stored in an index at the end of the file, so opening a section
+ * only touches that index and the section itself. Values written outside
+ * of sections have to come before the first section. Such files have
+ * SectionedVersion set in the stored version.
+ *
+ * Writes are buffered and end with a CRC-32C of everything after the
+ * header, which open() checks for files without sections. Files are
+ * written to a temporary file that replaces the old one in flush(), how
+ * hard that tries to survive a crash is up to the Durability.
+ *
+ * With setCompression() everything after the header is compressed in
+ * independent blocks, listed in a block index at the end of the file.
+ * Blocks are compressed in parallel on ThreadPool::instance() and
+ * readers only decompress the blocks they touch, several at a time on
+ * the same pool, or on the calling thread when the pool is busy, so
+ * this works from a job on that pool too. Offsets, sections and
+ * checksums all refer to the uncompressed data. Such files have
+ * BlockCompressedVersion set in the stored version.
+ */
 class DataFile
 {
 public:
-    DataFile(const Path &path, int version)
-        : mFile(nullptr), mSizeOffset(-1), mSerializer(nullptr), mDeserializer(nullptr), mPath(path), mVersion(version)
-    {}
+    enum {
+        CompactVersion = 0x40000000,
+        SectionedVersion = 0x20000000,
+        ChecksummedVersion = 0x10000000,
+        BlockCompressedVersion = 0x08000000
+    };
+    enum { DefaultBlockSize = 256 * 1024 };
 
-    ~DataFile()
-    {
-        delete mDeserializer;
-        if (mFile)
-            flush();
-    }
+    enum Durability {
+        NoSync, // leave it to the kernel when the data hits the disk
+        SyncFile, // fdatasync() the file before it replaces the old one
+        SyncFileAndDirectory // also fsync() the directory after the rename
+    };
+
+    DataFile(const Path &path, int version, Serializer::Encoding encoding = Serializer::Native);
+    ~DataFile();
 
     Path path() const { return mPath; }
+    Serializer::Encoding encoding() const { return mEncoding; }
 
-    bool flush()
-    {
-        if (!mFile)
-            return false;
-        const int size = ftell(mFile);
-        assert(mSizeOffset != -1);
-        fseek(mFile, mSizeOffset, SEEK_SET);
-        operator<<(size);
-
-        fclose(mFile);
-        mFile = nullptr;
-        delete mSerializer;
-        mSerializer = nullptr;
-        if (rename(mTempFilePath.c_str(), mPath.c_str())) {
-            Path::rm(mTempFilePath);
-            mError = String::format<128>("rename error: %d %s", errno, Rct::strerror().c_str());
-            return false;
-        }
-        return true;
-    }
+    Durability durability() const { return mDurability; }
+    void setDurability(Durability durability) { mDurability = durability; }
+
+    /**
+     * Compresses blocks of \a blockSize bytes according to \a policy,
+     * blocks that don't compress well enough are stored as is. Has to be
+     * called before open(Write).
+     */
+    void setCompression(const Compression::Policy &policy, size_t blockSize = DefaultBlockSize);
+
+    /**
+     * Reserves disk space for a file of about \a size bytes while
+     * writing, if the platform supports it.
+     */
+    void preallocate(size_t size);
+
+    /**
+     * Checks the checksum of the whole file. open() does that for files
+     * without sections, sections are checked as they're opened. Files
+     * from before checksums were added always pass.
+     */
+    bool verify();
+
+    bool flush();
 
     enum Mode {
         Read,
         Write
     };
     String error() const { return mError; }
-    bool open(Mode mode)
-    {
-        assert(!mFile);
-        if (mode == Write) {
-            if (!Path::mkdir(mPath.parentDir()))
-                return false;
-            mTempFilePath = mPath + "XXXXXX";
-            const int ret = mkstemp(&mTempFilePath[0]);
-            if (ret == -1) {
-                mError = String::format<128>("mkstemp failure %d (%s)", errno, Rct::strerror().c_str());
-                return false;
-            }
-            mFile = fdopen(ret, "w");
-            if (!mFile) {
-                mError = String::format<128>("fdopen failure %d (%s)", errno, Rct::strerror().c_str());
-                close(ret);
-                return false;
-            }
-            mSerializer = new Serializer(mFile);
-            operator<<(mVersion);
-            mSizeOffset = ftell(mFile);
-            operator<<(static_cast<int>(0));
-            return true;
-        } else {
-            mContents = mPath.readAll();
-            if (mContents.empty()) {
-                if (mPath.exists())
-                    mError = "Read error " + mPath;
-                return false;
-            }
-            mDeserializer = new Deserializer(mContents);
-            int version;
-            (*mDeserializer) >> version;
-            if (version != mVersion) {
-                mError = String::format<128>("Wrong database version. Expected %d, got %d for %s",
-                                             mVersion, version, mPath.c_str());
-                return false;
-            }
-            int fs;
-            (*mDeserializer) >> fs;
-            if (static_cast<size_t>(fs) != mContents.size()) {
-                mError = String::format<128>("%s seems to be corrupted. Size should have been %zu but was %d",
-                                             mPath.c_str(), mContents.size(), fs);
-                return false;
-            }
-            return true;
-        }
-    }
+    bool open(Mode mode);
 
     template <typename T> DataFile &operator<<(const T &t)
     {
@@ -109,14 +108,75 @@ public:
         (*mDeserializer) >> t;
         return *this;
     }
+
+    /**
+     * Everything written between beginSection() and endSection() goes
+     * into section \a name. Names have to be unique.
+     */
+    bool beginSection(const String &name);
+    bool endSection();
+    template <typename T> bool writeSection(const String &name, const T &value)
+    {
+        if (!beginSection(name))
+            return false;
+        operator<<(value);
+        return endSection();
+    }
+
+    List<String> sections() const;
+    bool hasSection(const String &name) const { return sectionIndex(name) != -1; }
+    /**
+     * Verifies the checksum of section \a name the first time it's opened
+     * and points operator>>() at the start of it.
+     */
+    bool openSection(const String &name);
+    template <typename T> bool readSection(const String &name, T &value)
+    {
+        if (!openSection(name))
+            return false;
+        operator>>(value);
+        return true;
+    }
 private:
-    FILE *mFile;
+    struct Section {
+        String name;
+        uint32_t offset, length, checksum;
+        bool verified;
+    };
+    class Writer;
+
+    struct Block {
+        uint32_t offset, size;
+        bool compressed, loaded;
+    };
+
+    int sectionIndex(const String &name) const;
+    bool readIndex(size_t headerSize);
+    bool readBlockIndex(size_t headerSize);
+    // the uncompressed contents at offset, null if they can't be read
+    const char *contents(size_t offset, size_t length);
+    bool loadBlocks(size_t offset, size_t length);
+    bool loadBlock(size_t index);
+
     int mSizeOffset;
-    Serializer *mSerializer;
-    Deserializer *mDeserializer;
+    std::unique_ptr<Serializer> mSerializer;
+    Writer *mWriter;
+    std::unique_ptr<Deserializer> mDeserializer;
     Path mPath, mTempFilePath;
-    String mContents;
+    MemoryMappedFile mMapping;
     String mError;
     const int mVersion;
+    Serializer::Encoding mEncoding;
+    Durability mDurability;
+    List<Section> mSections;
+    bool mInSection;
+    bool mChecksummed;
+    size_t mContentEnd;
+    Compression::Policy mCompression;
+    size_t mBlockSize;
+    List<Block> mBlocks;
+    // the whole file uncompressed, blocks are filled in as they're read
+    std::unique_ptr<char[]> mUncompressed;
+    size_t mUncompressedSize;
 };
 #endif
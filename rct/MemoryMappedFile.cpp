@@ -264,6 +264,35 @@ bool MemoryMappedFile::open(const Path &f_filename, AccessType f_access,
     return true;
 }
 
+bool MemoryMappedFile::advise(Advice f_advice)
+{
+    if(!mpMapped) return false;
+
+#ifdef _WIN32
+    (void)f_advice;
+    return false;
+#else
+    int advice = POSIX_MADV_NORMAL;
+    switch(f_advice)
+    {
+    case NORMAL: advice = POSIX_MADV_NORMAL; break;
+    case SEQUENTIAL: advice = POSIX_MADV_SEQUENTIAL; break;
+    case RANDOM: advice = POSIX_MADV_RANDOM; break;
+    case WILL_NEED: advice = POSIX_MADV_WILLNEED; break;
+    case DONT_NEED: advice = POSIX_MADV_DONTNEED; break;
+    }
+
+    const int ret = posix_madvise(mpMapped, mFileSize, advice);
+    if(ret != 0)
+    {
+        error() << "Could not advise " << mFilename
+                << ". errno=" << ret;
+        return false;
+    }
+    return true;
+#endif
+}
+
 void MemoryMappedFile::close()
 {
 #ifdef _WIN32
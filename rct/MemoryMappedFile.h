@@ -66,6 +66,18 @@ public:
         DONT_LOCK
     };
 
+    /**
+     * How the mapping is going to be accessed, see advise().
+     */
+    enum Advice
+    {
+        NORMAL,
+        SEQUENTIAL, ///< aggressive read-ahead, pages behind can be dropped early
+        RANDOM,     ///< no read-ahead
+        WILL_NEED,  ///< start reading the whole file in now
+        DONT_NEED   ///< the pages can be reclaimed
+    };
+
 public:  // ctors + dtors
 
     MemoryMappedFile();
@@ -114,6 +126,12 @@ public:  // methods
 
     bool isOpen() const {return mAccessType != NO_ACCESS;}
 
+    /**
+     * Tells the kernel how the mapping is going to be used. Only a hint,
+     * returns false if it's not supported, e.g. on Windows.
+     */
+    bool advise(Advice advice);
+
     AccessType accessType() const {return mAccessType;}
 
     /**
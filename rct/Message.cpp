@@ -1,6 +1,9 @@
 #include "Message.h"
 
 #include <stdint.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include <cstdlib>
 #include <algorithm>
 #include <functional>
@@ -9,9 +12,11 @@
 #include <mutex>
 #include <utility>
 
+#include "ChunkMessage.h"
 #include "FinishMessage.h"
 #include "QuitMessage.h"
 #include "ResponseMessage.h"
+#include "SharedMemoryMessage.h"
 #include "Serializer.h"
 #include "rct/Log.h"
 #include "rct/Map.h"
@@ -19,31 +24,121 @@
 #include "rct/String.h"
 
 std::mutex Message::sMutex;
-Map<uint8_t, Message::MessageCreatorBase *> Message::sFactory;
+std::atomic<Message::MessageCreatorBase *> Message::sFactory[256];
+Map<uint8_t, Compression::Policy> Message::sCompressionPolicies;
+std::atomic<int> Message::sCompressionPolicyCount(0);
 
-void Message::prepare(int version, String &header, String &value) const
+Message::~Message()
 {
-    if (mHeader.empty() || version != mVersion) {
-        if (version != mVersion) {
-            mHeader.clear();
-            mValue.clear();
-        }
-        {
-            Serializer s(mValue);
-            encode(s);
-        }
-        if (mFlags & Compressed) {
-            mValue = mValue.compress();
-        }
+#ifndef _WIN32
+    for (int fd : mFileDescriptors)
+        ::close(fd);
+#endif
+}
+
+void Message::prepare(int version, String &header, String &value, const Compression::Policy *policy) const
+{
+    if (mHeader.empty() || version != mVersion || policy != mPreparedPolicy) {
+        mHeader.clear();
+        mValue.clear();
+        mPreparedFlags = encodeValue(mValue, policy);
         Serializer s(mHeader);
-        encodeHeader(s, mValue.size(), version);
+        encodeHeader(s, mValue.size(), version, mPreparedFlags);
         mVersion = version;
+        mPreparedPolicy = policy;
     }
     value = mValue;
     header = mHeader;
 }
 
+uint8_t Message::encodeValue(String &value, const Compression::Policy *policy) const
+{
+    {
+        Serializer s(value);
+        if (mFlags & Compact)
+            s.setEncoding(Serializer::Compact);
+        encode(s);
+    }
+    uint8_t flags = mFlags & ~TransportFlags;
+    Compression::Policy typePolicy;
+    if (sCompressionPolicyCount.load(std::memory_order_relaxed) && compressionPolicy(mMessageId, &typePolicy))
+        policy = &typePolicy;
+    if (policy) {
+        flags &= ~Compressed;
+        String compressed;
+        if (Compression::compress(*policy, value.constData(), value.size(), compressed)) {
+            value = std::move(compressed);
+            flags |= Compressed | CodecTagged;
+        }
+    } else if (flags & Compressed) {
+        value = value.compress();
+    }
+    return flags;
+}
+
+void Message::setCompressionPolicy(uint8_t messageId, const Compression::Policy &policy)
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+    sCompressionPolicies[messageId] = policy;
+    sCompressionPolicyCount = sCompressionPolicies.size();
+}
+
+void Message::clearCompressionPolicy(uint8_t messageId)
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+    sCompressionPolicies.remove(messageId);
+    sCompressionPolicyCount = sCompressionPolicies.size();
+}
+
+bool Message::compressionPolicy(uint8_t messageId, Compression::Policy *policy)
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+    const auto it = sCompressionPolicies.find(messageId);
+    if (it == sCompressionPolicies.end())
+        return false;
+    if (policy)
+        *policy = it->second;
+    return true;
+}
+
+std::shared_ptr<const String> Message::encodeShared(int version) const
+{
+    if (mShared && mSharedVersion == version)
+        return mShared;
+
+#ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
+    const size_t size = String::npos;
+#else
+    const size_t size = mFlags & Compressed || hasCompressionPolicy(mMessageId) ? String::npos : encodedValueSize();
+#endif
+    std::shared_ptr<String> frame = std::make_shared<String>();
+    if (size != String::npos) {
+        frame->reserve(size + HeaderExtra + sizeof(uint32_t));
+        Serializer serializer(*frame);
+        encodeHeader(serializer, size, version);
+        encode(serializer);
+    } else {
+        String value;
+        const uint8_t flags = encodeValue(value, nullptr);
+        frame->reserve(value.size() + HeaderExtra + sizeof(uint32_t));
+        Serializer serializer(*frame);
+        encodeHeader(serializer, value.size(), version, flags);
+        frame->append(value);
+    }
+    if (mFlags & MessageCache) {
+        mShared = frame;
+        mSharedVersion = version;
+    }
+    return frame;
+}
+
 std::shared_ptr<Message> Message::create(int version, const char *data, int size, MessageError *errorPtr)
+{
+    return create(version, std::shared_ptr<Buffer>(), data, size, errorPtr);
+}
+
+std::shared_ptr<Message> Message::create(int version, const std::shared_ptr<Buffer> &frame,
+                                         const char *data, int size, MessageError *errorPtr, TraceStamps *trace)
 {
     auto sendError = [errorPtr](MessageErrorType type, const String &text) {
         if (errorPtr) {
@@ -85,36 +180,82 @@ std::shared_ptr<Message> Message::create(int version, const char *data, int size
     ds >> flags;
     data += Serializer::sizeOf(flags);
     size -= Serializer::sizeOf(flags);
+    uint32_t requestId = 0;
+    if (flags & Correlated) {
+        if (size < static_cast<int>(Serializer::sizeOf(requestId))) {
+            sendError(Message_LengthError, "Message too short for request id");
+            return std::shared_ptr<Message>();
+        }
+        Deserializer rds(data, Serializer::sizeOf(requestId));
+        rds >> requestId;
+        data += Serializer::sizeOf(requestId);
+        size -= Serializer::sizeOf(requestId);
+    }
+    if (flags & Traced) {
+        if (size < static_cast<int>(TraceStampsSize)) {
+            sendError(Message_LengthError, "Message too short for trace stamps");
+            return std::shared_ptr<Message>();
+        }
+        if (trace) {
+            Deserializer tds(data, TraceStampsSize);
+            tds >> trace->id >> trace->sent >> trace->encoded;
+        }
+        data += TraceStampsSize;
+        size -= TraceStampsSize;
+    }
     String uncompressed;
+    std::shared_ptr<Buffer> owner = frame;
     if (flags & Compressed) {
-        uncompressed = String::uncompress(data, size);
+        if (!(flags & CodecTagged)) {
+            if (size && !Compression::uncompress(Compression::Zlib, data, size, uncompressed)) {
+                sendError(Message_CreateError, String::format<128>("Can't uncompress message id: %d", id));
+                return std::shared_ptr<Message>();
+            }
+        } else if (!Compression::uncompressTagged(data, size, uncompressed)) {
+            sendError(Message_CreateError, String::format<128>("Can't uncompress message id: %d, codec: %d",
+                                                               id, size ? static_cast<uint8_t>(*data) : 0));
+            return std::shared_ptr<Message>();
+        }
         data = uncompressed.c_str();
         size = uncompressed.size();
+        // uncompressed doesn't outlive this call so views can't point into it
+        owner.reset();
     }
-    std::lock_guard<std::mutex> lock(sMutex);
-    if (!sFactory.contains(ResponseMessage::MessageId)) {
-        atexit(Message::cleanup);
-        sFactory[ResponseMessage::MessageId] = new MessageCreator<ResponseMessage>();
-        sFactory[FinishMessage::MessageId] = new MessageCreator<FinishMessage>();
-        sFactory[QuitMessage::MessageId] = new MessageCreator<QuitMessage>();
-    }
+    registerBuiltins();
 
-    MessageCreatorBase *base = sFactory.value(id);
+    MessageCreatorBase *base = sFactory[id].load(std::memory_order_acquire);
     if (!base) {
         sendError(Message_IdError, String::format<128>("Invalid message id %d, data: %d bytes", id, size));
         return std::shared_ptr<Message>();
     }
-    std::shared_ptr<Message> message(base->create(data, size));
+    std::shared_ptr<Message> message = base->create(owner, data, size, flags & Compact ? Serializer::Compact : Serializer::Native);
     if (!message) {
         sendError(Message_CreateError, String::format<128>("Can't create message from data id: %d, data: %d bytes", id, size));
+    } else {
+        message->mFlags |= (flags & (FileDescriptors | Correlated | Traced | TraceCapable));
+        message->mRequestId = requestId;
     }
     return message;
 }
 
+void Message::registerBuiltins()
+{
+    static std::once_flag sBuiltins;
+    std::call_once(sBuiltins, addBuiltins);
+}
+
+void Message::addBuiltins()
+{
+    atexit(Message::cleanup);
+    addCreator<ResponseMessage>(0);
+    addCreator<FinishMessage>(0);
+    addCreator<QuitMessage>(0);
+    addCreator<ChunkMessage>(0);
+    addCreator<SharedMemoryMessage>(0);
+}
+
 void Message::cleanup()
 {
-    std::lock_guard<std::mutex> lock(sMutex);
-    for (Map<uint8_t, MessageCreatorBase *>::const_iterator it = sFactory.begin(); it != sFactory.end(); ++it)
-        delete it->second;
-    sFactory.clear();
+    for (std::atomic<MessageCreatorBase *> &creator : sFactory)
+        delete creator.exchange(nullptr);
 }
@@ -1,96 +1,280 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
+#include <rct/Compression.h>
+#include <rct/PoolAllocator.h>
 #include <rct/Serializer.h>
+#include <atomic>
 #include <mutex>
 #include <memory>
 
+/**
+ * Generates encode(), decode() and an exact encodedSize() for a Message
+ * subclass from its list of members, e.g. RCT_MESSAGE_FIELDS(mPath, mFlags).
+ * Fields are serialized in the order given. As long as encodedSizeOf() is
+ * known for every field the message is written straight to the socket
+ * instead of going through a temporary String.
+ */
+#define RCT_MESSAGE_FIELDS(...)                                         \
+    virtual void encode(Serializer &serializer) const override          \
+    {                                                                   \
+        serializeFields(serializer, __VA_ARGS__);                       \
+    }                                                                   \
+    virtual void decode(Deserializer &deserializer) override            \
+    {                                                                   \
+        deserializeFields(deserializer, __VA_ARGS__);                   \
+    }                                                                   \
+    virtual size_t encodedSize() const override                         \
+    {                                                                   \
+        return encodedSizeOfFields(__VA_ARGS__);                        \
+    }
+
 class Message
 {
 public:
+    /**
+     * Apart from the first three, which predate it, rct's own messages use
+     * ids from ReservedMessageId up. Applications should stay below it.
+     */
     enum {
         ResponseId = 1,
         FinishMessageId = 2,
-        QuitMessageId = 3
+        QuitMessageId = 3,
+        ReservedMessageId = 0xf0,
+        ChunkMessageId = ReservedMessageId,
+        SharedMemoryMessageId = ReservedMessageId + 1
     };
 
     Message(uint8_t id, uint8_t f = None)
-        : mMessageId(id), mFlags(f), mVersion(0)
-    {}
-    virtual ~Message()
+        : mMessageId(id), mFlags(f), mVersion(0), mRequestId(0), mSharedVersion(0), mPreparedFlags(0),
+          mPreparedPolicy(nullptr)
     {}
+    virtual ~Message();
 
     void clearCache()
     {
         mHeader.clear();
         mValue.clear();
         mVersion = 0;
+        mShared.reset();
     }
 
     enum Flag {
         None = 0x0,
         Compressed = 0x1,
-        MessageCache = 0x2
+        MessageCache = 0x2,
+        FileDescriptors = 0x4,
+        Correlated = 0x8,
+        Traced = 0x10, // on the wire: the header carries TraceStamps
+        CodecTagged = 0x20, // on the wire: compressed payload starts with a Compression::Codec
+        TraceCapable = 0x40, // on the wire: the sender understands Traced, see Connection::setTracing()
+        Compact = 0x80 // encoded with Serializer::Compact, the receiver needs to support it
+    };
+    enum { TransportFlags = FileDescriptors | Correlated | Traced | CodecTagged | TraceCapable };
+
+    /**
+     * Stamps the sender puts in the header of a Traced message, in
+     * microseconds on its monotonic clock.
+     */
+    struct TraceStamps {
+        uint32_t id = 0;
+        uint64_t sent = 0;
+        uint64_t encoded = 0;
     };
 
     uint8_t flags() const { return mFlags; }
     uint8_t messageId() const { return mMessageId; }
 
+    /**
+     * The id of the request this message belongs to, if it was sent with
+     * Connection::request() or Connection::reply(). 0 otherwise.
+     */
+    uint32_t requestId() const { return mRequestId & ~ReplyBit; }
+    bool isReply() const { return mRequestId & ReplyBit; }
+
+    /**
+     * File descriptors received along with this message, see
+     * Connection::sendFileDescriptors(). Descriptors that haven't been taken
+     * are closed when the message is destroyed.
+     */
+    const List<int> &fileDescriptors() const { return mFileDescriptors; }
+    List<int> takeFileDescriptors() { return std::move(mFileDescriptors); }
+
     virtual void encode(Serializer &/* serializer */) const = 0;
     virtual void decode(Deserializer &/* deserializer */) = 0;
 
     virtual size_t encodedSize() const { return String::npos; }
+
+    /**
+     * Returns the complete frame, header included, for protocol \a version.
+     * It can be handed to any number of connections with
+     * Connection::sendEncoded() without copying. Kept around if
+     * MessageCache is set.
+     */
+    std::shared_ptr<const String> encodeShared(int version) const;
     enum MessageErrorType {
         Message_Success,
         Message_VersionError,
         Message_IdError,
         Message_LengthError,
-        Message_CreateError
+        Message_CreateError,
+        Message_SequenceError
     };
     struct MessageError {
         MessageErrorType type = Message_Success;
         String text;
     };
     static std::shared_ptr<Message> create(int version, const char *data, int size, MessageError *error = nullptr);
-    template<typename T> static void registerMessage()
+    /**
+     * Like create() but \a data lives inside \a frame. Messages may keep a
+     * reference to \a frame and decode StringViews pointing into it rather
+     * than copying, see Deserializer::owner().
+     */
+    static std::shared_ptr<Message> create(int version, const std::shared_ptr<Buffer> &frame,
+                                           const char *data, int size, MessageError *error = nullptr,
+                                           TraceStamps *trace = nullptr);
+    /**
+     * Registers T to be created for messages with id T::MessageId. With a
+     * \a poolSize decoded messages are allocated from a per thread pool of
+     * up to that many recycled objects. That only pays off when messages
+     * are freed on the thread that decoded them, e.g. the connection's,
+     * one freed elsewhere goes to that thread's pool instead. Registering T
+     * again does nothing, registering another type for an id that's taken
+     * fails.
+     */
+    template<typename T> static bool registerMessage(size_t poolSize = 0)
     {
-        const uint8_t id = T::MessageId;
-        std::lock_guard<std::mutex> lock(sMutex);
-        MessageCreatorBase *&base = sFactory[id];
-        if (!base) {
-            base = new MessageCreator<T>();
-        }
+        registerBuiltins();
+        return addCreator<T>(poolSize);
     }
     static void cleanup();
+
+    /**
+     * Compress all messages of type \a messageId according to \a policy,
+     * whether or not they have the Compressed flag. Takes precedence over
+     * Connection::setCompressionPolicy(). Without a policy Compressed
+     * messages use zlib at its best compression level.
+     */
+    static void setCompressionPolicy(uint8_t messageId, const Compression::Policy &policy);
+    static void clearCompressionPolicy(uint8_t messageId);
 private:
+    static bool compressionPolicy(uint8_t messageId, Compression::Policy *policy);
+    static bool hasCompressionPolicy(uint8_t messageId)
+    {
+        return sCompressionPolicyCount.load(std::memory_order_relaxed) && compressionPolicy(messageId, nullptr);
+    }
+    uint8_t encodeValue(String &value, const Compression::Policy *policy) const;
+    // there's no RTTI, its address tells message types apart
+    template <typename T> struct TypeTag { static char tag; };
+
     class MessageCreatorBase
     {
     public:
+        MessageCreatorBase(const void *type)
+            : mType(type)
+        {}
         virtual ~MessageCreatorBase() {}
-        virtual Message *create(const char *data, int size) = 0;
+        virtual std::shared_ptr<Message> create(const std::shared_ptr<Buffer> &owner, const char *data, int size,
+                                                Serializer::Encoding encoding) = 0;
+        const void *type() const { return mType; }
+    private:
+        const void *mType;
     };
 
     template <typename T>
     class MessageCreator : public MessageCreatorBase
     {
     public:
-        virtual Message *create(const char *data, int size) override
+        MessageCreator()
+            : MessageCreatorBase(&TypeTag<T>::tag)
+        {}
+
+        virtual std::shared_ptr<Message> create(const std::shared_ptr<Buffer> &owner, const char *data, int size,
+                                                Serializer::Encoding encoding) override
+        {
+            std::shared_ptr<T> t = std::make_shared<T>();
+            Deserializer deserializer(owner, data, size);
+            deserializer.setEncoding(encoding);
+            t->decode(deserializer);
+            return t;
+        }
+    };
+
+    template <typename T>
+    class PooledMessageCreator : public MessageCreatorBase
+    {
+    public:
+        PooledMessageCreator(size_t poolSize)
+            : MessageCreatorBase(&TypeTag<T>::tag), mAllocator(poolSize)
+        {}
+
+        virtual std::shared_ptr<Message> create(const std::shared_ptr<Buffer> &owner, const char *data, int size,
+                                                Serializer::Encoding encoding) override
         {
-            T *t = new T;
-            Deserializer deserializer(data, size);
+            std::shared_ptr<T> t = std::allocate_shared<T>(mAllocator);
+            Deserializer deserializer(owner, data, size);
+            deserializer.setEncoding(encoding);
             t->decode(deserializer);
             return t;
         }
+    private:
+        PoolAllocator<T> mAllocator;
     };
+    template <typename T> static bool addCreator(size_t poolSize)
+    {
+        MessageCreatorBase *creator;
+        if (poolSize) {
+            creator = new PooledMessageCreator<T>(poolSize);
+        } else {
+            creator = new MessageCreator<T>();
+        }
+        const uint8_t id = static_cast<uint8_t>(T::MessageId);
+        MessageCreatorBase *expected = nullptr;
+        if (sFactory[id].compare_exchange_strong(expected, creator))
+            return true;
+        delete creator;
+        if (expected->type() == &TypeTag<T>::tag)
+            return true;
+        error() << "Message id" << static_cast<int>(id) << "is already registered for another message";
+        return false;
+    }
+    // the first call registers rct's own messages, so they can't lose their
+    // ids to application messages
+    static void registerBuiltins();
+    static void addBuiltins();
 
-    void prepare(int version, String &header, String &value) const;
+    /**
+     * \a policy is used unless the message type has its own. Afterwards
+     * mPreparedFlags holds the flags the header was encoded with.
+     */
+    void prepare(int version, String &header, String &value, const Compression::Policy *policy = nullptr) const;
     enum { HeaderExtra = Serializer::sizeOf<int>() + Serializer::sizeOf<uint8_t>() + Serializer::sizeOf<uint8_t>() };
     inline void encodeHeader(Serializer &serializer, uint32_t size, int version) const
     {
-        size += HeaderExtra;
+        // these describe how the message was received, not what it contains
+        encodeHeader(serializer, size, version, mFlags & ~TransportFlags);
+    }
+    inline void encodeHeader(Serializer &serializer, uint32_t size, int version, uint8_t flags, uint32_t requestId = 0,
+                             const TraceStamps *trace = nullptr) const
+    {
+        assert(!(flags & Traced) == !trace);
+        size += headerExtra(flags);
         serializer.write(&size, sizeof(size));
-        serializer << version << static_cast<uint8_t>(mMessageId) << mFlags;
+        serializer << version << static_cast<uint8_t>(mMessageId) << flags;
+        if (flags & Correlated)
+            serializer << requestId;
+        if (flags & Traced)
+            serializer << trace->id << trace->sent << trace->encoded;
+    }
+    enum { TraceStampsSize = Serializer::sizeOf<uint32_t>() + Serializer::sizeOf<uint64_t>() + Serializer::sizeOf<uint64_t>() };
+    static constexpr size_t headerExtra(uint8_t flags)
+    {
+        return HeaderExtra + (flags & Correlated ? Serializer::sizeOf<uint32_t>() : 0)
+            + (flags & Traced ? static_cast<size_t>(TraceStampsSize) : 0);
     }
+    // encodedSize() is for Native encoding
+    size_t encodedValueSize() const { return mFlags & Compact ? String::npos : encodedSize(); }
+    enum { ReplyBit = 0x80000000 };
     friend class Connection;
 
     uint8_t mMessageId;
@@ -98,10 +282,20 @@ private:
     mutable int mVersion;
     mutable String mHeader;
     mutable String mValue;
+    List<int> mFileDescriptors;
+    uint32_t mRequestId;
+    mutable std::shared_ptr<const String> mShared;
+    mutable int mSharedVersion;
+    mutable uint8_t mPreparedFlags;
+    mutable const Compression::Policy *mPreparedPolicy;
 
-    static Map<uint8_t, MessageCreatorBase *> sFactory;
+    static std::atomic<MessageCreatorBase *> sFactory[256];
     static std::mutex sMutex;
+    static Map<uint8_t, Compression::Policy> sCompressionPolicies;
+    static std::atomic<int> sCompressionPolicyCount;
 
 };
 
+template <typename T> char Message::TypeTag<T>::tag;
+
 #endif // MESSAGE_H
@@ -61,6 +61,9 @@ public:
         replaceBackslashes();
 #endif
     }
+    Path(const StringView &path)
+        : Path(path.data(), path.size())
+    {}
     Path() {}
     Path &operator=(const Path &other)
     {
@@ -0,0 +1,91 @@
+#ifndef PoolAllocator_h
+#define PoolAllocator_h
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+
+/**
+ * Allocator that keeps up to maxPooled freed single objects per thread and
+ * type and hands them out again. Meant for std::allocate_shared() so that
+ * the object and its control block are recycled as one block. Memory freed
+ * on another thread than it was allocated on ends up in that thread's pool.
+ */
+template <typename T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+
+    PoolAllocator(size_t maxPooled = 64)
+        : mMaxPooled(maxPooled)
+    {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &other)
+        : mMaxPooled(other.maxPooled())
+    {}
+
+    size_t maxPooled() const { return mMaxPooled; }
+
+    T *allocate(size_t n)
+    {
+        if (n == 1) {
+            FreeList &list = freeList();
+            if (Node *node = list.head) {
+                list.head = node->next;
+                --list.size;
+                return reinterpret_cast<T *>(node);
+            }
+            return reinterpret_cast<T *>(::operator new(sizeof(Node)));
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, size_t n)
+    {
+        if (n == 1) {
+            FreeList &list = freeList();
+            if (list.size < mMaxPooled) {
+                Node *node = reinterpret_cast<Node *>(ptr);
+                node->next = list.head;
+                list.head = node;
+                ++list.size;
+                return;
+            }
+        }
+        ::operator delete(ptr);
+    }
+
+    template <typename U> bool operator==(const PoolAllocator<U> &) const { return true; }
+    template <typename U> bool operator!=(const PoolAllocator<U> &) const { return false; }
+
+private:
+    union Node {
+        Node *next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    struct FreeList {
+        Node *head = nullptr;
+        size_t size = 0;
+
+        ~FreeList()
+        {
+            while (head) {
+                Node *node = head;
+                head = node->next;
+                ::operator delete(node);
+            }
+        }
+    };
+
+    static FreeList &freeList()
+    {
+        static thread_local FreeList sList;
+        return sList;
+    }
+
+    size_t mMaxPooled;
+};
+
+#endif
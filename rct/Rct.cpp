@@ -377,6 +377,15 @@ uint64_t monoMs()
     return 0;
 }
 
+uint64_t monoUs()
+{
+    timeval time;
+    if (gettime(&time)) {
+        return (time.tv_sec * static_cast<uint64_t>(1000000)) + time.tv_usec;
+    }
+    return 0;
+}
+
 uint64_t currentTimeMs()
 {
     timeval time;
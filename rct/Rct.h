@@ -8,6 +8,7 @@
 #include <rct/List.h>
 #include <rct/Path.h>
 #include <rct/String.h>
+#include <rct/StringSearch.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -96,6 +97,7 @@ Path executablePath();
 String backtrace(int maxFrames = -1);
 bool gettime(timeval *time);
 uint64_t monoMs();
+uint64_t monoUs();
 uint64_t currentTimeMs();
 String currentTimeString();
 String hostName();
@@ -126,69 +128,54 @@ String addrLookup(const String &addr, LookupMode mode = Auto, bool *ok = nullptr
 String nameLookup(const String &name, LookupMode mode = IPv4, bool *ok = nullptr);
 bool isIP(const String &addr, LookupMode mode = Auto);
 
-inline void jsonEscape(const String &str, std::function<void(const char *, size_t)> output)
+/**
+ * Writes \a data as a quoted JSON string to \a output, which is called
+ * like output(const char *, size_t). Runs that need no escaping are found
+ * with StringSearch and written in one piece. Bytes from 0x80 on are
+ * copied as is, so UTF-8 stays UTF-8.
+ */
+template <typename Output>
+inline void jsonEscape(const char *data, size_t size, Output &&output)
 {
     output("\"", 1);
-    bool hasEscaped = false;
-    size_t i;
-    auto put = [&output, &hasEscaped, &i, &str](const char *escaped) {
-        if (!hasEscaped) {
-            hasEscaped = true;
-            if (i)
-                output(str.c_str(), i);
-        }
-        output(escaped, strlen(escaped));
-    };
-    const char *stringData = str.c_str();
-
-    const size_t length = str.size();
-    for (i = 0; i < length; ++i) {
-        switch (const char ch = stringData[i]) {
-        case 8:
-            put("\\b");
-            break; // backspace
-        case 12:
-            put("\\f");
-            break; // Form feed
-        case '\n':
-            put("\\n");
-            break; // newline
-        case '\t':
-            put("\\t");
-            break; // tab
-        case '\r':
-            put("\\r");
-            break; // carriage return
-        case '"':
-            put("\\\"");
-            break; // quote
-        case '\\':
-            put("\\\\");
-            break; // backslash
-        default:
-            if (ch < 0x20 || ch == 127) { // escape non printable characters
-                char buffer[7];
-                snprintf(buffer, 7, "\\u%04x", ch);
-                put(buffer);
-                break;
-            } else if (hasEscaped) {
-                output(&ch, 1);
-            }
+    size_t i = 0;
+    while (i < size) {
+        const size_t clean = StringSearch::indexOfJsonEscape(data + i, size - i);
+        if (clean == StringSearch::npos) {
+            output(data + i, size - i);
             break;
         }
+        if (clean)
+            output(data + i, clean);
+        i += clean;
+        switch (const char ch = data[i++]) {
+        case 8: output("\\b", 2); break; // backspace
+        case 12: output("\\f", 2); break; // Form feed
+        case '\n': output("\\n", 2); break; // newline
+        case '\t': output("\\t", 2); break; // tab
+        case '\r': output("\\r", 2); break; // carriage return
+        case '"': output("\\\"", 2); break; // quote
+        case '\\': output("\\\\", 2); break; // backslash
+        default: { // escape non printable characters
+            char buffer[7];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned char>(ch));
+            output(buffer, 6);
+            break; }
+        }
     }
-
-    if (!hasEscaped)
-        output(stringData, length);
     output("\"", 1);
 }
 
+inline void jsonEscape(const String &str, std::function<void(const char *, size_t)> output)
+{
+    jsonEscape(str.constData(), str.size(), output);
+}
+
 inline String jsonEscape(const String &string)
 {
     String ret;
-    jsonEscape(string,
-               std::bind(
-                   static_cast<void (String::*)(const char *, size_t)>(&String::append), &ret, std::placeholders::_1, std::placeholders::_2));
+    ret.reserve(string.size() + 2);
+    jsonEscape(string.constData(), string.size(), [&ret](const char *data, size_t size) { ret.append(data, size); });
     return ret;
 }
 
@@ -0,0 +1,355 @@
+#include "RecordLog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "Crc32c.h"
+#include "Log.h"
+#include "MemoryMappedFile.h"
+#include "Rct.h"
+#include "ThreadPool.h"
+#include "rct/rct-config.h"
+
+// every record is preceded by its length and a checksum of the length and
+// the record
+enum { FrameHeaderSize = Serializer::sizeOf<uint32_t>() * 2 };
+
+static bool syncFd(int fd)
+{
+#if defined(HAVE_FDATASYNC)
+    return !fdatasync(fd);
+#elif !defined(_WIN32)
+    return !fsync(fd);
+#else
+    (void)fd;
+    return true;
+#endif
+}
+
+static uint32_t frameChecksum(const char *length, const char *data, size_t size)
+{
+    return Crc32c::extend(Crc32c::checksum(length, Serializer::sizeOf<uint32_t>()), data, size);
+}
+
+RecordLog::RecordLog(const Path &dir, int version, Serializer::Encoding encoding)
+    : mDir(dir.ensureTrailingSlash()), mVersion(version), mEncoding(encoding), mDurability(DataFile::NoSync),
+      mFd(-1), mGeneration(0), mAppended(0), mCommitted(0), mLogSize(0), mWriting(false), mFailed(false),
+      mSnapshotting(false), mSnapshotFailed(false)
+{
+}
+
+RecordLog::~RecordLog()
+{
+    if (mFd != -1) {
+        commit();
+        waitForSnapshot();
+        int ret;
+        eintrwrap(ret, ::close(mFd));
+    }
+}
+
+String RecordLog::error() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mError;
+}
+
+Path RecordLog::segmentPath(uint64_t generation) const
+{
+    return mDir + String::format<32>("log.%llu", static_cast<unsigned long long>(generation));
+}
+
+bool RecordLog::openWith(const SnapshotReader &reader, const Replay &replay)
+{
+    assert(mFd == -1);
+    if (!Path::mkdir(mDir, Path::Recursive)) {
+        mError = String::format<128>("Can't create %s", mDir.c_str());
+        return false;
+    }
+    mGeneration = 0;
+    const Path snapshotPath = mDir + "snapshot";
+    if (snapshotPath.exists()) {
+        DataFile snapshot(snapshotPath, mVersion);
+        if (!snapshot.open(DataFile::Read)) {
+            mError = snapshot.error();
+            return false;
+        }
+        snapshot >> mGeneration;
+        reader(snapshot);
+    }
+
+    List<uint64_t> generations;
+    for (const Path &file : mDir.files(Path::File)) {
+        const String name = file.fileName();
+        bool ok;
+        const uint64_t generation = name.mid(4).toULongLong(&ok);
+        if (!name.startsWith("log.") || !ok)
+            continue;
+        // left behind by a snapshot that didn't get to remove them
+        if (generation < mGeneration) {
+            Path::rm(file);
+        } else {
+            generations.append(generation);
+        }
+    }
+    std::sort(generations.begin(), generations.end());
+    mLogSize = 0;
+    for (size_t i=0; i<generations.size(); ++i) {
+        if (!replaySegment(segmentPath(generations.at(i)), i + 1 == generations.size(), replay))
+            return false;
+    }
+    return openSegment(generations.isEmpty() ? mGeneration : generations.last());
+}
+
+bool RecordLog::replaySegment(const Path &path, bool last, const Replay &replay)
+{
+    MemoryMappedFile mapping;
+    if (!mapping.open(path)) {
+        mError = "Read error " + path;
+        return false;
+    }
+    mapping.advise(MemoryMappedFile::SEQUENTIAL);
+    const char *data = mapping.filePtr<char>();
+    const size_t size = mapping.size();
+    const size_t headerSize = Serializer::sizeOf<int>();
+    int version = -1;
+    if (size >= headerSize) {
+        Deserializer header(data, headerSize);
+        header >> version;
+    }
+    const int expected = mVersion | (mEncoding == Serializer::Compact ? DataFile::CompactVersion : 0);
+    if (size >= headerSize && version != expected) {
+        mError = String::format<128>("Wrong log version. Expected %d, got %d for %s", expected, version, path.c_str());
+        return false;
+    }
+
+    size_t offset = size >= headerSize ? headerSize : 0;
+    while (size - offset >= FrameHeaderSize) {
+        uint32_t length, checksum;
+        {
+            Deserializer frame(data + offset, FrameHeaderSize);
+            frame >> length >> checksum;
+        }
+        const char *record = data + offset + FrameHeaderSize;
+        if (length > size - offset - FrameHeaderSize || frameChecksum(data + offset, record, length) != checksum)
+            break;
+        Deserializer deserializer(record, length);
+        deserializer.setEncoding(mEncoding);
+        if (!replay(deserializer)) {
+            mError = String::format<128>("Failed to replay record at %zu in %s", offset, path.c_str());
+            return false;
+        }
+        offset += FrameHeaderSize + length;
+    }
+    if (offset != size) {
+        // a crash during a commit only damages the end of the last segment
+        if (!last) {
+            mError = String::format<128>("%s seems to be corrupted at %zu", path.c_str(), offset);
+            return false;
+        }
+        warning() << "Dropping" << (size - offset) << "bytes at the end of" << path;
+        mapping.close();
+        if (truncate(path.c_str(), offset)) {
+            mError = String::format<128>("truncate error: %d %s", errno, Rct::strerror().c_str());
+            return false;
+        }
+    }
+    mLogSize += offset;
+    return true;
+}
+
+bool RecordLog::openSegment(uint64_t generation)
+{
+    const Path path = segmentPath(generation);
+    const bool exists = path.exists() && path.fileSize() > 0;
+    int fd;
+    eintrwrap(fd, ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644));
+    if (fd == -1) {
+        mError = String::format<128>("open error: %d %s", errno, Rct::strerror().c_str());
+        return false;
+    }
+    if (!exists) {
+        String header;
+        {
+            Serializer serializer(header);
+            serializer << (mVersion | (mEncoding == Serializer::Compact ? DataFile::CompactVersion : 0));
+        }
+        if (!writeAll(fd, header)) {
+            mError = String::format<128>("write error: %d %s", errno, Rct::strerror().c_str());
+            int ret;
+            eintrwrap(ret, ::close(fd));
+            return false;
+        }
+    }
+    mFd = fd;
+    mGeneration = generation;
+    return true;
+}
+
+bool RecordLog::writeAll(int fd, const String &data)
+{
+    const char *bytes = data.constData();
+    size_t len = data.size();
+    while (len) {
+        ssize_t ret;
+        eintrwrap(ret, ::write(fd, bytes, len));
+        if (ret <= 0) {
+            if (!ret)
+                errno = EIO;
+            return false;
+        }
+        bytes += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+uint64_t RecordLog::appendRecord(const String &data)
+{
+    String frame;
+    {
+        Serializer serializer(frame);
+        serializer << static_cast<uint32_t>(data.size());
+    }
+    {
+        Serializer serializer(frame);
+        serializer << frameChecksum(frame.constData(), data.constData(), data.size());
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPending.append(frame);
+    mPending.append(data);
+    return ++mAppended;
+}
+
+bool RecordLog::commit(uint64_t sequence)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    assert(mFd != -1);
+    sequence = std::min(sequence, mAppended);
+    while (mCommitted < sequence) {
+        if (mFailed)
+            return false;
+        if (mWriting) {
+            mCond.wait(lock);
+            continue;
+        }
+        // write everything that's queued, including the records of the
+        // threads waiting for us
+        mWriting = true;
+        String batch;
+        std::swap(batch, mPending);
+        const uint64_t last = mAppended;
+        const int fd = mFd;
+        lock.unlock();
+        bool ok = writeAll(fd, batch) && (mDurability == DataFile::NoSync || syncFd(fd));
+        const int err = errno;
+        lock.lock();
+        mWriting = false;
+        if (ok) {
+            mCommitted = last;
+            mLogSize += batch.size();
+        } else {
+            mFailed = true;
+            mError = String::format<128>("write error: %d %s", err, strerror(err));
+        }
+        mCond.notify_all();
+    }
+    return !mFailed;
+}
+
+bool RecordLog::snapshotWith(const SnapshotCopier &copier)
+{
+    if (!waitForSnapshot())
+        debug() << "Previous snapshot failed" << error();
+    // most of what's queued is written without blocking appends
+    if (!commit())
+        return false;
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mWriting)
+        mCond.wait(lock);
+    if (mFailed)
+        return false;
+    // appends wait for us from here on, what came in since the commit is
+    // covered by the copy so it belongs to the old segment
+    if (!mPending.isEmpty()) {
+        if (!writeAll(mFd, mPending) || (mDurability != DataFile::NoSync && !syncFd(mFd))) {
+            mFailed = true;
+            mError = String::format<128>("write error: %d %s", errno, Rct::strerror().c_str());
+            mCond.notify_all();
+            return false;
+        }
+        mPending.clear();
+        mCommitted = mAppended;
+        mCond.notify_all();
+    }
+    // records appended from now on go to the next segment
+    const int old = mFd;
+    if (!openSegment(mGeneration + 1))
+        return false;
+    int ret;
+    eintrwrap(ret, ::close(old));
+    if (mDurability == DataFile::SyncFileAndDirectory) {
+        const int dir = ::open(mDir.c_str(), O_RDONLY);
+        if (dir != -1) {
+            syncFd(dir);
+            eintrwrap(ret, ::close(dir));
+        }
+    }
+    mLogSize = 0;
+    mSnapshotting = true;
+    const uint64_t generation = mGeneration;
+    const SnapshotWriter writer = copier();
+    lock.unlock();
+
+    ThreadPool::instance()->start([this, writer, generation]() {
+            DataFile snapshot(mDir + "snapshot", mVersion, mEncoding);
+            snapshot.setDurability(mDurability == DataFile::NoSync ? DataFile::NoSync : DataFile::SyncFileAndDirectory);
+            bool ok = snapshot.open(DataFile::Write);
+            if (ok) {
+                snapshot << generation;
+                writer(snapshot);
+                ok = snapshot.flush();
+            }
+            if (ok)
+                removeSegments(generation);
+            std::lock_guard<std::mutex> guard(mMutex);
+            mSnapshotting = false;
+            mSnapshotFailed = !ok;
+            if (!ok)
+                mError = snapshot.error();
+            mCond.notify_all();
+        });
+    return true;
+}
+
+bool RecordLog::waitForSnapshot()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mSnapshotting)
+        mCond.wait(lock);
+    return !mSnapshotFailed;
+}
+
+void RecordLog::removeSegments(uint64_t before)
+{
+    for (const Path &file : mDir.files(Path::File)) {
+        const String name = file.fileName();
+        bool ok;
+        const uint64_t generation = name.mid(4).toULongLong(&ok);
+        if (name.startsWith("log.") && ok && generation < before)
+            Path::rm(file);
+    }
+}
+
+size_t RecordLog::logSize() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mLogSize;
+}
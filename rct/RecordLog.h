@@ -0,0 +1,142 @@
+#ifndef RecordLog_h
+#define RecordLog_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "DataFile.h"
+#include "Path.h"
+#include "Serializer.h"
+#include "String.h"
+
+/**
+ * Persists state as a snapshot plus an append-only log of the changes
+ * made since, so saving a small change costs a small append instead of
+ * rewriting a whole DataFile.
+ *
+ * Records are serialized, framed with their length and a CRC-32C and
+ * appended to the current log segment in \a dir. append() only queues
+ * them, commit() writes them. Threads that commit at the same time share
+ * one write and, depending on the durability, one fdatasync().
+ *
+ * snapshot() starts a new segment, copies the state while appends are
+ * blocked and writes the copy to a DataFile on ThreadPool::instance(),
+ * segments the snapshot covers are
+ * removed once it's in place. open() loads the snapshot and replays the
+ * segments after it. A record that was cut short by a crash at the end of
+ * the last segment is dropped.
+ */
+class RecordLog
+{
+public:
+    RecordLog(const Path &dir, int version, Serializer::Encoding encoding = Serializer::Native);
+    ~RecordLog();
+
+    Path path() const { return mDir; }
+    String error() const;
+
+    /**
+     * Applies to commits and snapshots. Anything but DataFile::NoSync
+     * syncs every commit.
+     */
+    DataFile::Durability durability() const { return mDurability; }
+    void setDurability(DataFile::Durability durability) { mDurability = durability; }
+
+    typedef std::function<void(DataFile &snapshot)> SnapshotReader;
+    typedef std::function<void(DataFile &snapshot)> SnapshotWriter;
+    /**
+     * Copies the state and returns the writer for the copy.
+     */
+    typedef std::function<SnapshotWriter()> SnapshotCopier;
+    /**
+     * Called for every record, in order. Returning false aborts open().
+     */
+    typedef std::function<bool(Deserializer &record)> Replay;
+
+    /**
+     * Reads the snapshot into \a state, if there is one, and calls
+     * \a replay for every record appended after it.
+     */
+    template <typename T> bool open(T &state, const Replay &replay)
+    {
+        return openWith([&state](DataFile &snapshot) { snapshot >> state; }, replay);
+    }
+    bool openWith(const SnapshotReader &reader, const Replay &replay);
+
+    /**
+     * Queues \a record and returns its sequence number. Thread safe.
+     */
+    template <typename T> uint64_t append(const T &record)
+    {
+        String data;
+        {
+            Serializer serializer(data);
+            serializer.setEncoding(mEncoding);
+            serializer << record;
+        }
+        return appendRecord(data);
+    }
+    uint64_t appendRecord(const String &data);
+
+    /**
+     * Writes all records up to and including \a sequence, by default all
+     * of them. Returns once they're written, possibly by another thread.
+     */
+    bool commit(uint64_t sequence = UINT64_MAX);
+
+    /**
+     * Writes \a state to a new snapshot in the background. It's copied
+     * while append() is blocked, at the point where the log moves to the
+     * next segment, so it has to include exactly the records appended
+     * before that. Hold whatever lock keeps other threads from changing it
+     * and appending for the whole call, the copy mustn't wait for a thread
+     * that's appending. Waits for a snapshot that is still being written.
+     */
+    template <typename T> bool snapshot(const T &state)
+    {
+        return snapshotWith([&state]() {
+                std::shared_ptr<T> copy = std::make_shared<T>(state);
+                return SnapshotWriter([copy](DataFile &snapshot) { snapshot << *copy; });
+            });
+    }
+    bool snapshotWith(const SnapshotCopier &copier);
+    /**
+     * Returns false if the last snapshot couldn't be written.
+     */
+    bool waitForSnapshot();
+
+    /**
+     * Bytes appended since the last snapshot, snapshot() once that gets
+     * large compared to the state.
+     */
+    size_t logSize() const;
+
+private:
+    Path segmentPath(uint64_t generation) const;
+    bool replaySegment(const Path &path, bool last, const Replay &replay);
+    bool openSegment(uint64_t generation);
+    bool writeAll(int fd, const String &data);
+    void removeSegments(uint64_t before);
+
+    const Path mDir;
+    const int mVersion;
+    const Serializer::Encoding mEncoding;
+    DataFile::Durability mDurability;
+    mutable std::mutex mMutex;
+    std::condition_variable mCond;
+    String mError;
+    int mFd;
+    uint64_t mGeneration;
+    // records that are framed but not written
+    String mPending;
+    uint64_t mAppended, mCommitted;
+    size_t mLogSize;
+    bool mWriting, mFailed, mSnapshotting, mSnapshotFailed;
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <rct/Message.h>
 #include <rct/String.h>
+#include <rct/StringView.h>
 
 class ResponseMessage : public Message
 {
@@ -25,14 +26,36 @@ public:
 
     Type type() const { return mType; }
 
-    String data() const { return mData; }
-    void setData(const String &data) { mData = data; }
+    String data() const { return mOwner ? mView.toString() : mData; }
+    /**
+     * Returns the data without copying it. When received over a Connection
+     * this points into the receive buffer.
+     */
+    StringView dataView() const { return mOwner ? mView : StringView(mData); }
+    void setData(const String &data)
+    {
+        mData = data;
+        mView = StringView();
+        mOwner.reset();
+    }
 
-    virtual size_t encodedSize() const override { return mData.size() + sizeof(int); }
-    virtual void encode(Serializer &serializer) const override { serializer << mData; }
-    virtual void decode(Deserializer &deserializer) override { deserializer >> mData; }
+    virtual size_t encodedSize() const override { return dataView().size() + sizeof(int); }
+    virtual void encode(Serializer &serializer) const override { serializer << dataView(); }
+    virtual void decode(Deserializer &deserializer) override
+    {
+        mOwner = deserializer.owner();
+        if (mOwner) {
+            deserializer >> mView;
+            mData.clear();
+        } else {
+            deserializer >> mData;
+            mView = StringView();
+        }
+    }
 private:
     String mData;
+    StringView mView;
+    std::shared_ptr<Buffer> mOwner;
     Type mType;
 };
 
@@ -6,9 +6,14 @@
 #include <stdint.h>
 #include <string.h>
 
-#include <utility>
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
+#include <rct/Buffer.h>
 #include <rct/Hash.h>
 #include <rct/List.h>
 #include <rct/Log.h>
@@ -17,10 +22,51 @@
 #include <rct/Rct.h>
 #include <rct/Set.h>
 #include <rct/String.h>
+#include <rct/StringView.h>
+
+/**
+ * Integers wider than a byte are zigzag encoded if signed and written as
+ * LEB128 varints in Compact mode, which also covers the sizes of strings
+ * and containers. Both sides have to agree on the encoding, Message and
+ * DataFile record it for their readers.
+ */
+template <typename T>
+struct CompactEncoded
+{
+    static constexpr bool value = std::is_integral<T>::value && sizeof(T) > 1;
+};
+
+inline uint64_t zigzagEncode(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+template <typename T>
+uint64_t toCompact(T value)
+{
+    return std::is_signed<T>::value ? zigzagEncode(static_cast<int64_t>(value)) : static_cast<uint64_t>(value);
+}
+
+template <typename T>
+T fromCompact(uint64_t value)
+{
+    return std::is_signed<T>::value ? static_cast<T>(zigzagDecode(value)) : static_cast<T>(value);
+}
 
 class Serializer
 {
 public:
+    enum Encoding {
+        Native,
+        Compact
+    };
+    enum { MaxVarintSize = 10 };
+
     class Buffer
     {
     public:
@@ -30,19 +76,20 @@ public:
     };
 
     Serializer(std::unique_ptr<Buffer> &&buffer)
-        : mError(false), mBuffer(std::move(buffer))
+        : mError(false), mEncoding(Native), mString(nullptr), mBuffer(std::move(buffer))
     {}
 
+    // strings are appended to directly, without going through a Buffer
     Serializer(std::string &out)
-        : mError(false), mBuffer(new StringBuffer(out))
+        : mError(false), mEncoding(Native), mString(&out)
     {}
 
     Serializer(String &out)
-        : mError(false), mBuffer(new StringBuffer(out))
+        : mError(false), mEncoding(Native), mString(&out.ref())
     {}
 
     Serializer(FILE *f)
-        : mError(false), mBuffer(new FileBuffer(f))
+        : mError(false), mEncoding(Native), mString(nullptr), mBuffer(new FileBuffer(f))
     {
         assert(f);
     }
@@ -55,6 +102,10 @@ public:
     bool write(const void *data, int len)
     {
         assert(len > 0);
+        if (mString) {
+            mString->append(static_cast<const char *>(data), len);
+            return true;
+        }
         if (mError)
             return false;
         if (!mBuffer->write(data, len)) {
@@ -66,7 +117,56 @@ public:
 
     int pos() const
     {
-        return mBuffer->pos();
+        return mString ? static_cast<int>(mString->size()) : mBuffer->pos();
+    }
+
+    /**
+     * Makes room for \a size more bytes when writing to a string, e.g.
+     * from encodedSizeOf(). Does nothing for String::npos.
+     */
+    void reserve(size_t size)
+    {
+        if (mString && size != String::npos)
+            mString->reserve(mString->size() + size);
+    }
+
+    Encoding encoding() const { return mEncoding; }
+    void setEncoding(Encoding encoding) { mEncoding = encoding; }
+
+    static int encodeVarint(uint64_t value, unsigned char *out)
+    {
+        int ret = 0;
+        while (value >= 0x80) {
+            out[ret++] = static_cast<unsigned char>(value | 0x80);
+            value >>= 7;
+        }
+        out[ret++] = static_cast<unsigned char>(value);
+        return ret;
+    }
+
+    bool writeVarint(uint64_t value)
+    {
+        unsigned char buf[MaxVarintSize];
+        return write(buf, encodeVarint(value, buf));
+    }
+
+    /**
+     * Writes \a count integers in Compact encoding, batching the writes.
+     */
+    template <typename T>
+    bool writeVarints(const T *values, size_t count)
+    {
+        unsigned char buf[1024];
+        int used = 0;
+        for (size_t i=0; i<count; ++i) {
+            if (used > static_cast<int>(sizeof(buf)) - MaxVarintSize) {
+                if (!write(buf, used))
+                    return false;
+                used = 0;
+            }
+            used += encodeVarint(toCompact(values[i]), buf + used);
+        }
+        return !used || write(buf, used);
     }
 
     bool hasError() const { return mError; }
@@ -83,25 +183,6 @@ public:
     template <typename T> bool encodeType() { return true; }
 #endif
 private:
-    class StringBuffer : public Buffer
-    {
-    public:
-        StringBuffer(std::string &out)
-            : mString(&out)
-        {}
-        StringBuffer(String &out)
-            : mString(&out.ref())
-        {}
-
-        virtual bool write(const void *data, int len) override
-        {
-            mString->append(static_cast<const char*>(data), len);
-            return true;
-        }
-        virtual int pos() const override { return mString->size(); }
-    private:
-        std::string *mString;
-    };
     class FileBuffer : public Buffer
     {
     public:
@@ -127,6 +208,8 @@ private:
     };
 
     bool mError;
+    Encoding mEncoding;
+    std::string *mString;
     std::unique_ptr<Buffer> mBuffer;
 };
 
@@ -134,20 +217,82 @@ class Deserializer
 {
 public:
     Deserializer(const char *data, int len, const char *key = "")
-        : mData(data), mLength(len), mPos(0), mFile(nullptr), mKey(key)
+        : mData(data), mLength(len), mPos(0), mFile(nullptr), mKey(key), mEncoding(Serializer::Native),
+          mFileBufferCapacity(0), mFileBufferPos(0), mFileBufferSize(0)
     {}
 
     Deserializer(const String &string, const char *key = "")
         : mString(string), mData(mString.c_str()), mLength(mString.size()),
-          mPos(0), mFile(nullptr), mKey(key)
+          mPos(0), mFile(nullptr), mKey(key), mEncoding(Serializer::Native),
+          mFileBufferCapacity(0), mFileBufferPos(0), mFileBufferSize(0)
+    {}
+
+    /**
+     * Reads from memory kept alive by \a owner. Values decoded as
+     * StringView point straight into it.
+     */
+    Deserializer(const std::shared_ptr<Buffer> &owner, const char *data, int len, const char *key = "")
+        : mOwner(owner), mData(data), mLength(len), mPos(0), mFile(nullptr), mKey(key), mEncoding(Serializer::Native),
+          mFileBufferCapacity(0), mFileBufferPos(0), mFileBufferSize(0)
     {}
 
+    /**
+     * Reads \a file in chunks rather than calling fread() for every value.
+     * What was read ahead is given back to \a file on destruction so it's
+     * positioned right after the last value.
+     */
     Deserializer(FILE *file, const char *key = "")
-        : mData(nullptr), mLength(0), mFile(file), mKey(key)
+        : mData(nullptr), mLength(0), mPos(0), mFile(file), mKey(key), mEncoding(Serializer::Native),
+          mFileBufferCapacity(0), mFileBufferPos(0), mFileBufferSize(0)
     {
         assert(file);
     }
 
+    ~Deserializer()
+    {
+        if (mFile && mFileBufferPos < mFileBufferSize)
+            fseek(mFile, -static_cast<long>(mFileBufferSize - mFileBufferPos), SEEK_CUR);
+    }
+
+    Deserializer(const Deserializer &) = delete;
+    Deserializer &operator=(const Deserializer &) = delete;
+
+    const std::shared_ptr<Buffer> &owner() const { return mOwner; }
+
+    /**
+     * Returns a pointer to the next \a len bytes without copying them and
+     * advances past them. Only valid for memory deserializers. Returns null
+     * and skips to the end if there aren't \a len bytes left, e.g. because
+     * a length read from the wire is bogus.
+     */
+    const char *readInPlace(int len)
+    {
+        assert(mData);
+        if (len < 0 || len > mLength - mPos) {
+            error() << "Can't read" << len << "bytes at" << mPos << "of" << mLength << "for" << mKey;
+            mPos = mLength;
+            return nullptr;
+        }
+        const char *ret = mData + mPos;
+        mPos += len;
+        return ret;
+    }
+
+    /**
+     * Returns false, and skips to the end like readInPlace(), if a memory
+     * deserializer has fewer than \a len bytes left. Meant for checking
+     * sizes read from the data before allocating for them. File
+     * deserializers can't tell and always return true.
+     */
+    bool canRead(uint64_t len)
+    {
+        if (mFile || len <= static_cast<uint64_t>(mLength - mPos))
+            return true;
+        error() << "Can't read" << len << "bytes at" << mPos << "of" << mLength << "for" << mKey;
+        mPos = mLength;
+        return false;
+    }
+
     int peek(char *target, int len)
     {
         if (len) {
@@ -157,8 +302,8 @@ public:
                 return len;
             } else {
                 assert(mFile);
-                const int r = fread(target, sizeof(char), len, mFile);
-                fseek(mFile, -r, SEEK_CUR);
+                const int r = std::min(len, fillFileBuffer(len));
+                memcpy(target, mFileBuffer.get() + mFileBufferPos, r);
                 return r;
             }
         }
@@ -183,7 +328,7 @@ public:
                 return len;
             } else {
                 assert(mFile);
-                return fread(target, sizeof(char), len, mFile);
+                return readFile(static_cast<char *>(target), len);
             }
         }
         return 0;
@@ -191,7 +336,61 @@ public:
 
     bool atEnd() const { return mPos == mLength; }
 
-    int pos() const { return mFile ? ftell(mFile) : mPos; }
+    Serializer::Encoding encoding() const { return mEncoding; }
+    void setEncoding(Serializer::Encoding encoding) { mEncoding = encoding; }
+
+    uint64_t readVarint()
+    {
+        uint64_t ret = 0;
+        if (mData) {
+            for (int shift = 0; shift < 64 && mPos < mLength; shift += 7) {
+                const unsigned char byte = mData[mPos++];
+                ret |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return ret;
+            }
+        } else {
+            assert(mFile);
+            for (int shift = 0; shift < 64; shift += 7) {
+                unsigned char byte;
+                if (!readFile(reinterpret_cast<char *>(&byte), 1))
+                    break;
+                ret |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return ret;
+            }
+        }
+        error() << "Invalid varint for" << mKey;
+        return ret;
+    }
+
+    template <typename T>
+    void readVarints(T *values, size_t count)
+    {
+        size_t i = 0;
+        if (mData) {
+            // no bounds checks while a whole varint is guaranteed to fit
+            const unsigned char *data = reinterpret_cast<const unsigned char *>(mData);
+            while (i < count && mLength - mPos >= Serializer::MaxVarintSize) {
+                uint64_t value = data[mPos++];
+                if (value & 0x80) {
+                    value &= 0x7f;
+                    int shift = 7;
+                    unsigned char byte;
+                    do {
+                        byte = data[mPos++];
+                        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                        shift += 7;
+                    } while (byte & 0x80 && shift < 70);
+                }
+                values[i++] = fromCompact<T>(value);
+            }
+        }
+        for (; i<count; ++i)
+            values[i] = fromCompact<T>(readVarint());
+    }
+
+    int pos() const { return mFile ? ftell(mFile) - (mFileBufferSize - mFileBufferPos) : mPos; }
     int length() const { return mFile ? Rct::fileSize(mFile) : mLength; }
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     template <typename T>
@@ -210,12 +409,63 @@ public:
     template <typename T> bool decodeType() { return true; }
 #endif
 private:
+    enum { FileBufferSize = 64 * 1024 };
+
+    // makes at least min(len, what's left of the file) bytes available
+    int fillFileBuffer(int len)
+    {
+        int available = mFileBufferSize - mFileBufferPos;
+        if (available >= len)
+            return available;
+        if (mFileBufferCapacity < len) {
+            const int capacity = std::max<int>(len, FileBufferSize);
+            std::unique_ptr<char[]> buffer(new char[capacity]);
+            if (available)
+                memcpy(buffer.get(), mFileBuffer.get() + mFileBufferPos, available);
+            mFileBuffer = std::move(buffer);
+            mFileBufferCapacity = capacity;
+        } else if (available) {
+            memmove(mFileBuffer.get(), mFileBuffer.get() + mFileBufferPos, available);
+        }
+        mFileBufferPos = 0;
+        mFileBufferSize = available;
+        while (mFileBufferSize < len) {
+            const size_t r = fread(mFileBuffer.get() + mFileBufferSize, sizeof(char),
+                                   mFileBufferCapacity - mFileBufferSize, mFile);
+            if (!r)
+                break;
+            mFileBufferSize += r;
+        }
+        return mFileBufferSize;
+    }
+
+    int readFile(char *target, int len)
+    {
+        int ret = std::min(len, mFileBufferSize - mFileBufferPos);
+        memcpy(target, mFileBuffer.get() + mFileBufferPos, ret);
+        mFileBufferPos += ret;
+        if (ret == len)
+            return ret;
+        if (len - ret >= FileBufferSize) {
+            // large reads go straight into the target
+            return ret + fread(target + ret, sizeof(char), len - ret, mFile);
+        }
+        const int r = std::min(len - ret, fillFileBuffer(len - ret));
+        memcpy(target + ret, mFileBuffer.get() + mFileBufferPos, r);
+        mFileBufferPos += r;
+        return ret + r;
+    }
+
     String mString;
+    std::shared_ptr<Buffer> mOwner;
     const char *mData;
     const int mLength;
     int mPos;
     FILE *mFile;
     const char *mKey;
+    Serializer::Encoding mEncoding;
+    std::unique_ptr<char[]> mFileBuffer;
+    int mFileBufferCapacity, mFileBufferPos, mFileBufferSize;
 };
 
 template <typename T>
@@ -246,6 +496,10 @@ struct FixedSize
                                               const T &t)           \
     {                                                               \
         s.encodeType<T>();                                          \
+        if (CompactEncoded<T>::value && s.encoding() == Serializer::Compact) { \
+            s.writeVarint(toCompact(t));                            \
+            return s;                                               \
+        }                                                           \
         union {                                                     \
             T orig;                                                 \
             unsigned char buf[sizeof(T)];                           \
@@ -258,6 +512,10 @@ struct FixedSize
                                                 T &t)               \
     {                                                               \
         if (s.decodeType<T>()) {                                    \
+            if (CompactEncoded<T>::value && s.encoding() == Serializer::Compact) { \
+                t = fromCompact<T>(s.readVarint());                 \
+                return s;                                           \
+            }                                                       \
             union {                                                 \
                 T value;                                            \
                 unsigned char buf[sizeof(T)];                       \
@@ -294,6 +552,16 @@ inline Serializer &operator<<(Serializer &s, const String &string)
     return s;
 }
 
+template <>
+inline Serializer &operator<<(Serializer &s, const StringView &string)
+{
+    const uint32_t size = string.size();
+    s << size;
+    if (size)
+        s.write(string.data(), size);
+    return s;
+}
+
 template <>
 inline Serializer &operator<<(Serializer &s, const Path &path)
 {
@@ -311,14 +579,89 @@ inline Serializer &operator<<(Serializer &s, const LogLevel &level)
     return s;
 }
 
+/**
+ * Native types are written as their raw bytes so a contiguous run of them
+ * can be copied in one go. Not with RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
+ * since that tags every value.
+ */
+template <typename T>
+struct BulkCopyable
+{
+#ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
+    static constexpr bool value = false;
+#else
+    // std::vector<bool> has no data()
+    static constexpr bool value = FixedSize<T>::value == sizeof(T) && std::is_trivially_copyable<T>::value
+        && !std::is_same<T, bool>::value;
+#endif
+};
+
+template <typename Container>
+void serializeElements(Serializer &s, const Container &container, std::true_type)
+{
+    typedef typename Container::value_type T;
+    if (container.empty())
+        return;
+    if (CompactEncoded<T>::value && s.encoding() == Serializer::Compact) {
+        s.writeVarints(container.data(), container.size());
+    } else {
+        s.write(container.data(), container.size() * sizeof(T));
+    }
+}
+
+template <typename Container>
+void serializeElements(Serializer &s, const Container &container, std::false_type)
+{
+    for (const auto &value : container) {
+        s << value;
+    }
+}
+
+template <typename Container>
+void deserializeElements(Deserializer &s, Container &container, uint32_t size, std::true_type)
+{
+    typedef typename Container::value_type T;
+    const bool compact = CompactEncoded<T>::value && s.encoding() == Serializer::Compact;
+    // a bogus size mustn't make us allocate more than the data could hold,
+    // varints take at least a byte each
+    if (!s.canRead(static_cast<uint64_t>(size) * (compact ? 1 : sizeof(T)))) {
+        container.clear();
+        return;
+    }
+    container.resize(size);
+    if (container.empty())
+        return;
+    if (compact) {
+        s.readVarints(container.data(), container.size());
+    } else {
+        s.read(container.data(), container.size() * sizeof(T));
+    }
+}
+
+template <typename Container>
+void deserializeElements(Deserializer &s, Container &container, uint32_t size, std::false_type)
+{
+    container.resize(size);
+    for (auto &value : container) {
+        s >> value;
+    }
+}
+
 template <typename T>
 Serializer &operator<<(Serializer &s, const List<T> &list)
 {
     const uint32_t size = list.size();
     s << size;
-    for (uint32_t i=0; i<size; ++i) {
-        s << list.at(i);
-    }
+    serializeElements(s, list, std::integral_constant<bool, BulkCopyable<T>::value>());
+    return s;
+}
+
+template <typename T>
+Serializer &operator<<(Serializer &s, const std::vector<T> &vector)
+{
+    const uint32_t size = vector.size();
+    s << size;
+    serializeElements(s, vector, std::integral_constant<bool, BulkCopyable<T>::value>());
     return s;
 }
 
@@ -454,12 +797,16 @@ Deserializer &operator>>(Deserializer &s, List<T> &list)
 {
     uint32_t size;
     s >> size;
-    if (size) {
-        list.resize(size);
-        for (uint32_t i=0; i<size; ++i) {
-            s >> list[i];
-        }
-    }
+    deserializeElements(s, list, size, std::integral_constant<bool, BulkCopyable<T>::value>());
+    return s;
+}
+
+template <typename T>
+Deserializer &operator>>(Deserializer &s, std::vector<T> &vector)
+{
+    uint32_t size;
+    s >> size;
+    deserializeElements(s, vector, size, std::integral_constant<bool, BulkCopyable<T>::value>());
     return s;
 }
 
@@ -491,6 +838,19 @@ inline Deserializer &operator>>(Deserializer &s, String &string)
     return s;
 }
 
+/**
+ * The view points into the deserializer's memory, see Deserializer::owner().
+ */
+template <>
+inline Deserializer &operator>>(Deserializer &s, StringView &string)
+{
+    uint32_t size;
+    s >> size;
+    const char *data = size ? s.readInPlace(size) : nullptr;
+    string = data ? StringView(data, size) : StringView();
+    return s;
+}
+
 template <typename First, typename Second>
 Deserializer &operator>>(Deserializer &s, std::pair<First, Second> &pair)
 {
@@ -518,4 +878,143 @@ inline Deserializer &operator>>(Deserializer &s, LogLevel &level)
     return s;
 }
 
+/**
+ * encodedSizeOf() returns the number of bytes operator<< writes for a
+ * value in Native encoding, or String::npos if that isn't known. Overload it for your own
+ * types to make them usable with RCT_MESSAGE_FIELDS.
+ */
+template <typename T>
+size_t encodedSizeOf(const T &)
+{
+    return String::npos;
+}
+
+#define DECLARE_NATIVE_ENCODED_SIZE(T)                                  \
+    inline size_t encodedSizeOf(const T &) { return Serializer::sizeOf<T>(); } \
+    struct macrohack
+
+DECLARE_NATIVE_ENCODED_SIZE(bool);
+DECLARE_NATIVE_ENCODED_SIZE(char);
+DECLARE_NATIVE_ENCODED_SIZE(signed char);
+DECLARE_NATIVE_ENCODED_SIZE(unsigned char);
+DECLARE_NATIVE_ENCODED_SIZE(short);
+DECLARE_NATIVE_ENCODED_SIZE(unsigned short);
+DECLARE_NATIVE_ENCODED_SIZE(int);
+DECLARE_NATIVE_ENCODED_SIZE(unsigned int);
+DECLARE_NATIVE_ENCODED_SIZE(long);
+DECLARE_NATIVE_ENCODED_SIZE(unsigned long);
+DECLARE_NATIVE_ENCODED_SIZE(long long);
+DECLARE_NATIVE_ENCODED_SIZE(unsigned long long);
+DECLARE_NATIVE_ENCODED_SIZE(float);
+DECLARE_NATIVE_ENCODED_SIZE(double);
+
+inline size_t addEncodedSize(size_t a, size_t b)
+{
+    return a == String::npos || b == String::npos ? String::npos : a + b;
+}
+
+inline size_t encodedSizeOf(const String &string) { return Serializer::sizeOf<uint32_t>() + string.size(); }
+inline size_t encodedSizeOf(const Path &path) { return Serializer::sizeOf<uint32_t>() + path.size(); }
+inline size_t encodedSizeOf(const StringView &string) { return Serializer::sizeOf<uint32_t>() + string.size(); }
+inline size_t encodedSizeOf(const LogLevel &) { return Serializer::sizeOf<int>(); }
+
+template <typename T>
+size_t encodedSizeOf(const Flags<T> &)
+{
+    return sizeof(T) == 8 ? Serializer::sizeOf<uint64_t>() : Serializer::sizeOf<uint32_t>();
+}
+
+template <typename First, typename Second>
+size_t encodedSizeOf(const std::pair<First, Second> &pair)
+{
+    return addEncodedSize(encodedSizeOf(pair.first), encodedSizeOf(pair.second));
+}
+
+template <typename Container>
+size_t encodedSizeOfRange(const Container &container)
+{
+    size_t ret = Serializer::sizeOf<uint32_t>();
+    for (const auto &value : container) {
+        ret = addEncodedSize(ret, encodedSizeOf(value));
+        if (ret == String::npos)
+            break;
+    }
+    return ret;
+}
+
+template <typename T>
+size_t encodedSizeOf(const List<T> &list)
+{
+    if (FixedSize<T>::value)
+        return Serializer::sizeOf<uint32_t>() + list.size() * Serializer::sizeOf<T>();
+    return encodedSizeOfRange(list);
+}
+
+template <typename T>
+size_t encodedSizeOf(const std::vector<T> &vector)
+{
+    if (FixedSize<T>::value)
+        return Serializer::sizeOf<uint32_t>() + vector.size() * Serializer::sizeOf<T>();
+    return encodedSizeOfRange(vector);
+}
+
+template <typename T>
+size_t encodedSizeOf(const Set<T> &set)
+{
+    if (FixedSize<T>::value)
+        return Serializer::sizeOf<uint32_t>() + set.size() * Serializer::sizeOf<T>();
+    return encodedSizeOfRange(set);
+}
+
+template <typename Key, typename Value>
+size_t encodedSizeOf(const Map<Key, Value> &map)
+{
+    return encodedSizeOfRange(map);
+}
+
+template <typename Key, typename Value>
+size_t encodedSizeOf(const MultiMap<Key, Value> &map)
+{
+    return encodedSizeOfRange(map);
+}
+
+template <typename Key, typename Value>
+size_t encodedSizeOf(const Hash<Key, Value> &hash)
+{
+    return encodedSizeOfRange(hash);
+}
+
+inline void serializeFields(Serializer &)
+{
+}
+
+template <typename T, typename... Args>
+void serializeFields(Serializer &s, const T &t, const Args &... args)
+{
+    s << t;
+    serializeFields(s, args...);
+}
+
+inline void deserializeFields(Deserializer &)
+{
+}
+
+template <typename T, typename... Args>
+void deserializeFields(Deserializer &s, T &t, Args &... args)
+{
+    s >> t;
+    deserializeFields(s, args...);
+}
+
+inline size_t encodedSizeOfFields()
+{
+    return 0;
+}
+
+template <typename T, typename... Args>
+size_t encodedSizeOfFields(const T &t, const Args &... args)
+{
+    return addEncodedSize(encodedSizeOf(t), encodedSizeOfFields(args...));
+}
+
 #endif
@@ -0,0 +1,307 @@
+#include "SharedMemoryChannel.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+#include "rct/rct-config.h"
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RCT_SHARED_MEMORY_CHANNEL
+#endif
+
+#include "rct/Log.h"
+#include "rct/Rct.h"
+
+struct SharedMemoryRing
+{
+    // head is only written by the producer and tail by the consumer, they
+    // live on separate cache lines so the two sides don't contend
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> readerWaiting;
+    std::atomic<uint32_t> writerWaiting;
+
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+};
+
+namespace {
+size_t normalizedRingSize(size_t size)
+{
+    size_t ret = 4096;
+    while (ret < size && ret < (1u << 30))
+        ret <<= 1;
+    return ret;
+}
+
+// returned when the peer moved head or tail past each other, the ring is
+// shared with it so we can't trust either
+const size_t RingCorrupt = static_cast<size_t>(-1);
+
+size_t ringWrite(SharedMemoryRing *ring, size_t capacity, const char *data, size_t size)
+{
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+    if (head - tail > capacity)
+        return RingCorrupt;
+    size = std::min<size_t>(size, capacity - (head - tail));
+    if (!size)
+        return 0;
+    const size_t pos = head & (capacity - 1);
+    const size_t first = std::min(size, capacity - pos);
+    memcpy(ring->data() + pos, data, first);
+    if (first < size)
+        memcpy(ring->data(), data + first, size - first);
+    ring->head.store(head + size, std::memory_order_seq_cst);
+    return size;
+}
+
+size_t ringRead(SharedMemoryRing *ring, size_t capacity, Buffer &buffer)
+{
+    const uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    const uint64_t head = ring->head.load(std::memory_order_acquire);
+    if (head - tail > capacity)
+        return RingCorrupt;
+    const size_t size = head - tail;
+    if (!size)
+        return 0;
+    const size_t offset = buffer.size();
+    buffer.resize(offset + size);
+    const size_t pos = tail & (capacity - 1);
+    const size_t first = std::min(size, capacity - pos);
+    memcpy(buffer.data() + offset, ring->data() + pos, first);
+    if (first < size)
+        memcpy(buffer.data() + offset + first, ring->data(), size - first);
+    ring->tail.store(tail + size, std::memory_order_seq_cst);
+    return size;
+}
+
+bool ringEmpty(SharedMemoryRing *ring)
+{
+    return ring->head.load(std::memory_order_seq_cst) == ring->tail.load(std::memory_order_relaxed);
+}
+
+bool ringFull(SharedMemoryRing *ring, size_t capacity)
+{
+    return ring->head.load(std::memory_order_relaxed) - ring->tail.load(std::memory_order_seq_cst) == capacity;
+}
+}
+
+SharedMemoryChannel::SharedMemoryChannel()
+    : mMemoryFd(-1), mEventFd(-1), mPeerEventFd(-1), mMemory(nullptr), mMappedSize(0), mRingSize(0),
+      mCreator(false), mError(false), mIn(nullptr), mOut(nullptr), mPendingOffset(0), mBytesWritten(0)
+{
+}
+
+SharedMemoryChannel::~SharedMemoryChannel()
+{
+#ifdef RCT_SHARED_MEMORY_CHANNEL
+    if (mMemory)
+        munmap(mMemory, mMappedSize);
+    for (int fd : { mMemoryFd, mEventFd, mPeerEventFd }) {
+        if (fd != -1) {
+            int ret;
+            eintrwrap(ret, ::close(fd));
+        }
+    }
+#endif
+}
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::create(size_t ringSize)
+{
+#ifdef RCT_SHARED_MEMORY_CHANNEL
+    std::unique_ptr<SharedMemoryChannel> channel(new SharedMemoryChannel);
+    channel->mCreator = true;
+    channel->mMemoryFd = memfd_create("rct-connection", MFD_CLOEXEC);
+    channel->mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->mPeerEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel->mMemoryFd == -1 || channel->mEventFd == -1 || channel->mPeerEventFd == -1) {
+        error() << "Failed to create shared memory channel" << Rct::strerror();
+        return std::unique_ptr<SharedMemoryChannel>();
+    }
+    ringSize = normalizedRingSize(ringSize);
+    if (ftruncate(channel->mMemoryFd, (sizeof(SharedMemoryRing) + ringSize) * 2) == -1) {
+        error() << "Failed to size shared memory channel" << Rct::strerror();
+        return std::unique_ptr<SharedMemoryChannel>();
+    }
+    if (!channel->map(channel->mMemoryFd, ringSize, true))
+        return std::unique_ptr<SharedMemoryChannel>();
+    // the first write in either direction wakes up the reader
+    channel->mIn->readerWaiting = 1;
+    channel->mOut->readerWaiting = 1;
+    return channel;
+#else
+    (void)ringSize;
+    return std::unique_ptr<SharedMemoryChannel>();
+#endif
+}
+
+std::unique_ptr<SharedMemoryChannel> SharedMemoryChannel::attach(const List<int> &fileDescriptors, size_t ringSize)
+{
+#ifdef RCT_SHARED_MEMORY_CHANNEL
+    std::unique_ptr<SharedMemoryChannel> channel(new SharedMemoryChannel);
+    if (fileDescriptors.size() != 3) {
+        for (int fd : fileDescriptors) {
+            int ret;
+            eintrwrap(ret, ::close(fd));
+        }
+        return std::unique_ptr<SharedMemoryChannel>();
+    }
+    channel->mMemoryFd = fileDescriptors.at(0);
+    channel->mPeerEventFd = fileDescriptors.at(1);
+    channel->mEventFd = fileDescriptors.at(2);
+    if (normalizedRingSize(ringSize) != ringSize)
+        return std::unique_ptr<SharedMemoryChannel>();
+    struct stat st;
+    if (fstat(channel->mMemoryFd, &st) == -1
+        || static_cast<size_t>(st.st_size) != (sizeof(SharedMemoryRing) + ringSize) * 2) {
+        error() << "Invalid shared memory channel";
+        return std::unique_ptr<SharedMemoryChannel>();
+    }
+    if (!channel->map(channel->mMemoryFd, ringSize, false))
+        return std::unique_ptr<SharedMemoryChannel>();
+    // we don't need to hand this one on
+    int ret;
+    eintrwrap(ret, ::close(channel->mMemoryFd));
+    channel->mMemoryFd = -1;
+    return channel;
+#else
+    (void)fileDescriptors;
+    (void)ringSize;
+    return std::unique_ptr<SharedMemoryChannel>();
+#endif
+}
+
+bool SharedMemoryChannel::map(int memoryFd, size_t ringSize, bool creator)
+{
+#ifdef RCT_SHARED_MEMORY_CHANNEL
+    mRingSize = ringSize;
+    mMappedSize = (sizeof(SharedMemoryRing) + ringSize) * 2;
+    void *memory = mmap(nullptr, mMappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, memoryFd, 0);
+    if (memory == MAP_FAILED) {
+        error() << "Failed to map shared memory channel" << Rct::strerror();
+        return false;
+    }
+    mMemory = memory;
+    SharedMemoryRing *first = static_cast<SharedMemoryRing *>(memory);
+    SharedMemoryRing *second = reinterpret_cast<SharedMemoryRing *>(first->data() + ringSize);
+    mOut = creator ? first : second;
+    mIn = creator ? second : first;
+    return true;
+#else
+    (void)memoryFd;
+    (void)ringSize;
+    (void)creator;
+    return false;
+#endif
+}
+
+List<int> SharedMemoryChannel::fileDescriptors() const
+{
+    assert(mCreator);
+    return List<int>() << mMemoryFd << mEventFd << mPeerEventFd;
+}
+
+void SharedMemoryChannel::clearEvent()
+{
+#ifdef RCT_SHARED_MEMORY_CHANNEL
+    uint64_t count;
+    ssize_t ret;
+    eintrwrap(ret, ::read(mEventFd, &count, sizeof(count)));
+#endif
+}
+
+void SharedMemoryChannel::notifyPeer()
+{
+#ifdef RCT_SHARED_MEMORY_CHANNEL
+    const uint64_t one = 1;
+    ssize_t ret;
+    eintrwrap(ret, ::write(mPeerEventFd, &one, sizeof(one)));
+#endif
+}
+
+void SharedMemoryChannel::write(const void *data, size_t size)
+{
+    if (!size || mError)
+        return;
+    const char *bytes = static_cast<const char *>(data);
+    if (!pendingWrite()) {
+        const size_t written = ringWrite(mOut, mRingSize, bytes, size);
+        if (written == RingCorrupt) {
+            setError();
+            return;
+        }
+        mBytesWritten += written;
+        if (mOut->readerWaiting.load(std::memory_order_seq_cst) && mOut->readerWaiting.exchange(0))
+            notifyPeer();
+        if (written == size)
+            return;
+        bytes += written;
+        size -= written;
+    }
+    mPending.append(bytes, size);
+    flushPending();
+}
+
+void SharedMemoryChannel::flushPending()
+{
+    while (pendingWrite() && !mError) {
+        const size_t written = ringWrite(mOut, mRingSize, mPending.constData() + mPendingOffset, pendingWrite());
+        if (written == RingCorrupt) {
+            setError();
+            return;
+        } else if (written) {
+            mBytesWritten += written;
+            mPendingOffset += written;
+            if (mOut->readerWaiting.load(std::memory_order_seq_cst) && mOut->readerWaiting.exchange(0))
+                notifyPeer();
+            continue;
+        }
+        // ask the reader to wake us up once there's room, unless it made
+        // some while we were asking
+        mOut->writerWaiting.store(1, std::memory_order_seq_cst);
+        if (ringFull(mOut, mRingSize))
+            return;
+    }
+    mPending.clear();
+    mPendingOffset = 0;
+}
+
+size_t SharedMemoryChannel::takeBytesWritten()
+{
+    const size_t ret = mBytesWritten;
+    mBytesWritten = 0;
+    return ret;
+}
+
+bool SharedMemoryChannel::process(Buffer &buffer)
+{
+    flushPending();
+    if (mError)
+        return false;
+    const size_t read = ringRead(mIn, mRingSize, buffer);
+    if (read == RingCorrupt) {
+        setError();
+        return false;
+    } else if (read) {
+        if (mIn->writerWaiting.load(std::memory_order_seq_cst) && mIn->writerWaiting.exchange(0))
+            notifyPeer();
+        return true;
+    }
+    mIn->readerWaiting.store(1, std::memory_order_seq_cst);
+    return !ringEmpty(mIn);
+}
+
+void SharedMemoryChannel::setError()
+{
+    error() << "Shared memory channel corrupted by the peer";
+    mError = true;
+    mPending.clear();
+    mPendingOffset = 0;
+}
@@ -0,0 +1,88 @@
+#ifndef SharedMemoryChannel_h
+#define SharedMemoryChannel_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
+#include <rct/Buffer.h>
+#include <rct/List.h>
+#include <rct/String.h>
+
+struct SharedMemoryRing;
+
+/**
+ * A pair of single producer, single consumer byte rings in a memfd shared
+ * between two processes, one ring per direction. Each side has an eventfd
+ * that the other side signals when it writes to a ring the reader is
+ * waiting on, or frees space in a ring the writer is waiting on. As long
+ * as both sides are busy no system calls are made.
+ *
+ * Only available on Linux, create() and attach() return null elsewhere.
+ */
+class SharedMemoryChannel
+{
+public:
+    ~SharedMemoryChannel();
+
+    /**
+     * Creates a channel with two rings of at least \a ringSize bytes.
+     */
+    static std::unique_ptr<SharedMemoryChannel> create(size_t ringSize);
+    /**
+     * Opens the other end of a channel from the descriptors returned by
+     * fileDescriptors() on the creating side. Takes ownership of them.
+     */
+    static std::unique_ptr<SharedMemoryChannel> attach(const List<int> &fileDescriptors, size_t ringSize);
+
+    List<int> fileDescriptors() const;
+    size_t ringSize() const { return mRingSize; }
+
+    /**
+     * Readable when the peer wants our attention, see process().
+     */
+    int eventFd() const { return mEventFd; }
+    void clearEvent();
+
+    /**
+     * Copies \a size bytes into the outgoing ring. What doesn't fit is
+     * queued and written as the peer makes room.
+     */
+    void write(const void *data, size_t size);
+    size_t pendingWrite() const { return mPending.size() - mPendingOffset; }
+    /**
+     * Returns the number of bytes moved into the outgoing ring since the
+     * last call.
+     */
+    size_t takeBytesWritten();
+
+    /**
+     * Writes queued data and reads everything available into \a buffer.
+     * Returns false once there's nothing left to do and the peer has been
+     * asked to signal eventFd() when that changes.
+     */
+    bool process(Buffer &buffer);
+
+    /**
+     * True once the peer left a ring in an impossible state, nothing is
+     * read or written after that.
+     */
+    bool hasError() const { return mError; }
+
+private:
+    SharedMemoryChannel();
+    bool map(int memoryFd, size_t ringSize, bool creator);
+    void flushPending();
+    void notifyPeer();
+    void setError();
+
+    int mMemoryFd, mEventFd, mPeerEventFd;
+    void *mMemory;
+    size_t mMappedSize, mRingSize;
+    bool mCreator, mError;
+    SharedMemoryRing *mIn, *mOut;
+    String mPending;
+    size_t mPendingOffset, mBytesWritten;
+};
+
+#endif
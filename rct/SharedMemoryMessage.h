@@ -0,0 +1,35 @@
+#ifndef SharedMemoryMessage_h
+#define SharedMemoryMessage_h
+
+#include <rct/Message.h>
+
+/**
+ * Negotiates the shared memory transport of a Connection, see
+ * Connection::enableSharedMemory(). Setup carries the memory and event
+ * file descriptors, the peer answers with Accept or Reject. These are
+ * handled by Connection and never emitted through newMessage().
+ */
+class SharedMemoryMessage : public Message
+{
+public:
+    enum { MessageId = SharedMemoryMessageId };
+    enum Type {
+        Setup,
+        Accept,
+        Reject
+    };
+
+    SharedMemoryMessage(Type type = Setup, uint32_t ringSize = 0)
+        : Message(MessageId), mType(type), mRingSize(ringSize)
+    {}
+
+    Type type() const { return static_cast<Type>(mType); }
+    uint32_t ringSize() const { return mRingSize; }
+
+    RCT_MESSAGE_FIELDS(mType, mRingSize)
+private:
+    uint8_t mType;
+    uint32_t mRingSize;
+};
+
+#endif
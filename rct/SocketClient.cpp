@@ -7,6 +7,7 @@
 #  include <arpa/inet.h>
 #  include <netdb.h>
 #  include <netinet/in.h>
+#  include <netinet/tcp.h>
 #  include <sys/socket.h>
 #  include <sys/un.h>
 #endif
@@ -16,6 +17,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <algorithm>
 #include <cstdint>
 #include <map>
 
@@ -48,7 +50,8 @@ SocketClient::SocketClient(int f, unsigned int mode)
     ::setsockopt(mFd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
 #endif
 #ifdef HAVE_CLOEXEC
-    setFlags(mFd, FD_CLOEXEC, F_GETFD, F_SETFD);
+    if (!(mode & Accepted))
+        setFlags(mFd, FD_CLOEXEC, F_GETFD, F_SETFD);
 #endif
     mBlocking = (mode & Blocking);
 
@@ -57,7 +60,7 @@ SocketClient::SocketClient(int f, unsigned int mode)
             loop->registerSocket(mFd, EventLoop::SocketRead,
                                  std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
 #ifndef _WIN32
-            if (!setFlags(mFd, O_NONBLOCK, F_GETFL, F_SETFL)) {
+            if (!(mode & Accepted) && !setFlags(mFd, O_NONBLOCK, F_GETFL, F_SETFL)) {
                 mSignalError(shared_from_this(), InitializeError);
                 close();
                 return;
@@ -70,12 +73,19 @@ SocketClient::SocketClient(int f, unsigned int mode)
 SocketClient::~SocketClient()
 {
     close();
+#ifndef _WIN32
+    for (const List<int> &fds : mReceivedFileDescriptors) {
+        for (int fd : fds)
+            ::close(fd);
+    }
+#endif
 }
 
 void SocketClient::close()
 {
     if (mFd == -1)
         return;
+    releaseConnectionCount();
     mSocketState = Disconnected;
     if (!mBlocking) {
         if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
@@ -85,6 +95,26 @@ void SocketClient::close()
     mSocketPort = 0;
     mAddress.clear();
     mFd = -1;
+#ifndef _WIN32
+    for (const auto &pending : mPendingFileDescriptors) {
+        for (int fd : pending.second)
+            ::close(fd);
+    }
+    mPendingFileDescriptors.clear();
+    for (const WriteSegment &segment : mWriteSegments) {
+        for (int fd : segment.fileDescriptors)
+            ::close(fd);
+    }
+#endif
+    mWriteSegments.clear();
+    mWriteSegmentsSize = 0;
+    if (mStatistics && mStatistics->queuedSince) {
+        // whatever is left won't be written anymore
+        const uint64_t time = Rct::monoMs() - mStatistics->queuedSince;
+        mStatistics->queueTime += time;
+        mStatistics->maxQueueTime = std::max(mStatistics->maxQueueTime, time);
+        mStatistics->queuedSince = 0;
+    }
 }
 
 class Resolver
@@ -407,7 +437,68 @@ String SocketClient::sockName(uint16_t* port) const
     return getNameHelper(mFd, ::getsockname, port);
 }
 
+#ifndef _WIN32
+static int sendFileDescriptors(int fd, const void *data, size_t size, const List<int> &fileDescriptors, int flags)
+{
+    iovec iov;
+    iov.iov_base = const_cast<void *>(data);
+    iov.iov_len = size;
+
+    assert(fileDescriptors.size() <= SocketClient::MaxFileDescriptors);
+    const size_t len = fileDescriptors.size() * sizeof(int);
+    // cmsghdr has to be aligned
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * SocketClient::MaxFileDescriptors)];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(len);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(len);
+    memcpy(CMSG_DATA(cmsg), fileDescriptors.data(), len);
+
+    int e;
+    eintrwrap(e, ::sendmsg(fd, &msg, flags));
+    return e;
+}
+
+bool SocketClient::write(const void *data, unsigned int size, const List<int> &fileDescriptors)
+{
+    assert(mSocketMode & Unix);
+    assert(size);
+    if (fileDescriptors.isEmpty())
+        return write(data, size);
+    if (fileDescriptors.size() > MaxFileDescriptors) {
+        ::error() << "Can't pass" << fileDescriptors.size() << "file descriptors in one write";
+        return false;
+    }
+    return writeTo(String(), 0, reinterpret_cast<const unsigned char*>(data), size, &fileDescriptors);
+}
+
+List<int> SocketClient::takeFileDescriptors()
+{
+    if (mReceivedFileDescriptors.isEmpty())
+        return List<int>();
+    return mReceivedFileDescriptors.takeFirst();
+}
+#endif
+
 bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned char* f_data, unsigned int size)
+{
+    return writeTo(host, port, f_data, size, nullptr);
+}
+
+bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned char* f_data, unsigned int size,
+                           const List<int> *fileDescriptors)
 {
 #ifdef _WIN32
     const char *data = reinterpret_cast<const char*>(f_data);
@@ -443,12 +534,37 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
             const size_t writeBufferSize = mWriteBuffer.size() - mWriteOffset;
             while (total < writeBufferSize) {
                 assert(mWriteBuffer.size() > total);
+                size_t chunk = writeBufferSize - total;
+#ifndef _WIN32
+                const List<int> *pendingFileDescriptors = nullptr;
+                if (!mPendingFileDescriptors.isEmpty()) {
+                    const size_t pos = mWriteOffset + total;
+                    const size_t at = mPendingFileDescriptors.first().first;
+                    assert(at >= pos);
+                    if (at == pos) {
+                        pendingFileDescriptors = &mPendingFileDescriptors.first().second;
+                        if (mPendingFileDescriptors.size() > 1)
+                            chunk = std::min(chunk, mPendingFileDescriptors.at(1).first - pos);
+                    } else {
+                        chunk = std::min(chunk, at - pos);
+                    }
+                }
+                if (pendingFileDescriptors) {
+                    e = sendFileDescriptors(mFd, mWriteBuffer.data() + total + mWriteOffset, chunk, *pendingFileDescriptors, sendFlags);
+                    if (e > 0) {
+                        for (int fd : *pendingFileDescriptors)
+                            ::close(fd);
+                        mPendingFileDescriptors.removeFirst();
+                    }
+                } else
+#endif
                 if (resolver.addr) {
-                    eintrwrap(e, ::sendto(mFd, reinterpret_cast<const char*>(mWriteBuffer.data()) + total + mWriteOffset, writeBufferSize - total,
+                    eintrwrap(e, ::sendto(mFd, reinterpret_cast<const char*>(mWriteBuffer.data()) + total + mWriteOffset, chunk,
                                           sendFlags, resolver.addr, resolver.size));
                 } else {
-                    eintrwrap(e, ::write(mFd, mWriteBuffer.data() + total + mWriteOffset, writeBufferSize - total));
+                    eintrwrap(e, ::write(mFd, mWriteBuffer.data() + total + mWriteOffset, chunk));
                 }
+                recordWrite(e);
                 DEBUG() << "SENT(1)" << (writeBufferSize - total) << "BYTES" << e << errno;
                 if (e == -1) {
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -479,6 +595,13 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
             }
         }
 
+        if (mFd != -1 && !mWriteWait && mWriteBuffer.empty() && !mWriteSegments.isEmpty()
+            && !flushWriteSegments(socketPtr, sendFlags)) {
+            return false;
+        }
+        if (mStatistics)
+            updateQueueStatistics();
+
         if (mFd == -1 || !data) {
             return mFd != -1;
         }
@@ -486,15 +609,21 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
 
         assert(data != nullptr && size > 0);
 
-        if (mWriteBuffer.empty()) {
+        if (mWriteBuffer.empty() && mWriteSegments.isEmpty()) {
             for (;;) {
                 assert(size > total);
+#ifndef _WIN32
+                if (fileDescriptors && !total) {
+                    e = sendFileDescriptors(mFd, data, size, *fileDescriptors, sendFlags);
+                } else
+#endif
                 if (resolver.addr) {
                     eintrwrap(e, ::sendto(mFd, data + total, size - total,
                                           sendFlags, resolver.addr, resolver.size));
                 } else {
                     eintrwrap(e, ::write(mFd, data + total, size - total));
                 }
+                recordWrite(e);
                 DEBUG() << "SENT(2)" << (size - total) << "BYTES" << e << errno;
                 if (e == -1) {
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -525,17 +654,141 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
     if (total < size) {
         // store the rest
         const unsigned int rem = size - total;
-        if (mMaxWriteBufferSize && mWriteBuffer.size() + rem > mMaxWriteBufferSize) {
+        if (mMaxWriteBufferSize && mWriteBuffer.size() + mWriteSegmentsSize + rem > mMaxWriteBufferSize) {
             close();
             return false;
         }
+        if (!mWriteSegments.isEmpty()) {
+            return queueWriteSegment(std::make_shared<const String>(reinterpret_cast<const char *>(data + total), rem),
+                                     total ? nullptr : fileDescriptors);
+        }
+#ifndef _WIN32
+        if (fileDescriptors && !total) {
+            List<int> dups;
+            dups.reserve(fileDescriptors->size());
+            for (int fd : *fileDescriptors) {
+                int dup;
+#ifdef HAVE_CLOEXEC
+                eintrwrap(dup, ::fcntl(fd, F_DUPFD_CLOEXEC, 0));
+#else
+                eintrwrap(dup, ::dup(fd));
+#endif
+                if (dup == -1) {
+                    for (int d : dups)
+                        ::close(d);
+                    mSignalError(shared_from_this(), WriteError);
+                    close();
+                    return false;
+                }
+                dups.append(dup);
+            }
+            mPendingFileDescriptors.append(std::make_pair(mWriteBuffer.size(), std::move(dups)));
+        }
+#endif
         mWriteBuffer.reserve(mWriteBuffer.size() + rem);
         memcpy(mWriteBuffer.end(), data + total, rem);
         mWriteBuffer.resize(mWriteBuffer.size() + rem);
+        if (mStatistics)
+            updateQueueStatistics();
     }
     return true;
 }
 
+bool SocketClient::write(const std::shared_ptr<const String> &data)
+{
+    if (mFd == -1)
+        return false;
+    if (!data || data->isEmpty())
+        return true;
+    if (mMaxWriteBufferSize && mWriteBuffer.size() + mWriteSegmentsSize + data->size() > mMaxWriteBufferSize) {
+        close();
+        return false;
+    }
+    std::shared_ptr<const String> copy = data;
+    if (!queueWriteSegment(std::move(copy), nullptr))
+        return false;
+    return mWriteWait || write(nullptr, 0);
+}
+
+bool SocketClient::queueWriteSegment(std::shared_ptr<const String> &&data, const List<int> *fileDescriptors)
+{
+    WriteSegment segment;
+    segment.offset = 0;
+#ifndef _WIN32
+    if (fileDescriptors) {
+        for (int fd : *fileDescriptors) {
+            int dup;
+#ifdef HAVE_CLOEXEC
+            eintrwrap(dup, ::fcntl(fd, F_DUPFD_CLOEXEC, 0));
+#else
+            eintrwrap(dup, ::dup(fd));
+#endif
+            if (dup == -1) {
+                for (int d : segment.fileDescriptors)
+                    ::close(d);
+                mSignalError(shared_from_this(), WriteError);
+                close();
+                return false;
+            }
+            segment.fileDescriptors.append(dup);
+        }
+    }
+#else
+    (void)fileDescriptors;
+#endif
+    mWriteSegmentsSize += data->size();
+    segment.data = std::move(data);
+    mWriteSegments.append(std::move(segment));
+    if (mStatistics)
+        updateQueueStatistics();
+    return true;
+}
+
+bool SocketClient::flushWriteSegments(const std::shared_ptr<SocketClient> &socketPtr, int sendFlags)
+{
+    while (!mWriteSegments.isEmpty() && mFd != -1) {
+        WriteSegment &segment = mWriteSegments.first();
+        const char *data = segment.data->constData() + segment.offset;
+        const size_t size = segment.data->size() - segment.offset;
+        int e;
+#ifndef _WIN32
+        if (!segment.fileDescriptors.isEmpty()) {
+            e = sendFileDescriptors(mFd, data, size, segment.fileDescriptors, sendFlags);
+            if (e > 0) {
+                for (int fd : segment.fileDescriptors)
+                    ::close(fd);
+                segment.fileDescriptors.clear();
+            }
+        } else
+#endif
+        {
+            eintrwrap(e, ::send(mFd, data, size, sendFlags));
+        }
+        recordWrite(e);
+        DEBUG() << "SENT(3)" << size << "BYTES" << e << errno;
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
+                    loop->updateSocket(mFd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                    mWriteWait = true;
+                }
+                return true;
+            }
+            mSignalError(socketPtr, WriteError);
+            close();
+            return false;
+        }
+        mWriteSegmentsSize -= e;
+        if (static_cast<size_t>(e) == size) {
+            mWriteSegments.pop_front();
+        } else {
+            segment.offset += e;
+        }
+        mSignalBytesWritten(socketPtr, e);
+    }
+    return mFd != -1;
+}
+
 bool SocketClient::write(const void *data, unsigned int size)
 {
     return writeTo(String(), 0, reinterpret_cast<const unsigned char*>(data), size);
@@ -576,6 +829,63 @@ static uint16_t addrToPort(const sockaddr* addr, bool IPv6)
     return ntohs(reinterpret_cast<const sockaddr_in*>(addr)->sin_port);
 }
 
+#ifndef _WIN32
+int SocketClient::receiveFileDescriptors(void *data, size_t size)
+{
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MaxFileDescriptors)];
+    } control;
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+    const int flags = MSG_CMSG_CLOEXEC;
+#else
+    const int flags = 0;
+#endif
+    int e;
+    eintrwrap(e, ::recvmsg(mFd, &msg, flags));
+    if (e <= 0 || !msg.msg_controllen)
+        return e;
+
+    const bool truncated = msg.msg_flags & MSG_CTRUNC;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        List<int> fds(count);
+        memcpy(fds.data(), CMSG_DATA(cmsg), count * sizeof(int));
+        if (truncated) {
+            for (int fd : fds)
+                ::close(fd);
+            continue;
+        }
+#if defined(HAVE_CLOEXEC) && !defined(MSG_CMSG_CLOEXEC)
+        for (int fd : fds)
+            setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+        mReceivedFileDescriptors.append(std::move(fds));
+    }
+    if (truncated) {
+        // the message can't be handled without the rest of them
+        ::error() << "File descriptors were truncated on" << mFd;
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return e;
+}
+#endif
+
 void SocketClient::socketCallback(int f, int mode)
 {
     assert(f == mFd);
@@ -628,9 +938,16 @@ void SocketClient::socketCallback(int f, int mode)
                     fromLen = sizeof(fromAddr4);
                     eintrwrap(e, ::recvfrom(mFd, reinterpret_cast<char*>(mReadBuffer.end()), rem, 0, &fromAddr, &fromLen));
                 }
-            } else {
+            }
+#ifndef _WIN32
+            else if (mSocketMode & Unix) {
+                e = receiveFileDescriptors(mReadBuffer.end(), rem);
+            }
+#endif
+            else {
                 eintrwrap(e, ::read(mFd, mReadBuffer.end(), rem));
             }
+            recordRead(e);
             DEBUG() << "RECEIVED(2)" << rem << "BYTES" << e << errno;
             if (e == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -786,6 +1103,74 @@ double SocketClient::mbpsWritten() const
 }
 #endif
 
+SocketClient::Statistics &SocketClient::Statistics::operator+=(const Statistics &other)
+{
+    bytesRead += other.bytesRead;
+    bytesWritten += other.bytesWritten;
+    reads += other.reads;
+    writes += other.writes;
+    writeWaits += other.writeWaits;
+    queuedBytes += other.queuedBytes;
+    maxQueuedBytes = std::max(maxQueuedBytes, other.maxQueuedBytes);
+    queueTime += other.queueTime;
+    maxQueueTime = std::max(maxQueueTime, other.maxQueueTime);
+    rtt = std::max(rtt, other.rtt);
+    rttVariance = std::max(rttVariance, other.rttVariance);
+    elapsed = std::max(elapsed, other.elapsed);
+    return *this;
+}
+
+void SocketClient::setStatisticsEnabled(bool on)
+{
+    if (!on) {
+        mStatistics.reset();
+        return;
+    }
+    mStatistics = std::make_shared<StatisticsData>();
+    mStatistics->started = Rct::monoMs();
+    updateQueueStatistics();
+}
+
+SocketClient::Statistics SocketClient::statistics() const
+{
+    if (!mStatistics)
+        return Statistics();
+    const uint64_t now = Rct::monoMs();
+    Statistics ret = *mStatistics;
+    ret.elapsed = now - mStatistics->started;
+    if (mStatistics->queuedSince) {
+        // count the stretch we're in the middle of
+        ret.queueTime += now - mStatistics->queuedSince;
+        ret.maxQueueTime = std::max(ret.maxQueueTime, now - mStatistics->queuedSince);
+    }
+#if defined(HAVE_TCP_INFO)
+    if (mFd != -1 && mSocketMode & Tcp) {
+        tcp_info info;
+        socklen_t size = sizeof(info);
+        if (!::getsockopt(mFd, IPPROTO_TCP, TCP_INFO, &info, &size)) {
+            ret.rtt = info.tcpi_rtt;
+            ret.rttVariance = info.tcpi_rttvar;
+        }
+    }
+#endif
+    return ret;
+}
+
+void SocketClient::updateQueueStatistics()
+{
+    assert(mStatistics);
+    const uint64_t queued = (mWriteBuffer.size() - mWriteOffset) + mWriteSegmentsSize;
+    mStatistics->queuedBytes = queued;
+    mStatistics->maxQueuedBytes = std::max(mStatistics->maxQueuedBytes, queued);
+    if (queued && !mStatistics->queuedSince) {
+        mStatistics->queuedSince = Rct::monoMs();
+    } else if (!queued && mStatistics->queuedSince) {
+        const uint64_t time = Rct::monoMs() - mStatistics->queuedSince;
+        mStatistics->queueTime += time;
+        mStatistics->maxQueueTime = std::max(mStatistics->maxQueueTime, time);
+        mStatistics->queuedSince = 0;
+    }
+}
 
 void SocketClient::bytesWritten(const std::shared_ptr<SocketClient> &socket, uint64_t bytes)
 {
@@ -1,6 +1,7 @@
 #ifndef TCPSOCKET_H
 #define TCPSOCKET_H
 
+#include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <memory>
@@ -8,6 +9,7 @@
 #include <utility>
 
 #include "Buffer.h"
+#include "LinkedList.h"
 #include "Rct.h"
 #include "SignalSlot.h"
 #include "String.h"
@@ -22,14 +24,21 @@ public:
         Udp = 0x2,
         Unix = 0x4,
         IPv6 = 0x8,
-        Blocking = 0x10
+        Blocking = 0x10,
+        Accepted = 0x20 // fd already has O_NONBLOCK and FD_CLOEXEC set, e.g. from accept4()
     };
 
     SocketClient(unsigned int mode = 0);
     SocketClient(int fd, unsigned int mode);
     ~SocketClient();
 
-    int takeFD() { const int f = mFd; mFd = -1; return f; }
+    int takeFD()
+    {
+        const int f = mFd;
+        mFd = -1;
+        releaseConnectionCount();
+        return f;
+    }
 
     enum State { Disconnected, Connecting, Connected };
     State state() const { return mSocketState; }
@@ -52,6 +61,25 @@ public:
     // TCP/UNIX
     bool write(const void *data, unsigned int num);
     bool write(const String &data) { return write(&data[0], data.size()); }
+    // Queues data that's shared with other sockets without copying it. It
+    // must not be modified afterwards.
+    bool write(const std::shared_ptr<const String> &data);
+
+#ifndef _WIN32
+    // UNIX, the file descriptors are passed as SCM_RIGHTS along with the
+    // first byte of data. They're duplicated if the write has to be queued
+    // so the caller may close them once this returns. The receiving side
+    // takes at most MaxFileDescriptors per write and drops the connection
+    // if it gets more.
+    enum { MaxFileDescriptors = 64 };
+    bool write(const void *data, unsigned int num, const List<int> &fileDescriptors);
+    bool write(const String &data, const List<int> &fileDescriptors) { return write(&data[0], data.size(), fileDescriptors); }
+
+    // File descriptors received on a UNIX socket, one list per sendmsg() of
+    // the peer. Ownership passes to the caller.
+    bool hasFileDescriptors() const { return !mReceivedFileDescriptors.empty(); }
+    List<int> takeFileDescriptors();
+#endif
 
     String peerName(uint16_t *port = nullptr) const;
     String peerString() const
@@ -116,6 +144,39 @@ public:
 #ifdef RCT_SOCKETCLIENT_TIMING_ENABLED
     double mbpsWritten() const;
 #endif
+
+    /**
+     * Counters kept while statistics are enabled. Times are in ms, rtt in
+     * microseconds. rtt is read from TCP_INFO when statistics() is called
+     * and is 0 where that isn't available. In aggregates, see
+     * SocketServer::statistics(), the max* and rtt fields are the largest
+     * of any socket.
+     */
+    struct Statistics {
+        uint64_t bytesRead = 0;
+        uint64_t bytesWritten = 0;
+        uint64_t reads = 0;          // read system calls
+        uint64_t writes = 0;         // write system calls
+        uint64_t writeWaits = 0;     // writes that found the socket buffer full
+        uint64_t queuedBytes = 0;    // waiting in the write queue right now
+        uint64_t maxQueuedBytes = 0;
+        uint64_t queueTime = 0;      // time with data waiting in the write queue
+        uint64_t maxQueueTime = 0;   // longest stretch of it
+        uint32_t rtt = 0;
+        uint32_t rttVariance = 0;
+        uint64_t elapsed = 0;        // time since statistics were enabled
+
+        Statistics &operator+=(const Statistics &other);
+    };
+
+    /**
+     * Off by default, costs a pointer check per system call while off.
+     * Turning it on again resets the counters.
+     */
+    void setStatisticsEnabled(bool on);
+    bool isStatisticsEnabled() const { return mStatistics != nullptr; }
+    Statistics statistics() const;
+
     bool logsEnabled() const { return mLogsEnabled; }
     void setLogsEnabled(bool on) { mLogsEnabled = on; }
 private:
@@ -140,9 +201,65 @@ private:
     Buffer mReadBuffer, mWriteBuffer;
     size_t mWriteOffset;
 
+    bool writeTo(const String &host, uint16_t port, const unsigned char *data, unsigned int num, const List<int> *fileDescriptors);
+    bool flushWriteSegments(const std::shared_ptr<SocketClient> &socketPtr, int sendFlags);
+    bool queueWriteSegment(std::shared_ptr<const String> &&data, const List<int> *fileDescriptors);
+
+    // Written after mWriteBuffer. Once there are segments everything else
+    // that has to be queued becomes a segment too, to keep the order.
+    struct WriteSegment {
+        std::shared_ptr<const String> data;
+        size_t offset;
+        List<int> fileDescriptors;
+    };
+    LinkedList<WriteSegment> mWriteSegments;
+    size_t mWriteSegmentsSize { 0 };
     int writeData(const unsigned char *data, int size);
     void socketCallback(int, int);
 
+    struct StatisticsData : public Statistics {
+        uint64_t started = 0, queuedSince = 0;
+    };
+    std::shared_ptr<StatisticsData> mStatistics;
+    // the SocketServer's count of open connections, decremented once the
+    // fd is closed or taken
+    std::shared_ptr<size_t> mConnectionCount;
+    void releaseConnectionCount()
+    {
+        if (mConnectionCount) {
+            --*mConnectionCount;
+            mConnectionCount.reset();
+        }
+    }
+    void recordRead(int ret)
+    {
+        if (mStatistics) {
+            ++mStatistics->reads;
+            if (ret > 0)
+                mStatistics->bytesRead += ret;
+        }
+    }
+    void recordWrite(int ret)
+    {
+        if (mStatistics) {
+            ++mStatistics->writes;
+            if (ret > 0) {
+                mStatistics->bytesWritten += ret;
+            } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                ++mStatistics->writeWaits;
+            }
+        }
+    }
+    void updateQueueStatistics();
+
+#ifndef _WIN32
+    int receiveFileDescriptors(void *data, size_t size);
+
+    // offset into mWriteBuffer and the (duplicated) descriptors to send with it
+    List<std::pair<size_t, List<int> > > mPendingFileDescriptors;
+    List<List<int> > mReceivedFileDescriptors;
+#endif
+
 #ifdef RCT_SOCKETCLIENT_TIMING_ENABLED
     struct TimeData {
         TimeData(uint64_t b = 0)
@@ -182,6 +299,7 @@ private:
 #endif
 
     friend class Resolver;
+    friend class SocketServer;
 };
 
 #endif
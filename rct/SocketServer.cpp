@@ -23,12 +23,16 @@
 #include "EventLoop.h"
 #include "rct/rct-config.h"
 #include "Rct.h"
+#include "Timer.h"
 #include "rct/Path.h"
 #include "rct/SocketClient.h"
 #include "rct/String.h"
 
 SocketServer::SocketServer()
-    : fd(-1), isIPv6(false)
+    : fd(-1), isIPv6(false), listenBacklog(128), acceptBatch(64), maxConnectionCount(0),
+      acceptRate(0), acceptTokens(0), acceptTokensTime(0), acceptTimer(0),
+      acceptedTotal(0), refusedTotal(0), connectionCount(std::make_shared<size_t>(0)), statisticsEnabled(false),
+      trackedPruneSize(64)
 {}
 
 SocketServer::~SocketServer()
@@ -40,8 +44,12 @@ void SocketServer::close()
 {
     if (fd == -1)
         return;
-    if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+    if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
         loop->unregisterSocket(fd);
+        if (acceptTimer)
+            loop->unregisterTimer(acceptTimer);
+    }
+    acceptTimer = 0;
     ::close(fd);
     fd = -1;
     if (!path.empty()) {
@@ -162,9 +170,7 @@ bool SocketServer::commonBindAndListen(sockaddr* addr, size_t size)
 
 bool SocketServer::commonListen()
 {
-    // ### should be able to customize the backlog
-    enum { Backlog = 128 };
-    if (::listen(fd, Backlog) < 0) {
+    if (::listen(fd, listenBacklog) < 0) {
         fprintf(stderr, "::listen() failed with errno: %s\n",
                 Rct::strerror().c_str());
 
@@ -192,16 +198,112 @@ bool SocketServer::commonListen()
     return true;
 }
 
+void SocketServer::setAcceptRateLimit(size_t perSecond)
+{
+    acceptRate = perSecond;
+    acceptTokens = perSecond;
+    acceptTokensTime = Rct::monoMs();
+}
+
 std::shared_ptr<SocketClient> SocketServer::nextConnection()
 {
     if (accepted.empty())
         return nullptr;
     const int sock = accepted.front();
     accepted.pop();
-    return std::shared_ptr<SocketClient>(new SocketClient(sock, path.empty() ? SocketClient::Tcp : SocketClient::Unix));
+    unsigned int mode = path.empty() ? SocketClient::Tcp : SocketClient::Unix;
+#ifdef HAVE_ACCEPT4
+    mode |= SocketClient::Accepted;
+#endif
+    std::shared_ptr<SocketClient> client(new SocketClient(sock, mode));
+    ++*connectionCount;
+    client->mConnectionCount = connectionCount;
+    if (statisticsEnabled) {
+        client->setStatisticsEnabled(true);
+        // don't let clients that are long gone pile up if nobody asks
+        if (tracked.size() >= trackedPruneSize) {
+            pruneTracked();
+            trackedPruneSize = std::max<size_t>(64, tracked.size() * 2);
+        }
+        tracked.append({ client, client->mStatistics });
+    }
+    return client;
+}
+
+void SocketServer::pruneTracked() const
+{
+    auto it = tracked.begin();
+    while (it != tracked.end()) {
+        if (it->client.expired()) {
+            SocketClient::Statistics statistics = *it->statistics;
+            statistics.queuedBytes = 0;
+            closedStatistics += statistics;
+            it = tracked.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+SocketClient::Statistics SocketServer::statistics() const
+{
+    pruneTracked();
+    SocketClient::Statistics ret = closedStatistics;
+    for (const TrackedClient &t : tracked) {
+        if (std::shared_ptr<SocketClient> client = t.client.lock()) {
+            // the client may have reset or turned off its counters since
+            ret += client->mStatistics == t.statistics ? client->statistics() : *t.statistics;
+        }
+    }
+    return ret;
+}
+
+List<std::shared_ptr<SocketClient> > SocketServer::clients() const
+{
+    pruneTracked();
+    List<std::shared_ptr<SocketClient> > ret;
+    for (const TrackedClient &t : tracked) {
+        std::shared_ptr<SocketClient> client = t.client.lock();
+        if (client && client->isConnected())
+            ret.append(std::move(client));
+    }
+    return ret;
+}
+
+bool SocketServer::takeAcceptToken()
+{
+    if (!acceptRate)
+        return true;
+    const uint64_t now = Rct::monoMs();
+    acceptTokens = std::min<double>(acceptRate, acceptTokens + ((now - acceptTokensTime) * acceptRate / 1000.0));
+    acceptTokensTime = now;
+    if (acceptTokens < 1.0)
+        return false;
+    acceptTokens -= 1.0;
+    return true;
+}
+
+void SocketServer::scheduleAccept(int timeout)
+{
+    if (acceptTimer)
+        return;
+    if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
+        acceptTimer = loop->registerTimer([this](int) {
+                acceptTimer = 0;
+                acceptConnections();
+            }, timeout, Timer::SingleShot);
+    }
 }
 
 void SocketServer::socketCallback(int /*fd*/, int mode)
+{
+    if (!(mode & EventLoop::SocketRead))
+        return;
+
+    acceptConnections();
+}
+
+void SocketServer::acceptConnections()
 {
     union {
         sockaddr_in client4;
@@ -209,29 +311,49 @@ void SocketServer::socketCallback(int /*fd*/, int mode)
         sockaddr client;
     };
     socklen_t size = 0;
-    if (isIPv6) {
-        size = sizeof(client6);
-    } else {
-        size = sizeof(client4);
-    }
     int e;
 
-    if (!(mode & EventLoop::SocketRead))
-        return;
-
+    // the listening socket is edge triggered so we have to either drain it
+    // or come back later on our own
+    size_t count = 0;
     for (;;) {
+        if (count == acceptBatch) {
+            scheduleAccept(0);
+            break;
+        }
+        if (!takeAcceptToken()) {
+            scheduleAccept(std::max<int>(1, 1000 / acceptRate));
+            break;
+        }
+
+        size = isIPv6 ? sizeof(client6) : sizeof(client4);
+#ifdef HAVE_ACCEPT4
+        eintrwrap(e, ::accept4(fd, &client, &size, SOCK_NONBLOCK | SOCK_CLOEXEC));
+#else
         eintrwrap(e, ::accept(fd, &client, &size));
+#endif
         if (e == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return;
-            }
+            if (acceptRate)
+                acceptTokens += 1.0;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
             serverError(this, AcceptError);
             close();
             return;
         }
+        ++count;
 
-        //EventLoop::eventLoop()->unregisterSocket( fd );
+        if (maxConnectionCount && activeConnections() >= maxConnectionCount) {
+            ++refusedTotal;
+            ::close(e);
+            continue;
+        }
+
+        ++acceptedTotal;
         accepted.push(e);
         serverNewConnection(this);
+        // a handler may have closed us
+        if (fd == -1)
+            return;
     }
 }
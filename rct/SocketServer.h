@@ -2,10 +2,12 @@
 #define SOCKETSERVER_H
 
 #include <stdint.h>
+#include <rct/List.h>
 #include <rct/Path.h>
 #include <rct/SignalSlot.h>
 #include <rct/SocketClient.h>
 #include <stddef.h>
+#include <algorithm>
 #include <memory>
 #include <queue>
 #include <functional>
@@ -31,8 +33,58 @@ public:
 #endif
     bool isListening() const { return fd != -1; }
 
+    /**
+     * Backlog passed to ::listen(). Only takes effect for subsequent calls to
+     * listen()/listenFD().
+     */
+    void setBacklog(int backlog) { listenBacklog = backlog; }
+    int backlog() const { return listenBacklog; }
+
+    /**
+     * Maximum number of sockets accepted per readiness notification. When a
+     * batch fills up the server yields to the event loop and continues
+     * accepting on the next iteration.
+     */
+    void setAcceptBatchSize(size_t size) { acceptBatch = std::max<size_t>(size, 1); }
+    size_t acceptBatchSize() const { return acceptBatch; }
+
+    /**
+     * Maximum number of concurrent connections, counting both queued sockets
+     * and connected SocketClients handed out by nextConnection(). Sockets
+     * accepted above the limit are closed immediately. 0 means no limit.
+     */
+    void setMaxConnections(size_t max) { maxConnectionCount = max; }
+    size_t maxConnections() const { return maxConnectionCount; }
+
+    /**
+     * Maximum number of sockets accepted per second. Pending connections
+     * above the rate are left in the kernel backlog until tokens become
+     * available. 0 means no limit.
+     */
+    void setAcceptRateLimit(size_t perSecond);
+    size_t acceptRateLimit() const { return acceptRate; }
+
+    uint64_t acceptedCount() const { return acceptedTotal; }
+    uint64_t refusedCount() const { return refusedTotal; }
+    size_t queuedCount() const { return accepted.size(); }
+    size_t activeConnections() const { return *connectionCount + accepted.size(); }
+
+    /**
+     * Enables statistics on SocketClients handed out by nextConnection()
+     * from now on. statistics() adds up all of them, including ones that
+     * have been destroyed since, and clients() returns the ones that are
+     * still connected, e.g. to find the busiest or slowest peers.
+     */
+    void setStatisticsEnabled(bool on) { statisticsEnabled = on; }
+    bool isStatisticsEnabled() const { return statisticsEnabled; }
+    SocketClient::Statistics statistics() const;
+    List<std::shared_ptr<SocketClient> > clients() const;
+
     std::shared_ptr<SocketClient> nextConnection();
 
+    /**
+     * Emitted once per accepted socket.
+     */
     Signal<std::function<void(SocketServer*)> >& newConnection() { return serverNewConnection; }
 
     enum Error { InitializeError, BindError, ListenError, AcceptError };
@@ -42,12 +94,34 @@ private:
     void socketCallback(int fd, int mode);
     bool commonBindAndListen(sockaddr* addr, size_t size);
     bool commonListen();
+    void acceptConnections();
+    void scheduleAccept(int timeout);
+    bool takeAcceptToken();
+    void pruneTracked() const;
 
 private:
     int fd;
     bool isIPv6;
     Path path;
     std::queue<int> accepted;
+    int listenBacklog;
+    size_t acceptBatch;
+    size_t maxConnectionCount;
+    size_t acceptRate;
+    double acceptTokens;
+    uint64_t acceptTokensTime;
+    int acceptTimer;
+    uint64_t acceptedTotal, refusedTotal;
+    // clients handed out by nextConnection() that haven't been closed
+    std::shared_ptr<size_t> connectionCount;
+    struct TrackedClient {
+        std::weak_ptr<SocketClient> client;
+        std::shared_ptr<const SocketClient::Statistics> statistics;
+    };
+    bool statisticsEnabled;
+    mutable List<TrackedClient> tracked;
+    size_t trackedPruneSize;
+    mutable SocketClient::Statistics closedStatistics;
     Signal<std::function<void(SocketServer*)> > serverNewConnection;
     Signal<std::function<void(SocketServer*, Error)> > serverError;
 };
@@ -1,6 +1,7 @@
 #include "String.h"
 
 #include <zconf.h>
+#include <algorithm>
 
 #ifdef RCT_HAVE_ZLIB
 #include <zlib.h>
@@ -8,27 +9,30 @@
 enum { BufferSize = 1024 * 32 };
 #endif
 
-String String::compress() const
+String String::compress(const char *data, size_t size, int level)
 {
 #ifndef RCT_HAVE_ZLIB
+    (void)data;
+    (void)size;
+    (void)level;
     assert(0 && "Rct configured without zlib support");
     return String();
 #else
-    if (empty())
+    if (!size)
         return String();
     z_stream stream;
     memset(&stream, 0, sizeof(stream));
 
-    if (::deflateInit(&stream, Z_BEST_COMPRESSION) != Z_OK)
+    if (::deflateInit(&stream, level) != Z_OK)
         return String();
 
-    stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef *>(data()));
-    stream.avail_in = size();
+    stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef *>(data));
+    stream.avail_in = size;
 
     char buffer[BufferSize];
 
     String out;
-    out.reserve(size() / 2);
+    out.reserve(size / 2);
 
     int error = 0;
     do {
@@ -51,11 +55,12 @@ String String::compress() const
 #endif
 }
 
-String String::uncompress(const char *data, size_t size)
+String String::uncompress(const char *data, size_t size, size_t maxSize)
 {
 #ifndef RCT_HAVE_ZLIB
     (void)data;
     (void)size;
+    (void)maxSize;
     assert(0 && "Rct configured without zlib support");
     return String();
 #else
@@ -74,7 +79,7 @@ String String::uncompress(const char *data, size_t size)
     char buffer[BufferSize];
 
     String out;
-    out.reserve(size * 2);
+    out.reserve(std::min(size * 2, maxSize));
 
     int error = 0;
     do {
@@ -89,6 +94,10 @@ String String::uncompress(const char *data, size_t size)
         }
 
         const int processed = sizeof(buffer) - stream.avail_out;
+        if (static_cast<size_t>(processed) > maxSize - out.size()) {
+            out.clear();
+            break;
+        }
         out.append(buffer, processed);
     } while (!stream.avail_out);
 
@@ -7,6 +7,7 @@
 #include <strings.h>
 #include <time.h>
 #include <rct/List.h>
+#include <rct/StringSearch.h>
 #include <assert.h>
 #include <cstdint>
 #include <cstdio>
@@ -21,6 +22,8 @@
 #include <utility>
 
 #define RCT_PRINTF_WARNING(fmt, firstarg) __attribute__ ((__format__ (__printf__, fmt, firstarg)))
+class StringView;
+
 class String
 {
 public:
@@ -98,95 +101,43 @@ public:
     iterator begin() { return mString.begin(); }
     iterator end() { return mString.end(); }
 
+    /**
+     * Matches start at or before \a from. CaseInsensitive only folds
+     * ASCII letters, see StringSearch.
+     */
     size_t lastIndexOf(char ch, size_t from = npos, CaseSensitivity cs = CaseSensitive) const
     {
-        if (cs == CaseSensitive)
-            return mString.rfind(ch, from == npos ? std::string::npos : size_t(from));
-        const char *str = mString.c_str();
-        if (from == npos)
-            from = mString.size() - 1;
-        ch = tolower(ch);
-        int f = static_cast<int>(from);
-        while (f >= 0) {
-            if (tolower(str[f]) == ch)
-                return from;
-            --f;
-        }
-        return npos;
+        if (empty())
+            return npos;
+        return StringSearch::lastIndexOf(constData(), std::min(from, size() - 1) + 1, ch, cs == CaseInsensitive);
     }
 
     size_t indexOf(char ch, size_t from = 0, CaseSensitivity cs = CaseSensitive) const
     {
-        if (cs == CaseSensitive)
-            return mString.find(ch, from);
-        const char *data = mString.c_str();
-        ch = tolower(ch);
-        const size_t len = mString.size();
-        while (from < len) {
-            if (tolower(data[from]) == ch)
-                return from;
-            ++from;
-        }
-        return npos;
+        if (from >= size())
+            return npos;
+        const size_t ret = StringSearch::indexOf(constData() + from, size() - from, ch, cs == CaseInsensitive);
+        return ret == npos ? npos : from + ret;
     }
 
     size_t lastIndexOf(const char *ch, size_t from = npos, size_t len = std::numeric_limits<size_t>::max(), CaseSensitivity cs = CaseSensitive) const
     {
         if (len == std::numeric_limits<size_t>::max())
             len = strlen(ch);
-        switch (len) {
-        case 0: return npos;
-        case 1: return lastIndexOf(*ch, from, cs);
-        default: {
-            if (cs == CaseSensitive)
-                return mString.rfind(ch, from, len);
-            if (from == npos)
-                from = mString.size() - 1;
-            String lowered(ch, len);
-            lowered.lowerCase();
-            const size_t needleSize = lowered.size();
-            size_t matched = 0;
-            int f = static_cast<int>(from);
-            while (f >= 0) {
-                if (lowered.at(needleSize - matched - 1) != tolower(at(f))) {
-                    matched = 0;
-                } else if (++matched == needleSize) {
-                    return f;
-                }
-
-                --f;
-            }
-            break; }
-        }
-        return npos;
+        if (!len || len > size())
+            return npos;
+        const size_t end = std::min(from, size() - len) + len;
+        return StringSearch::lastIndexOf(constData(), end, ch, len, cs == CaseInsensitive);
     }
 
     size_t indexOf(const char *ch, size_t from = 0, size_t len = std::numeric_limits<size_t>::max(), CaseSensitivity cs = CaseSensitive) const
     {
         if (len == std::numeric_limits<size_t>::max())
             len = strlen(ch);
-        switch (len) {
-        case 0: return npos;
-        case 1: return indexOf(*ch, from, cs);
-        default: {
-            if (cs == CaseSensitive)
-                return mString.find(ch, from, len);
-
-            String lowered(ch, len);
-            lowered.lowerCase();
-            const size_t count = size();
-            size_t matched = 0;
-
-            for (size_t i=from; i<count; ++i) {
-                if (lowered.at(matched) != tolower(at(i))) {
-                    matched = 0;
-                } else if (++matched == lowered.size()) {
-                    return i - matched + 1;
-                }
-            }
-            break; }
-        }
-        return npos;
+        if (!len || from > size() || len > size() - from)
+            return npos;
+        const size_t ret = StringSearch::indexOf(constData() + from, size() - from, ch, len, cs == CaseInsensitive);
+        return ret == npos ? npos : from + ret;
     }
 
     bool contains(const String &other, CaseSensitivity cs = CaseSensitive) const
@@ -276,26 +227,26 @@ public:
 
     void lowerCase()
     {
-        std::transform(mString.begin(), mString.end(), mString.begin(), ::tolower);
+        StringSearch::toLower(&mString[0], mString.size());
     }
 
     String toLower() const
     {
-        std::string ret = mString;
-        std::transform(ret.begin(), ret.end(), ret.begin(), ::tolower);
+        String ret = *this;
+        ret.lowerCase();
         return ret;
     }
 
     String toUpper() const
     {
-        std::string ret = mString;
-        std::transform(ret.begin(), ret.end(), ret.begin(), ::toupper);
+        String ret = *this;
+        ret.upperCase();
         return ret;
     }
 
     void upperCase()
     {
-        std::transform(mString.begin(), mString.end(), mString.begin(), ::toupper);
+        StringSearch::toUpper(&mString[0], mString.size());
     }
 
     String trimmed(const String &trim = " \f\n\r\t\v") const
@@ -474,9 +425,17 @@ public:
         mString.append(ba);
     }
 
-    String compress() const;
-    String uncompress() const { return uncompress(c_str(), size()); }
-    static String uncompress(const char *data, size_t size);
+    /**
+     * zlib compression, \a level goes from 1 (fastest) to 9 (smallest).
+     */
+    String compress(int level = 9) const { return compress(c_str(), size(), level); }
+    static String compress(const char *data, size_t size, int level = 9);
+    /**
+     * Returns an empty string if \a data is invalid or would uncompress to
+     * more than \a maxSize bytes.
+     */
+    String uncompress(size_t maxSize = npos) const { return uncompress(c_str(), size(), maxSize); }
+    static String uncompress(const char *data, size_t size, size_t maxSize = npos);
 
     void append(const char *str, size_t len = npos)
     {
@@ -501,15 +460,21 @@ public:
     }
     size_t remove(char ch, CaseSensitivity cs = CaseSensitive)
     {
-        size_t idx = 0;
-        size_t ret = 0;
-        while (true) {
-            idx = indexOf(ch, idx, cs);
-            if (idx == npos)
-                break;
-            ++ret;
-            remove(idx, 1);
+        // moves the runs between matches down in one pass
+        size_t idx = indexOf(ch, 0, cs);
+        if (idx == npos)
+            return 0;
+        char *data = &mString[0];
+        size_t out = idx;
+        while (idx != npos) {
+            const size_t next = indexOf(ch, idx + 1, cs);
+            const size_t end = next == npos ? size() : next;
+            memmove(data + out, data + idx + 1, end - idx - 1);
+            out += end - idx - 1;
+            idx = next;
         }
+        const size_t ret = size() - out;
+        mString.resize(out);
         return ret;
     }
 
@@ -562,7 +527,9 @@ public:
     {
         if (cs == CaseSensitive)
             return mString.compare(other.mString);
-        return strcasecmp(mString.c_str(), other.mString.c_str());
+        if (const int ret = StringSearch::compareCaseInsensitive(constData(), other.constData(), std::min(size(), other.size())))
+            return ret;
+        return size() < other.size() ? -1 : size() > other.size();
     }
 
     bool operator==(const String &other) const
@@ -627,7 +594,9 @@ public:
             len = strlen(str);
         const size_t s = mString.size();
         if (s >= len) {
-            return (cs == CaseInsensitive ? !strncasecmp(str, c_str() + s - len, len) : !strncmp(str, c_str() + s - len, len));
+            return (cs == CaseInsensitive
+                    ? !StringSearch::compareCaseInsensitive(str, c_str() + s - len, len)
+                    : !memcmp(str, c_str() + s - len, len));
         }
         return false;
     }
@@ -644,7 +613,9 @@ public:
         if (len == npos)
             len = strlen(str);
         if (s >= len) {
-            return (cs == CaseInsensitive ? !strncasecmp(str, c_str(), len) : !strncmp(str, c_str(), len));
+            return (cs == CaseInsensitive
+                    ? !StringSearch::compareCaseInsensitive(str, c_str(), len)
+                    : !memcmp(str, c_str(), len));
         }
         return false;
     }
@@ -671,29 +642,9 @@ public:
 
     size_t replace(char from, char to, CaseSensitivity cs = CaseSensitive)
     {
-        size_t count = 0;
-        int i = static_cast<int>(size() - 1);
-        if (cs == CaseSensitive) {
-            while (i >= 0) {
-                char &ch = operator[](i);
-                if (ch == from) {
-                    ch = to;
-                    ++count;
-                }
-                --i;
-            }
-        } else {
-            from = tolower(from);
-            while (i >= 0) {
-                char &ch = operator[](i);
-                if (tolower(ch) == from) {
-                    ch = to;
-                    ++count;
-                }
-                --i;
-            }
-        }
-        return count;
+        if (empty())
+            return 0;
+        return StringSearch::replace(&mString[0], size(), from, to, cs == CaseInsensitive);
     }
 
     String mid(size_t from, size_t l = npos) const
@@ -715,6 +666,15 @@ public:
         return mString.substr(size() - l, l);
     }
 
+    /**
+     * Like mid(), left(), right() and trimmed() but without a copy. The
+     * views are invalidated by anything that modifies the string.
+     */
+    StringView midView(size_t from, size_t l = npos) const;
+    StringView leftView(size_t l) const;
+    StringView rightView(size_t l) const;
+    StringView trimmedView(const String &trim = " \f\n\r\t\v") const;
+
     operator std::string() const
     {
         return mString;
@@ -760,6 +720,11 @@ public:
         return str.split(ch, flags);
     }
 
+    /**
+     * Splits into views, see StringView::split().
+     */
+    size_t splitView(char ch, List<StringView> &out, unsigned int flags = NoSplitFlag) const;
+
     List<String> split(const String &str, unsigned int flags = NoSplitFlag) const
     {
         List<String> ret;
@@ -1038,5 +1003,7 @@ template <> struct hash<String> : public unary_function<String, size_t>
 };
 }
 
+// StringView needs String to be complete, it defines the view functions
+#include <rct/StringView.h>
 
 #endif
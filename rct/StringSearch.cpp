@@ -0,0 +1,517 @@
+#include "StringSearch.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RCT_STRINGSEARCH_X86
+// the loops pass AVX2 vectors to the Avx2 helpers, that's only safe since
+// they're always inlined into the AVX2 kernels and compiled for AVX2 there,
+// even without optimizations
+#define RCT_LOOP inline __attribute__((always_inline))
+#if !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+#else
+#define RCT_LOOP inline
+#endif
+
+namespace {
+inline char lower(char ch)
+{
+    return ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch;
+}
+
+inline char upper(char ch)
+{
+    return ch >= 'a' && ch <= 'z' ? ch - ('a' - 'A') : ch;
+}
+
+inline bool isAlpha(char ch)
+{
+    return lower(ch) >= 'a' && lower(ch) <= 'z';
+}
+
+// quotes, backslashes and control characters
+inline bool isJsonEscape(char ch)
+{
+    return ch == '"' || ch == '\\' || static_cast<unsigned char>(ch) < 0x20 || ch == 0x7f;
+}
+
+inline int compareBytes(char a, char b)
+{
+    return static_cast<unsigned char>(a) - static_cast<unsigned char>(b);
+}
+
+// the loops are written once against an interface that Portable, Sse2 and
+// Avx2 implement. Portable processes one byte at a time.
+struct Portable
+{
+    typedef char Vec;
+    enum { Width = 1 };
+    static Vec load(const char *data) { return *data; }
+    static void store(char *data, Vec v) { *data = v; }
+    static Vec splat(char ch) { return ch; }
+    static unsigned int match(Vec v, Vec ch) { return v == ch; }
+    static unsigned int match(Vec v, Vec a, Vec b) { return v == a || v == b; }
+    static unsigned int match(Vec v1, Vec a, Vec v2, Vec b) { return v1 == a && v2 == b; }
+    static Vec toLower(Vec v) { return lower(v); }
+    static Vec toUpper(Vec v) { return upper(v); }
+    static Vec replace(Vec v, Vec a, Vec b, Vec to) { return v == a || v == b ? to : v; }
+    static unsigned int matchJsonEscape(Vec v) { return isJsonEscape(v); }
+    static unsigned int popcount(unsigned int mask) { return mask; }
+    static unsigned int lowest(unsigned int) { return 0; }
+    static unsigned int highest(unsigned int) { return 0; }
+};
+
+#ifdef RCT_STRINGSEARCH_X86
+// SSE2 is part of x86_64 so this needs no check
+struct Sse2
+{
+    typedef __m128i Vec;
+    enum { Width = 16 };
+    static Vec load(const char *data) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)); }
+    static void store(char *data, Vec v) { _mm_storeu_si128(reinterpret_cast<__m128i *>(data), v); }
+    static Vec splat(char ch) { return _mm_set1_epi8(ch); }
+    static unsigned int match(Vec v, Vec ch) { return _mm_movemask_epi8(_mm_cmpeq_epi8(v, ch)); }
+    static unsigned int match(Vec v, Vec a, Vec b)
+    {
+        return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)));
+    }
+    static unsigned int match(Vec v1, Vec a, Vec v2, Vec b)
+    {
+        return _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v1, a), _mm_cmpeq_epi8(v2, b)));
+    }
+    // moves [first, first + count) to the bottom of the signed range,
+    // there's no unsigned compare
+    static Vec inRange(Vec v, char first, char count)
+    {
+        const Vec shifted = _mm_add_epi8(v, _mm_set1_epi8(static_cast<char>(0x80 - first)));
+        return _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(0x80 + count)));
+    }
+    static Vec toLower(Vec v) { return _mm_xor_si128(v, _mm_and_si128(inRange(v, 'A', 26), _mm_set1_epi8(0x20))); }
+    static Vec toUpper(Vec v) { return _mm_xor_si128(v, _mm_and_si128(inRange(v, 'a', 26), _mm_set1_epi8(0x20))); }
+    static Vec replace(Vec v, Vec a, Vec b, Vec to)
+    {
+        const Vec mask = _mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b));
+        return _mm_or_si128(_mm_and_si128(mask, to), _mm_andnot_si128(mask, v));
+    }
+    static unsigned int matchJsonEscape(Vec v)
+    {
+        const Vec special = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        const Vec control = _mm_or_si128(inRange(v, 0, 0x20), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+        return _mm_movemask_epi8(_mm_or_si128(special, control));
+    }
+    static unsigned int popcount(unsigned int mask) { return __builtin_popcount(mask); }
+    static unsigned int lowest(unsigned int mask) { return __builtin_ctz(mask); }
+    static unsigned int highest(unsigned int mask) { return 31 - __builtin_clz(mask); }
+};
+
+#define RCT_AVX2 __attribute__((target("avx2")))
+struct Avx2
+{
+    typedef __m256i Vec;
+    enum { Width = 32 };
+    RCT_AVX2 static Vec load(const char *data) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data)); }
+    RCT_AVX2 static void store(char *data, Vec v) { _mm256_storeu_si256(reinterpret_cast<__m256i *>(data), v); }
+    RCT_AVX2 static Vec splat(char ch) { return _mm256_set1_epi8(ch); }
+    RCT_AVX2 static unsigned int match(Vec v, Vec ch) { return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ch)); }
+    RCT_AVX2 static unsigned int match(Vec v, Vec a, Vec b)
+    {
+        return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, a), _mm256_cmpeq_epi8(v, b)));
+    }
+    RCT_AVX2 static unsigned int match(Vec v1, Vec a, Vec v2, Vec b)
+    {
+        return _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v1, a), _mm256_cmpeq_epi8(v2, b)));
+    }
+    RCT_AVX2 static Vec inRange(Vec v, char first, char count)
+    {
+        const Vec shifted = _mm256_add_epi8(v, _mm256_set1_epi8(static_cast<char>(0x80 - first)));
+        return _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(0x80 + count)), shifted);
+    }
+    RCT_AVX2 static Vec toLower(Vec v)
+    {
+        return _mm256_xor_si256(v, _mm256_and_si256(inRange(v, 'A', 26), _mm256_set1_epi8(0x20)));
+    }
+    RCT_AVX2 static Vec toUpper(Vec v)
+    {
+        return _mm256_xor_si256(v, _mm256_and_si256(inRange(v, 'a', 26), _mm256_set1_epi8(0x20)));
+    }
+    RCT_AVX2 static Vec replace(Vec v, Vec a, Vec b, Vec to)
+    {
+        return _mm256_blendv_epi8(v, to, _mm256_or_si256(_mm256_cmpeq_epi8(v, a), _mm256_cmpeq_epi8(v, b)));
+    }
+    RCT_AVX2 static unsigned int matchJsonEscape(Vec v)
+    {
+        const Vec special = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+        const Vec control = _mm256_or_si256(inRange(v, 0, 0x20), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+        return _mm256_movemask_epi8(_mm256_or_si256(special, control));
+    }
+    static unsigned int popcount(unsigned int mask) { return __builtin_popcount(mask); }
+    static unsigned int lowest(unsigned int mask) { return __builtin_ctz(mask); }
+    static unsigned int highest(unsigned int mask) { return 31 - __builtin_clz(mask); }
+};
+#endif
+
+template <typename V>
+RCT_LOOP int compareCaseInsensitive(const char *a, const char *b, size_t size)
+{
+    size_t i = 0;
+    for (; i + V::Width <= size; i += V::Width) {
+        const typename V::Vec la = V::toLower(V::load(a + i));
+        const typename V::Vec lb = V::toLower(V::load(b + i));
+        const unsigned int equal = V::match(la, lb);
+        if (equal != (V::Width == 32 ? 0xffffffffu : (1u << V::Width) - 1)) {
+            const size_t idx = i + V::lowest(~equal);
+            return compareBytes(lower(a[idx]), lower(b[idx]));
+        }
+    }
+    for (; i<size; ++i) {
+        if (const int ret = compareBytes(lower(a[i]), lower(b[i])))
+            return ret;
+    }
+    return 0;
+}
+
+template <typename V>
+RCT_LOOP bool equals(const char *a, const char *b, size_t size, bool caseInsensitive)
+{
+    return caseInsensitive ? !compareCaseInsensitive<V>(a, b, size) : !memcmp(a, b, size);
+}
+
+// the first of either byte
+template <typename V>
+RCT_LOOP size_t indexOfEither(const char *data, size_t size, char a, char b)
+{
+    const typename V::Vec va = V::splat(a), vb = V::splat(b);
+    size_t i = 0;
+    for (; i + V::Width <= size; i += V::Width) {
+        if (const unsigned int mask = V::match(V::load(data + i), va, vb))
+            return i + V::lowest(mask);
+    }
+    for (; i<size; ++i) {
+        if (data[i] == a || data[i] == b)
+            return i;
+    }
+    return StringSearch::npos;
+}
+
+template <typename V>
+RCT_LOOP size_t lastIndexOfEither(const char *data, size_t size, char a, char b)
+{
+    const typename V::Vec va = V::splat(a), vb = V::splat(b);
+    size_t i = size;
+    for (; i >= static_cast<size_t>(V::Width); i -= V::Width) {
+        if (const unsigned int mask = V::match(V::load(data + i - V::Width), va, vb))
+            return i - V::Width + V::highest(mask);
+    }
+    while (i--) {
+        if (data[i] == a || data[i] == b)
+            return i;
+    }
+    return StringSearch::npos;
+}
+
+// candidates are the positions where both the first and the last byte of
+// the needle match, only those get compared in full
+template <typename V>
+RCT_LOOP size_t indexOfString(const char *data, size_t size, const char *needle, size_t len, bool caseInsensitive)
+{
+    if (len > size)
+        return StringSearch::npos;
+    const char first = caseInsensitive ? lower(needle[0]) : needle[0];
+    const char last = caseInsensitive ? lower(needle[len - 1]) : needle[len - 1];
+    const typename V::Vec vf = V::splat(first), vl = V::splat(last);
+    const size_t count = size - len + 1;
+    size_t i = 0;
+    for (; i + V::Width <= count; i += V::Width) {
+        typename V::Vec f = V::load(data + i), l = V::load(data + i + len - 1);
+        if (caseInsensitive) {
+            f = V::toLower(f);
+            l = V::toLower(l);
+        }
+        for (unsigned int mask = V::match(f, vf, l, vl); mask; mask &= mask - 1) {
+            const size_t idx = i + V::lowest(mask);
+            if (equals<V>(data + idx + 1, needle + 1, len - 2, caseInsensitive))
+                return idx;
+        }
+    }
+    for (; i<count; ++i) {
+        if (equals<V>(data + i, needle, len, caseInsensitive))
+            return i;
+    }
+    return StringSearch::npos;
+}
+
+template <typename V>
+RCT_LOOP size_t lastIndexOfString(const char *data, size_t size, const char *needle, size_t len, bool caseInsensitive)
+{
+    if (len > size)
+        return StringSearch::npos;
+    const char first = caseInsensitive ? lower(needle[0]) : needle[0];
+    const char last = caseInsensitive ? lower(needle[len - 1]) : needle[len - 1];
+    const typename V::Vec vf = V::splat(first), vl = V::splat(last);
+    size_t i = size - len + 1;
+    for (; i >= static_cast<size_t>(V::Width); i -= V::Width) {
+        const size_t start = i - V::Width;
+        typename V::Vec f = V::load(data + start), l = V::load(data + start + len - 1);
+        if (caseInsensitive) {
+            f = V::toLower(f);
+            l = V::toLower(l);
+        }
+        unsigned int mask = V::match(f, vf, l, vl);
+        while (mask) {
+            const unsigned int bit = V::highest(mask);
+            if (equals<V>(data + start + bit + 1, needle + 1, len - 2, caseInsensitive))
+                return start + bit;
+            mask &= ~(1u << bit);
+        }
+    }
+    while (i--) {
+        if (equals<V>(data + i, needle, len, caseInsensitive))
+            return i;
+    }
+    return StringSearch::npos;
+}
+
+template <typename V>
+RCT_LOOP void toLower(char *data, size_t size)
+{
+    size_t i = 0;
+    for (; i + V::Width <= size; i += V::Width)
+        V::store(data + i, V::toLower(V::load(data + i)));
+    for (; i<size; ++i)
+        data[i] = lower(data[i]);
+}
+
+template <typename V>
+RCT_LOOP void toUpper(char *data, size_t size)
+{
+    size_t i = 0;
+    for (; i + V::Width <= size; i += V::Width)
+        V::store(data + i, V::toUpper(V::load(data + i)));
+    for (; i<size; ++i)
+        data[i] = upper(data[i]);
+}
+
+template <typename V>
+RCT_LOOP size_t replaceEither(char *data, size_t size, char a, char b, char to)
+{
+    const typename V::Vec va = V::splat(a), vb = V::splat(b), vto = V::splat(to);
+    size_t ret = 0;
+    size_t i = 0;
+    for (; i + V::Width <= size; i += V::Width) {
+        const typename V::Vec v = V::load(data + i);
+        if (const unsigned int mask = V::match(v, va, vb)) {
+            ret += V::popcount(mask);
+            V::store(data + i, V::replace(v, va, vb, vto));
+        }
+    }
+    for (; i<size; ++i) {
+        if (data[i] == a || data[i] == b) {
+            data[i] = to;
+            ++ret;
+        }
+    }
+    return ret;
+}
+
+template <typename V>
+RCT_LOOP size_t indexOfJsonEscape(const char *data, size_t size)
+{
+    size_t i = 0;
+    for (; i + V::Width <= size; i += V::Width) {
+        if (const unsigned int mask = V::matchJsonEscape(V::load(data + i)))
+            return i + V::lowest(mask);
+    }
+    for (; i<size; ++i) {
+        if (isJsonEscape(data[i]))
+            return i;
+    }
+    return StringSearch::npos;
+}
+
+struct Kernels
+{
+    size_t (*indexOfEither)(const char *, size_t, char, char);
+    size_t (*lastIndexOfEither)(const char *, size_t, char, char);
+    size_t (*indexOfString)(const char *, size_t, const char *, size_t, bool);
+    size_t (*lastIndexOfString)(const char *, size_t, const char *, size_t, bool);
+    int (*compareCaseInsensitive)(const char *, const char *, size_t);
+    void (*toLower)(char *, size_t);
+    void (*toUpper)(char *, size_t);
+    size_t (*replaceEither)(char *, size_t, char, char, char);
+    size_t (*indexOfJsonEscape)(const char *, size_t);
+};
+
+template <typename V>
+Kernels kernels()
+{
+    return { indexOfEither<V>, lastIndexOfEither<V>, indexOfString<V>, lastIndexOfString<V>,
+             compareCaseInsensitive<V>, toLower<V>, toUpper<V>, replaceEither<V>, indexOfJsonEscape<V> };
+}
+
+#ifdef RCT_STRINGSEARCH_X86
+#define RCT_AVX2_KERNEL __attribute__((target("avx2")))
+RCT_AVX2_KERNEL size_t indexOfEitherAvx2(const char *data, size_t size, char a, char b)
+{
+    return indexOfEither<Avx2>(data, size, a, b);
+}
+RCT_AVX2_KERNEL size_t lastIndexOfEitherAvx2(const char *data, size_t size, char a, char b)
+{
+    return lastIndexOfEither<Avx2>(data, size, a, b);
+}
+RCT_AVX2_KERNEL size_t indexOfStringAvx2(const char *data, size_t size, const char *needle, size_t len, bool ci)
+{
+    return indexOfString<Avx2>(data, size, needle, len, ci);
+}
+RCT_AVX2_KERNEL size_t lastIndexOfStringAvx2(const char *data, size_t size, const char *needle, size_t len, bool ci)
+{
+    return lastIndexOfString<Avx2>(data, size, needle, len, ci);
+}
+RCT_AVX2_KERNEL int compareCaseInsensitiveAvx2(const char *a, const char *b, size_t size)
+{
+    return compareCaseInsensitive<Avx2>(a, b, size);
+}
+RCT_AVX2_KERNEL void toLowerAvx2(char *data, size_t size)
+{
+    toLower<Avx2>(data, size);
+}
+RCT_AVX2_KERNEL void toUpperAvx2(char *data, size_t size)
+{
+    toUpper<Avx2>(data, size);
+}
+RCT_AVX2_KERNEL size_t replaceEitherAvx2(char *data, size_t size, char a, char b, char to)
+{
+    return replaceEither<Avx2>(data, size, a, b, to);
+}
+RCT_AVX2_KERNEL size_t indexOfJsonEscapeAvx2(const char *data, size_t size)
+{
+    return indexOfJsonEscape<Avx2>(data, size);
+}
+
+bool hasAvx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+struct Dispatch
+{
+    Dispatch()
+    {
+#ifdef RCT_STRINGSEARCH_X86
+        set(hasAvx2() ? StringSearch::AVX2 : StringSearch::SSE2);
+#else
+        set(StringSearch::Portable);
+#endif
+    }
+
+    bool set(StringSearch::Instructions which)
+    {
+        switch (which) {
+        case StringSearch::Portable:
+            kernels = ::kernels<Portable>();
+            break;
+#ifdef RCT_STRINGSEARCH_X86
+        case StringSearch::SSE2:
+            kernels = ::kernels<Sse2>();
+            break;
+        case StringSearch::AVX2:
+            if (!hasAvx2())
+                return false;
+            kernels = { indexOfEitherAvx2, lastIndexOfEitherAvx2, indexOfStringAvx2, lastIndexOfStringAvx2,
+                        compareCaseInsensitiveAvx2, toLowerAvx2, toUpperAvx2, replaceEitherAvx2, indexOfJsonEscapeAvx2 };
+            break;
+#endif
+        default:
+            return false;
+        }
+        instructions = which;
+        return true;
+    }
+
+    Kernels kernels;
+    StringSearch::Instructions instructions;
+};
+
+Dispatch &dispatch()
+{
+    static Dispatch sDispatch;
+    return sDispatch;
+}
+}
+
+StringSearch::Instructions StringSearch::instructions()
+{
+    return dispatch().instructions;
+}
+
+bool StringSearch::setInstructions(Instructions instructions)
+{
+    return dispatch().set(instructions);
+}
+
+size_t StringSearch::indexOf(const char *data, size_t size, char ch, bool caseInsensitive)
+{
+    if (!caseInsensitive || !isAlpha(ch)) {
+        const void *found = memchr(data, ch, size);
+        return found ? static_cast<const char *>(found) - data : npos;
+    }
+    return dispatch().kernels.indexOfEither(data, size, lower(ch), upper(ch));
+}
+
+size_t StringSearch::lastIndexOf(const char *data, size_t size, char ch, bool caseInsensitive)
+{
+    if (!caseInsensitive || !isAlpha(ch))
+        return dispatch().kernels.lastIndexOfEither(data, size, ch, ch);
+    return dispatch().kernels.lastIndexOfEither(data, size, lower(ch), upper(ch));
+}
+
+size_t StringSearch::indexOf(const char *data, size_t size, const char *needle, size_t len, bool caseInsensitive)
+{
+    if (!len)
+        return 0;
+    if (len == 1)
+        return indexOf(data, size, *needle, caseInsensitive);
+    return dispatch().kernels.indexOfString(data, size, needle, len, caseInsensitive);
+}
+
+size_t StringSearch::lastIndexOf(const char *data, size_t size, const char *needle, size_t len, bool caseInsensitive)
+{
+    if (!len)
+        return size;
+    if (len == 1)
+        return lastIndexOf(data, size, *needle, caseInsensitive);
+    return dispatch().kernels.lastIndexOfString(data, size, needle, len, caseInsensitive);
+}
+
+int StringSearch::compareCaseInsensitive(const char *a, const char *b, size_t size)
+{
+    return dispatch().kernels.compareCaseInsensitive(a, b, size);
+}
+
+void StringSearch::toLower(char *data, size_t size)
+{
+    dispatch().kernels.toLower(data, size);
+}
+
+void StringSearch::toUpper(char *data, size_t size)
+{
+    dispatch().kernels.toUpper(data, size);
+}
+
+size_t StringSearch::replace(char *data, size_t size, char from, char to, bool caseInsensitive)
+{
+    if (!caseInsensitive || !isAlpha(from))
+        return dispatch().kernels.replaceEither(data, size, from, from, to);
+    return dispatch().kernels.replaceEither(data, size, lower(from), upper(from), to);
+}
+
+size_t StringSearch::indexOfJsonEscape(const char *data, size_t size)
+{
+    return dispatch().kernels.indexOfJsonEscape(data, size);
+}
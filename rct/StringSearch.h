@@ -0,0 +1,60 @@
+#ifndef StringSearch_h
+#define StringSearch_h
+
+#include <stddef.h>
+
+/**
+ * The search, case folding and replace loops behind String and
+ * Rct::jsonEscape(). On x86_64 they use SSE2, or AVX2 if the CPU has it,
+ * and plain loops elsewhere. Case folding only applies to ASCII letters,
+ * other bytes are compared as is.
+ *
+ * Offsets are relative to \a data and npos means not found.
+ */
+class StringSearch
+{
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    enum Instructions {
+        Portable,
+        SSE2,
+        AVX2
+    };
+    /**
+     * The instructions in use, the best the CPU supports unless
+     * setInstructions() picked others. That's meant for benchmarks and
+     * tests and not thread safe. Returns false if the CPU can't do it.
+     */
+    static Instructions instructions();
+    static bool setInstructions(Instructions instructions);
+
+    static size_t indexOf(const char *data, size_t size, char ch, bool caseInsensitive);
+    static size_t lastIndexOf(const char *data, size_t size, char ch, bool caseInsensitive);
+    /**
+     * lastIndexOf() returns the last match that ends within \a size.
+     */
+    static size_t indexOf(const char *data, size_t size, const char *needle, size_t len, bool caseInsensitive);
+    static size_t lastIndexOf(const char *data, size_t size, const char *needle, size_t len, bool caseInsensitive);
+
+    /**
+     * Compares like strncasecmp() but doesn't stop at null bytes.
+     */
+    static int compareCaseInsensitive(const char *a, const char *b, size_t size);
+
+    static void toLower(char *data, size_t size);
+    static void toUpper(char *data, size_t size);
+
+    /**
+     * Replaces every \a from with \a to and returns how many there were.
+     */
+    static size_t replace(char *data, size_t size, char from, char to, bool caseInsensitive);
+
+    /**
+     * The first quote, backslash or control character, the bytes
+     * Rct::jsonEscape() can't copy as is.
+     */
+    static size_t indexOfJsonEscape(const char *data, size_t size);
+};
+
+#endif
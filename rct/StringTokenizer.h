@@ -2,6 +2,7 @@
 #define StringTokenizer_h
 
 #include <rct/String.h>
+#include <rct/StringView.h>
 #include <rct/List.h>
 #include <cctype>
 #include <algorithm>
@@ -98,7 +99,7 @@ class StringTokenizer
 {
 public:
     static inline List<String> break_parts_of_word(const String &str);
-    static inline size_t common_prefix(const String &str1, const String &str2);
+    static inline size_t common_prefix(const StringView &str1, const StringView &str2);
     static inline std::unique_ptr<MatchResult> find_match(CompletionCandidate *candidate, const String &query);
     static inline bool is_boundary_match(const List<String> &parts, const String &query, List<size_t> &indices);
     static inline String find_identifier_prefix(const String &line, size_t column, size_t *start);
@@ -167,7 +168,7 @@ List<String> StringTokenizer::break_parts_of_word(const String &str)
     return result;
 }
 
-size_t StringTokenizer::common_prefix(const String &str1, const String &str2)
+size_t StringTokenizer::common_prefix(const StringView &str1, const StringView &str2)
 {
     size_t l = std::min(str1.length(), str2.length());
 
@@ -180,7 +181,7 @@ size_t StringTokenizer::common_prefix(const String &str1, const String &str2)
 
 std::unique_ptr<MatchResult> StringTokenizer::find_match(CompletionCandidate *candidate, const String &query)
 {
-    String c = candidate->name;
+    const String &c = candidate->name;
 
     if (query.length() > c.length())
         return nullptr;
@@ -230,7 +231,7 @@ bool StringTokenizer::is_boundary_match(const List<String> &parts,
     else if (current_index == parts.size())
         return false;
 
-    String to_find = query.mid(query_start, query.length() - query_start);
+    const StringView to_find = query.midView(query_start);
     size_t longest_prefix = common_prefix(parts[current_index], to_find);
 
     for (int i = longest_prefix; i >= 0; i--) {
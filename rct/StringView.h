@@ -0,0 +1,211 @@
+#ifndef StringView_h
+#define StringView_h
+
+#include <string.h>
+#include <algorithm>
+#include <functional>
+
+#include <rct/String.h>
+#include <rct/StringSearch.h>
+
+/**
+ * A non-owning reference to a range of characters. The referenced data must
+ * outlive the view.
+ *
+ * The queries mirror String's but return views, so parsing code can slice
+ * and split a buffer without allocating. String::midView(), splitView()
+ * and friends hand out views into a String.
+ */
+class StringView
+{
+public:
+    static const size_t npos = String::npos;
+
+    StringView()
+        : mData(nullptr), mSize(0)
+    {}
+    StringView(const char *data, size_t size)
+        : mData(data), mSize(size)
+    {}
+    StringView(const char *str)
+        : mData(str), mSize(str ? strlen(str) : 0)
+    {}
+    StringView(const String &str)
+        : mData(str.constData()), mSize(str.size())
+    {}
+
+    typedef const char *const_iterator;
+    const_iterator begin() const { return mData; }
+    const_iterator end() const { return mData + mSize; }
+
+    const char *data() const { return mData; }
+    size_t size() const { return mSize; }
+    size_t length() const { return mSize; }
+    bool empty() const { return !mSize; }
+    bool isEmpty() const { return !mSize; }
+
+    char at(size_t i) const
+    {
+        assert(i < mSize);
+        return mData[i];
+    }
+    const char &operator[](size_t i) const { return mData[i]; }
+
+    char first() const { return at(0); }
+    char last() const { return at(mSize - 1); }
+
+    String toString() const { return String(mData, mSize); }
+    operator String() const { return toString(); }
+
+    StringView mid(size_t from, size_t len = npos) const
+    {
+        assert(from <= mSize);
+        return StringView(mData + from, std::min(len, mSize - from));
+    }
+    StringView left(size_t len) const { return StringView(mData, std::min(len, mSize)); }
+    StringView right(size_t len) const
+    {
+        len = std::min(len, mSize);
+        return StringView(mData + mSize - len, len);
+    }
+
+    size_t indexOf(char ch, size_t from = 0) const
+    {
+        if (from >= mSize)
+            return npos;
+        const void *found = memchr(mData + from, ch, mSize - from);
+        return found ? static_cast<const char *>(found) - mData : npos;
+    }
+    size_t indexOf(const StringView &str, size_t from = 0) const
+    {
+        if (from > mSize)
+            return npos;
+        const size_t ret = StringSearch::indexOf(mData + from, mSize - from, str.mData, str.mSize, false);
+        return ret == npos ? npos : from + ret;
+    }
+    size_t lastIndexOf(char ch, size_t from = npos) const
+    {
+        if (!mSize)
+            return npos;
+        for (size_t i = std::min(from, mSize - 1) + 1; i > 0; --i) {
+            if (mData[i - 1] == ch)
+                return i - 1;
+        }
+        return npos;
+    }
+    bool contains(char ch) const { return indexOf(ch) != npos; }
+    bool contains(const StringView &str) const { return indexOf(str) != npos; }
+
+    bool startsWith(char ch) const { return mSize && mData[0] == ch; }
+    bool endsWith(char ch) const { return mSize && mData[mSize - 1] == ch; }
+    bool startsWith(const StringView &str, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        return str.mSize <= mSize && !left(str.mSize).compare(str, cs);
+    }
+    bool endsWith(const StringView &str, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        return str.mSize <= mSize && !right(str.mSize).compare(str, cs);
+    }
+
+    StringView trimmed(const StringView &trim = " \f\n\r\t\v") const
+    {
+        size_t start = 0, end = mSize;
+        while (start < end && trim.contains(mData[start]))
+            ++start;
+        while (end > start && trim.contains(mData[end - 1]))
+            --end;
+        return StringView(mData + start, end - start);
+    }
+
+    /**
+     * Replaces the contents of \a out with the parts of this view between
+     * \a ch, see String::split(). Reusing \a out keeps its capacity.
+     * Returns the number of parts.
+     */
+    size_t split(char ch, List<StringView> &out, unsigned int flags = String::NoSplitFlag) const
+    {
+        out.clear();
+        if (isEmpty())
+            return 0;
+        const size_t add = flags & String::KeepSeparators ? 1 : 0;
+        size_t prev = 0;
+        while (true) {
+            const size_t next = indexOf(ch, prev);
+            if (next == npos)
+                break;
+            if (next > prev || !(flags & String::SkipEmpty))
+                out.append(StringView(mData + prev, next - prev + add));
+            prev = next + 1;
+        }
+        if (prev < mSize || !(flags & String::SkipEmpty))
+            out.append(StringView(mData + prev, mSize - prev));
+        return out.size();
+    }
+
+    int compare(const StringView &other, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        const size_t len = std::min(mSize, other.mSize);
+        int ret = 0;
+        if (len)
+            ret = cs == String::CaseSensitive ? memcmp(mData, other.mData, len) : StringSearch::compareCaseInsensitive(mData, other.mData, len);
+        if (ret)
+            return ret;
+        return mSize < other.mSize ? -1 : (mSize > other.mSize ? 1 : 0);
+    }
+
+    bool operator==(const StringView &other) const { return mSize == other.mSize && !compare(other); }
+    bool operator!=(const StringView &other) const { return !operator==(other); }
+    bool operator<(const StringView &other) const { return compare(other) < 0; }
+    bool operator>(const StringView &other) const { return compare(other) > 0; }
+
+private:
+    const char *mData;
+    size_t mSize;
+};
+
+inline bool operator==(const String &l, const StringView &r)
+{
+    return StringView(l) == r;
+}
+
+inline bool operator!=(const String &l, const StringView &r)
+{
+    return StringView(l) != r;
+}
+
+inline bool operator==(const char *l, const StringView &r)
+{
+    return StringView(l) == r;
+}
+
+inline bool operator!=(const char *l, const StringView &r)
+{
+    return StringView(l) != r;
+}
+
+inline StringView String::midView(size_t from, size_t l) const
+{
+    return StringView(*this).mid(from, l);
+}
+
+inline StringView String::leftView(size_t l) const
+{
+    return StringView(*this).left(l);
+}
+
+inline StringView String::rightView(size_t l) const
+{
+    return StringView(*this).right(l);
+}
+
+inline StringView String::trimmedView(const String &trim) const
+{
+    return StringView(*this).trimmed(trim);
+}
+
+inline size_t String::splitView(char ch, List<StringView> &out, unsigned int flags) const
+{
+    return StringView(*this).split(ch, out, flags);
+}
+
+#endif
@@ -0,0 +1,228 @@
+#include "ConnectionPoolTestSuite.h"
+
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+
+#include <rct/Connection.h>
+#include <rct/ConnectionPool.h>
+#include <rct/EventLoop.h>
+#include <rct/List.h>
+#include <rct/SocketClient.h>
+#include <rct/SocketServer.h>
+
+// a TCP server on localhost that accepts and holds on to its clients
+class Backend
+{
+public:
+    Backend()
+        : mPort(0)
+    {
+        for (uint16_t port = 20000 + ::getpid() % 20000; !mServer; ++port) {
+            mServer.reset(new SocketServer);
+            if (!mServer->listen(port)) {
+                mServer.reset();
+                continue;
+            }
+            mPort = port;
+        }
+        mServer->newConnection().connect([this](SocketServer *server) {
+                while (std::shared_ptr<SocketClient> client = server->nextConnection())
+                    mClients.append(client);
+            });
+    }
+
+    uint16_t port() const { return mPort; }
+    size_t accepted() const { return mClients.size(); }
+
+    void closeClients()
+    {
+        for (const std::shared_ptr<SocketClient> &client : mClients)
+            client->close();
+        mClients.clear();
+    }
+private:
+    std::unique_ptr<SocketServer> mServer;
+    uint16_t mPort;
+    List<std::shared_ptr<SocketClient> > mClients;
+};
+
+// runs the loop until done() or about a second has passed
+static void runUntil(const std::shared_ptr<EventLoop> &loop, const std::function<bool()> &done)
+{
+    for (int i=0; i<100 && !done(); ++i)
+        loop->exec(10);
+}
+
+static std::shared_ptr<Connection> acquire(const std::shared_ptr<EventLoop> &loop, ConnectionPool &pool, uint16_t port)
+{
+    bool called = false;
+    std::shared_ptr<Connection> ret;
+    pool.acquire("127.0.0.1", port, 0, [&called, &ret](const std::shared_ptr<Connection> &connection) {
+            called = true;
+            ret = connection;
+        });
+    runUntil(loop, [&called]() { return called; });
+    CPPUNIT_ASSERT(called);
+    return ret;
+}
+
+void ConnectionPoolTestSuite::reuse()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    Backend backend;
+    ConnectionPool pool;
+    std::shared_ptr<Connection> connection = acquire(loop, pool, backend.port());
+    CPPUNIT_ASSERT(connection);
+    CPPUNIT_ASSERT(connection->isConnected());
+    CPPUNIT_ASSERT_EQUAL(size_t(1), pool.stats().active);
+    pool.release(connection);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), pool.stats().idle);
+
+    // handed out from inside acquire(), without a new connect
+    std::shared_ptr<Connection> again;
+    pool.acquire("127.0.0.1", backend.port(), 0, [&again](const std::shared_ptr<Connection> &c) { again = c; });
+    CPPUNIT_ASSERT(again == connection);
+    pool.release(again);
+
+    // other protocol versions get their own connections
+    std::shared_ptr<Connection> other;
+    pool.acquire("127.0.0.1", backend.port(), 1, [&other](const std::shared_ptr<Connection> &c) { other = c; });
+    CPPUNIT_ASSERT(!other);
+    runUntil(loop, [&other]() { return other.get(); });
+    CPPUNIT_ASSERT(other && other != connection);
+
+    const ConnectionPool::Stats stats = pool.stats();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), stats.created);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), stats.reused);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), stats.idle);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), stats.active);
+    loop->quit();
+}
+
+void ConnectionPoolTestSuite::deadIdleConnection()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    Backend backend;
+    ConnectionPool pool;
+    std::shared_ptr<Connection> connection = acquire(loop, pool, backend.port());
+    CPPUNIT_ASSERT(connection);
+    runUntil(loop, [&backend]() { return backend.accepted() == 1; });
+    pool.release(connection);
+
+    // the loop doesn't get to see the hangup, acquire() has to
+    backend.closeClients();
+    std::shared_ptr<Connection> fresh;
+    pool.acquire("127.0.0.1", backend.port(), 0, [&fresh](const std::shared_ptr<Connection> &c) { fresh = c; });
+    CPPUNIT_ASSERT(!fresh);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), pool.stats().discarded);
+    CPPUNIT_ASSERT_EQUAL(size_t(0), pool.stats().idle);
+    runUntil(loop, [&fresh]() { return fresh.get(); });
+    CPPUNIT_ASSERT(fresh && fresh != connection);
+    CPPUNIT_ASSERT(fresh->isConnected());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), pool.stats().created);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), pool.stats().reused);
+    loop->quit();
+}
+
+void ConnectionPoolTestSuite::idleEviction()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    Backend backend;
+    ConnectionPool::Options options;
+    options.idleTimeout = 50;
+    ConnectionPool pool(options);
+    std::shared_ptr<Connection> connection = acquire(loop, pool, backend.port());
+    CPPUNIT_ASSERT(connection);
+    pool.release(connection);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), pool.stats().idle);
+    runUntil(loop, [&pool]() { return !pool.stats().idle; });
+    CPPUNIT_ASSERT_EQUAL(size_t(0), pool.stats().idle);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), pool.stats().evicted);
+    CPPUNIT_ASSERT(!connection->isConnected());
+    loop->quit();
+}
+
+void ConnectionPoolTestSuite::minIdle()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    Backend backend;
+    ConnectionPool::Options options;
+    options.minIdle = 2;
+    options.idleTimeout = 50;
+    ConnectionPool pool(options);
+    pool.prewarm("127.0.0.1", backend.port());
+    CPPUNIT_ASSERT_EQUAL(size_t(2), pool.stats().connecting);
+    runUntil(loop, [&pool]() { return pool.stats().idle == 2; });
+    CPPUNIT_ASSERT_EQUAL(size_t(2), pool.stats().idle);
+
+    // taking one out connects a replacement
+    std::shared_ptr<Connection> connection;
+    pool.acquire("127.0.0.1", backend.port(), 0, [&connection](const std::shared_ptr<Connection> &c) { connection = c; });
+    CPPUNIT_ASSERT(connection);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), pool.stats().connecting);
+    runUntil(loop, [&pool]() { return pool.stats().idle == 2; });
+    CPPUNIT_ASSERT_EQUAL(size_t(2), pool.stats().idle);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(3), pool.stats().created);
+
+    // only the ones above minIdle time out
+    pool.release(connection);
+    CPPUNIT_ASSERT_EQUAL(size_t(3), pool.stats().idle);
+    runUntil(loop, [&pool]() { return pool.stats().evicted == 1; });
+    for (int i=0; i<10; ++i)
+        loop->exec(10);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), pool.stats().evicted);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), pool.stats().idle);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(3), pool.stats().created);
+    loop->quit();
+}
+
+void ConnectionPoolTestSuite::maxActive()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    Backend backend;
+    ConnectionPool::Options options;
+    options.maxActive = 2;
+    ConnectionPool pool(options);
+
+    // the first two are still connecting when the third comes in
+    List<std::shared_ptr<Connection> > connections;
+    int calls = 0;
+    for (int i=0; i<3; ++i) {
+        pool.acquire("127.0.0.1", backend.port(), 0, [&connections, &calls](const std::shared_ptr<Connection> &c) {
+                ++calls;
+                if (c)
+                    connections.append(c);
+            });
+    }
+    CPPUNIT_ASSERT_EQUAL(1, calls);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), pool.stats().refused);
+    runUntil(loop, [&calls]() { return calls == 3; });
+    CPPUNIT_ASSERT_EQUAL(3, calls);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), connections.size());
+    CPPUNIT_ASSERT_EQUAL(size_t(2), pool.stats().active);
+
+    std::shared_ptr<Connection> refused(connections.first());
+    pool.acquire("127.0.0.1", backend.port(), 0, [&refused](const std::shared_ptr<Connection> &c) { refused = c; });
+    CPPUNIT_ASSERT(!refused);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), pool.stats().refused);
+
+    // a released one is handed out again
+    pool.release(connections.first());
+    std::shared_ptr<Connection> reused;
+    pool.acquire("127.0.0.1", backend.port(), 0, [&reused](const std::shared_ptr<Connection> &c) { reused = c; });
+    CPPUNIT_ASSERT(reused == connections.first());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), pool.stats().created);
+    loop->quit();
+}
@@ -0,0 +1,28 @@
+#ifndef CONNECTIONPOOLTESTSUITE_H
+#define CONNECTIONPOOLTESTSUITE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class ConnectionPoolTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(ConnectionPoolTestSuite);
+
+    CPPUNIT_TEST(reuse);
+    CPPUNIT_TEST(deadIdleConnection);
+    CPPUNIT_TEST(idleEviction);
+    CPPUNIT_TEST(minIdle);
+    CPPUNIT_TEST(maxActive);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void reuse();
+    void deadIdleConnection();
+    void idleEviction();
+    void minIdle();
+    void maxActive();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ConnectionPoolTestSuite);
+
+#endif /* CONNECTIONPOOLTESTSUITE_H */
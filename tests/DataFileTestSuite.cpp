@@ -0,0 +1,378 @@
+#include "DataFileTestSuite.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <rct/Compression.h>
+#include <rct/Crc32c.h>
+#include <rct/DataFile.h>
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Path.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/ThreadPool.h>
+
+// DataFile creates the parent directory, so it needs an absolute path
+static Path testPath()
+{
+    return Path::pwd() + "datafile.test";
+}
+
+void DataFileTestSuite::setUp()
+{
+    Path::rm(testPath());
+}
+
+void DataFileTestSuite::tearDown()
+{
+    Path::rm(testPath());
+}
+
+void DataFileTestSuite::roundTrip()
+{
+    List<int> ints;
+    for (int i=0; i<100000; ++i)
+        ints.append(i - 50000);
+    Map<String, int> values;
+    values["one"] = 1;
+    values["two"] = 2;
+
+    for (Serializer::Encoding encoding : { Serializer::Native, Serializer::Compact }) {
+        {
+            DataFile file(testPath(), 3, encoding);
+            CPPUNIT_ASSERT(file.open(DataFile::Write));
+            file << ints << values;
+            CPPUNIT_ASSERT(file.flush());
+        }
+
+        DataFile file(testPath(), 3);
+        CPPUNIT_ASSERT(file.open(DataFile::Read));
+        CPPUNIT_ASSERT(file.encoding() == encoding);
+        List<int> decodedInts;
+        Map<String, int> decodedValues;
+        file >> decodedInts >> decodedValues;
+        CPPUNIT_ASSERT(decodedInts.size() == ints.size());
+        CPPUNIT_ASSERT(decodedInts.first() == ints.first());
+        CPPUNIT_ASSERT(decodedInts.last() == ints.last());
+        CPPUNIT_ASSERT(decodedValues == values);
+    }
+}
+
+void DataFileTestSuite::wrongVersion()
+{
+    {
+        DataFile file(testPath(), 3);
+        CPPUNIT_ASSERT(file.open(DataFile::Write));
+        file << String("hello");
+    }
+    DataFile file(testPath(), 4);
+    CPPUNIT_ASSERT(!file.open(DataFile::Read));
+    CPPUNIT_ASSERT(!file.error().isEmpty());
+
+    DataFile missing(Path::pwd() + "datafile.missing", 4);
+    CPPUNIT_ASSERT(!missing.open(DataFile::Read));
+}
+
+void DataFileTestSuite::truncated()
+{
+    {
+        DataFile file(testPath(), 3);
+        CPPUNIT_ASSERT(file.open(DataFile::Write));
+        file << String("hello world");
+    }
+    String contents = testPath().readAll();
+    contents.chop(4);
+    CPPUNIT_ASSERT(testPath().write(contents));
+    DataFile file(testPath(), 3);
+    CPPUNIT_ASSERT(!file.open(DataFile::Read));
+}
+
+void DataFileTestSuite::fileDeserializer()
+{
+    String encoded;
+    {
+        Serializer serializer(encoded);
+        for (int i=0; i<100000; ++i)
+            serializer << i;
+        serializer << String("tail");
+    }
+    FILE *f = fopen(testPath().c_str(), "w+");
+    CPPUNIT_ASSERT(f);
+    CPPUNIT_ASSERT(fwrite(encoded.constData(), 1, encoded.size(), f) == encoded.size());
+    rewind(f);
+    {
+        Deserializer deserializer(f);
+        int value = -1;
+        CPPUNIT_ASSERT(deserializer.peek(reinterpret_cast<char *>(&value), sizeof(value)) == sizeof(value));
+        CPPUNIT_ASSERT_EQUAL(0, value);
+        for (int i=0; i<50000; ++i) {
+            deserializer >> value;
+            CPPUNIT_ASSERT_EQUAL(i, value);
+        }
+        CPPUNIT_ASSERT_EQUAL(static_cast<int>(50000 * sizeof(int)), deserializer.pos());
+    }
+    // the read ahead is given back
+    CPPUNIT_ASSERT_EQUAL(static_cast<long>(50000 * sizeof(int)), ftell(f));
+    {
+        Deserializer deserializer(f);
+        int value = -1;
+        for (int i=50000; i<100000; ++i) {
+            deserializer >> value;
+            CPPUNIT_ASSERT_EQUAL(i, value);
+        }
+        String tail;
+        deserializer >> tail;
+        CPPUNIT_ASSERT(tail == "tail");
+    }
+    fclose(f);
+}
+
+void DataFileTestSuite::sections()
+{
+    List<int> ints;
+    for (int i=0; i<1000; ++i)
+        ints.append(i);
+    Map<String, int> values;
+    values["one"] = 1;
+    {
+        DataFile file(testPath(), 3, Serializer::Compact);
+        CPPUNIT_ASSERT(file.open(DataFile::Write));
+        file << String("header");
+        CPPUNIT_ASSERT(file.writeSection("ints", ints));
+        CPPUNIT_ASSERT(file.beginSection("values"));
+        file << values << 42;
+        CPPUNIT_ASSERT(file.endSection());
+        CPPUNIT_ASSERT(!file.beginSection("ints"));
+        CPPUNIT_ASSERT(file.writeSection("empty", List<int>()));
+    }
+
+    DataFile file(testPath(), 3);
+    CPPUNIT_ASSERT(file.open(DataFile::Read));
+    CPPUNIT_ASSERT(file.encoding() == Serializer::Compact);
+    CPPUNIT_ASSERT(file.sections() == (List<String>() << "ints" << "values" << "empty"));
+    CPPUNIT_ASSERT(file.hasSection("values"));
+    CPPUNIT_ASSERT(!file.hasSection("missing"));
+    String header;
+    file >> header;
+    CPPUNIT_ASSERT(header == "header");
+
+    Map<String, int> decodedValues;
+    int number = 0;
+    CPPUNIT_ASSERT(file.openSection("values"));
+    file >> decodedValues >> number;
+    CPPUNIT_ASSERT(decodedValues == values);
+    CPPUNIT_ASSERT_EQUAL(42, number);
+    List<int> decodedInts;
+    CPPUNIT_ASSERT(file.readSection("ints", decodedInts));
+    CPPUNIT_ASSERT(decodedInts.size() == ints.size());
+    CPPUNIT_ASSERT(decodedInts.last() == ints.last());
+    List<int> empty;
+    empty << 1;
+    CPPUNIT_ASSERT(file.readSection("empty", empty));
+    CPPUNIT_ASSERT(empty.isEmpty());
+    CPPUNIT_ASSERT(!file.openSection("missing"));
+}
+
+void DataFileTestSuite::corruptSection()
+{
+    {
+        DataFile file(testPath(), 3);
+        CPPUNIT_ASSERT(file.open(DataFile::Write));
+        CPPUNIT_ASSERT(file.writeSection("first", String("first section")));
+        CPPUNIT_ASSERT(file.writeSection("second", String("second section")));
+    }
+    String contents = testPath().readAll();
+    const size_t pos = contents.indexOf("second section");
+    CPPUNIT_ASSERT(pos != String::npos);
+    contents[pos] = 'S';
+    CPPUNIT_ASSERT(testPath().write(contents));
+
+    DataFile file(testPath(), 3);
+    CPPUNIT_ASSERT(file.open(DataFile::Read));
+    String value;
+    CPPUNIT_ASSERT(file.readSection("first", value));
+    CPPUNIT_ASSERT(value == "first section");
+    CPPUNIT_ASSERT(!file.openSection("second"));
+    CPPUNIT_ASSERT(!file.error().isEmpty());
+}
+
+void DataFileTestSuite::checksum()
+{
+    CPPUNIT_ASSERT_EQUAL(0xe3069283u, Crc32c::checksum("123456789", 9));
+    String data;
+    for (int i=0; i<4099; ++i)
+        data.append(static_cast<char>(i * 31));
+    // the hardware path handles unaligned heads and tails separately
+    for (size_t offset = 0; offset < 9; ++offset) {
+        CPPUNIT_ASSERT_EQUAL(Crc32c::extendPortable(0, data.constData() + offset, data.size() - offset),
+                             Crc32c::checksum(data.constData() + offset, data.size() - offset));
+    }
+    Crc32c crc;
+    crc.update(data.constData(), 5);
+    crc.update(data.constData() + 5, data.size() - 5);
+    CPPUNIT_ASSERT_EQUAL(Crc32c::checksum(data.constData(), data.size()), crc.value());
+
+    {
+        DataFile file(testPath(), 3);
+        file.setDurability(DataFile::SyncFileAndDirectory);
+        CPPUNIT_ASSERT(file.open(DataFile::Write));
+        file.preallocate(1024 * 1024);
+        file << data;
+        CPPUNIT_ASSERT(file.flush());
+    }
+    {
+        DataFile file(testPath(), 3);
+        CPPUNIT_ASSERT(file.open(DataFile::Read));
+        CPPUNIT_ASSERT(file.verify());
+        String decoded;
+        file >> decoded;
+        CPPUNIT_ASSERT(decoded == data);
+    }
+
+    String contents = testPath().readAll();
+    contents[contents.size() / 2] ^= 1;
+    CPPUNIT_ASSERT(testPath().write(contents));
+    DataFile file(testPath(), 3);
+    CPPUNIT_ASSERT(!file.open(DataFile::Read));
+    CPPUNIT_ASSERT(file.error().contains("Checksum"));
+}
+
+void DataFileTestSuite::largeWrites()
+{
+    String big, section;
+    for (int i=0; i<3 * 1024 * 1024; ++i)
+        big.append(static_cast<char>(i * 7));
+    for (int i=0; i<600 * 1024; ++i)
+        section.append(static_cast<char>(i * 13));
+    {
+        // they go around the buffer, which must not lose the small ones
+        // or the checksums
+        DataFile file(testPath(), 3);
+        CPPUNIT_ASSERT(file.open(DataFile::Write));
+        file << 1 << big << 2;
+        CPPUNIT_ASSERT(file.beginSection("section"));
+        file << 3 << section;
+        CPPUNIT_ASSERT(file.endSection());
+        CPPUNIT_ASSERT(file.flush());
+    }
+    {
+        DataFile file(testPath(), 3);
+        CPPUNIT_ASSERT(file.open(DataFile::Read));
+        CPPUNIT_ASSERT(file.verify());
+        int one = 0, two = 0, three = 0;
+        String decodedBig, decodedSection;
+        file >> one >> decodedBig >> two;
+        CPPUNIT_ASSERT_EQUAL(1, one);
+        CPPUNIT_ASSERT(decodedBig == big);
+        CPPUNIT_ASSERT_EQUAL(2, two);
+        CPPUNIT_ASSERT(file.openSection("section"));
+        file >> three >> decodedSection;
+        CPPUNIT_ASSERT_EQUAL(3, three);
+        CPPUNIT_ASSERT(decodedSection == section);
+    }
+
+    String contents = testPath().readAll();
+    contents[contents.size() / 2] ^= 1;
+    CPPUNIT_ASSERT(testPath().write(contents));
+    DataFile file(testPath(), 3);
+    CPPUNIT_ASSERT(file.open(DataFile::Read));
+    CPPUNIT_ASSERT(!file.verify());
+    CPPUNIT_ASSERT(file.error().contains("Checksum"));
+}
+
+void DataFileTestSuite::blockCompression()
+{
+    List<int> ints;
+    for (int i=0; i<100000; ++i)
+        ints.append(i % 1000);
+    // doesn't compress, so it's stored as is
+    String noise;
+    unsigned int seed = 1;
+    for (int i=0; i<20000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        noise.append(static_cast<char>(seed >> 16));
+    }
+
+    Compression::Policy policy;
+    {
+        DataFile file(testPath(), 3);
+        file.setCompression(policy, 4096);
+        CPPUNIT_ASSERT(file.open(DataFile::Write));
+        file << String("before");
+        CPPUNIT_ASSERT(file.writeSection("ints", ints));
+        CPPUNIT_ASSERT(file.writeSection("noise", noise));
+        CPPUNIT_ASSERT(file.flush());
+    }
+    CPPUNIT_ASSERT(testPath().fileSize() < static_cast<int64_t>(ints.size() * sizeof(int)));
+    {
+        DataFile file(testPath(), 3);
+        CPPUNIT_ASSERT(file.open(DataFile::Read));
+        String value;
+        file >> value;
+        CPPUNIT_ASSERT(value == "before");
+        String decodedNoise;
+        CPPUNIT_ASSERT(file.readSection("noise", decodedNoise));
+        CPPUNIT_ASSERT(decodedNoise == noise);
+        List<int> decoded;
+        CPPUNIT_ASSERT(file.readSection("ints", decoded));
+        CPPUNIT_ASSERT_EQUAL(ints.size(), decoded.size());
+        for (size_t i=0; i<ints.size(); ++i)
+            CPPUNIT_ASSERT_EQUAL(ints.at(i), decoded.at(i));
+        CPPUNIT_ASSERT(file.verify());
+    }
+
+    // the stored noise blocks come right before the block index
+    String contents = testPath().readAll();
+    const size_t pos = contents.indexOf(noise.mid(10000, 64));
+    CPPUNIT_ASSERT(pos != String::npos);
+    contents[pos] ^= 1;
+    CPPUNIT_ASSERT(testPath().write(contents));
+    DataFile file(testPath(), 3);
+    CPPUNIT_ASSERT(file.open(DataFile::Read));
+    List<int> decoded;
+    CPPUNIT_ASSERT(file.readSection("ints", decoded));
+    CPPUNIT_ASSERT(!file.openSection("noise"));
+    CPPUNIT_ASSERT(file.error().contains("Checksum"));
+}
+
+void DataFileTestSuite::fromPoolThreads()
+{
+    // every pool thread writes and reads a file, the blocks have no
+    // thread left to run on
+    ThreadPool *pool = ThreadPool::instance();
+    const int count = ThreadPool::idealThreadCount();
+    List<int> ints;
+    for (int i=0; i<100000; ++i)
+        ints.append(i % 1000);
+    std::atomic<int> done(0), ok(0);
+    for (int i=0; i<count; ++i) {
+        pool->start([i, &ints, &done, &ok]() {
+                const Path path = Path::pwd() + String::format<32>("datafile%d.test", i);
+                bool success;
+                {
+                    DataFile file(path, 3);
+                    file.setCompression(Compression::Policy(), 4096);
+                    success = file.open(DataFile::Write) && file.writeSection("ints", ints) && file.flush();
+                }
+                if (success) {
+                    DataFile file(path, 3);
+                    List<int> decoded;
+                    success = file.open(DataFile::Read) && file.readSection("ints", decoded)
+                        && decoded.size() == ints.size() && std::equal(decoded.begin(), decoded.end(), ints.begin());
+                }
+                Path::rm(path);
+                if (success)
+                    ++ok;
+                ++done;
+            });
+    }
+    for (int i=0; i<6000 && done < count; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CPPUNIT_ASSERT_EQUAL(count, done.load());
+    CPPUNIT_ASSERT_EQUAL(count, ok.load());
+}
@@ -0,0 +1,42 @@
+#ifndef DATAFILETESTSUITE_H
+#define DATAFILETESTSUITE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class DataFileTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(DataFileTestSuite);
+
+    CPPUNIT_TEST(roundTrip);
+    CPPUNIT_TEST(wrongVersion);
+    CPPUNIT_TEST(truncated);
+    CPPUNIT_TEST(fileDeserializer);
+    CPPUNIT_TEST(sections);
+    CPPUNIT_TEST(corruptSection);
+    CPPUNIT_TEST(checksum);
+    CPPUNIT_TEST(largeWrites);
+    CPPUNIT_TEST(blockCompression);
+    CPPUNIT_TEST(fromPoolThreads);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp();
+    void tearDown();
+
+protected:
+    void roundTrip();
+    void wrongVersion();
+    void truncated();
+    void fileDeserializer();
+    void sections();
+    void corruptSection();
+    void checksum();
+    void largeWrites();
+    void blockCompression();
+    void fromPoolThreads();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(DataFileTestSuite);
+
+#endif /* DATAFILETESTSUITE_H */
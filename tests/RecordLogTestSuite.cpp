@@ -0,0 +1,218 @@
+#include "RecordLogTestSuite.h"
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <rct/Map.h>
+#include <rct/Path.h>
+#include <rct/RecordLog.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+
+static Path testDir()
+{
+    return Path::pwd() + "recordlog.test/";
+}
+
+typedef Map<String, int> State;
+
+// records are key/value pairs
+static RecordLog::Replay apply(State &state)
+{
+    return [&state](Deserializer &record) {
+        String key;
+        int value;
+        record >> key >> value;
+        state[key] = value;
+        return true;
+    };
+}
+
+static size_t segmentCount()
+{
+    size_t ret = 0;
+    for (const Path &file : testDir().files(Path::File)) {
+        if (String(file.fileName()).startsWith("log."))
+            ++ret;
+    }
+    return ret;
+}
+
+void RecordLogTestSuite::setUp()
+{
+    Path::rmdir(testDir());
+}
+
+void RecordLogTestSuite::tearDown()
+{
+    Path::rmdir(testDir());
+}
+
+void RecordLogTestSuite::replay()
+{
+    size_t logSize;
+    {
+        RecordLog log(testDir(), 1);
+        State state;
+        CPPUNIT_ASSERT(log.open(state, apply(state)));
+        CPPUNIT_ASSERT(state.isEmpty());
+        for (int i=0; i<100; ++i)
+            log.append(std::make_pair(String::format<32>("key%d", i % 10), i));
+        CPPUNIT_ASSERT(log.commit());
+        logSize = log.logSize();
+        // committed by the destructor
+        log.append(std::make_pair(String("last"), -1));
+    }
+    RecordLog log(testDir(), 1);
+    State state;
+    CPPUNIT_ASSERT(log.open(state, apply(state)));
+    CPPUNIT_ASSERT_EQUAL(size_t(11), state.size());
+    CPPUNIT_ASSERT_EQUAL(95, state.value("key5"));
+    CPPUNIT_ASSERT_EQUAL(-1, state.value("last"));
+    CPPUNIT_ASSERT(log.logSize() > logSize);
+
+    // records of another version aren't replayed
+    RecordLog other(testDir(), 2);
+    State otherState;
+    CPPUNIT_ASSERT(!other.open(otherState, apply(otherState)));
+    CPPUNIT_ASSERT(other.error().contains("version"));
+}
+
+void RecordLogTestSuite::snapshot()
+{
+    {
+        RecordLog log(testDir(), 1, Serializer::Compact);
+        State state;
+        CPPUNIT_ASSERT(log.open(state, apply(state)));
+        for (int i=0; i<1000; ++i) {
+            const String key = String::format<32>("key%d", i % 100);
+            state[key] = i;
+            log.append(std::make_pair(key, i));
+        }
+        CPPUNIT_ASSERT(log.commit());
+        CPPUNIT_ASSERT(log.logSize() > 0);
+        CPPUNIT_ASSERT(log.snapshot(state));
+        // goes to the next segment while the snapshot is written
+        state["after"] = 1;
+        log.append(std::make_pair(String("after"), 1));
+        CPPUNIT_ASSERT(log.commit());
+        CPPUNIT_ASSERT(log.waitForSnapshot());
+        CPPUNIT_ASSERT_EQUAL(size_t(1), segmentCount());
+    }
+    RecordLog log(testDir(), 1, Serializer::Compact);
+    State state;
+    CPPUNIT_ASSERT(log.open(state, apply(state)));
+    CPPUNIT_ASSERT_EQUAL(size_t(101), state.size());
+    CPPUNIT_ASSERT_EQUAL(999, state.value("key99"));
+    CPPUNIT_ASSERT_EQUAL(1, state.value("after"));
+}
+
+void RecordLogTestSuite::tornRecord()
+{
+    {
+        RecordLog log(testDir(), 1);
+        State state;
+        CPPUNIT_ASSERT(log.open(state, apply(state)));
+        log.append(std::make_pair(String("one"), 1));
+        log.append(std::make_pair(String("two"), 2));
+        CPPUNIT_ASSERT(log.commit());
+    }
+    const Path segment = testDir() + "log.0";
+    String contents = segment.readAll();
+    // a crash in the middle of writing the second record
+    contents.chop(3);
+    CPPUNIT_ASSERT(segment.write(contents));
+    {
+        RecordLog log(testDir(), 1);
+        State state;
+        CPPUNIT_ASSERT(log.open(state, apply(state)));
+        CPPUNIT_ASSERT_EQUAL(size_t(1), state.size());
+        CPPUNIT_ASSERT_EQUAL(1, state.value("one"));
+        log.append(std::make_pair(String("three"), 3));
+        CPPUNIT_ASSERT(log.commit());
+    }
+    RecordLog log(testDir(), 1);
+    State state;
+    CPPUNIT_ASSERT(log.open(state, apply(state)));
+    CPPUNIT_ASSERT_EQUAL(size_t(2), state.size());
+    CPPUNIT_ASSERT_EQUAL(3, state.value("three"));
+}
+
+void RecordLogTestSuite::groupCommit()
+{
+    {
+        RecordLog log(testDir(), 1);
+        log.setDurability(DataFile::SyncFile);
+        State state;
+        CPPUNIT_ASSERT(log.open(state, apply(state)));
+        std::vector<std::thread> threads;
+        for (int t=0; t<4; ++t) {
+            threads.emplace_back([&log, t]() {
+                    for (int i=0; i<50; ++i) {
+                        const uint64_t sequence = log.append(std::make_pair(String::format<32>("%d-%d", t, i), i));
+                        CPPUNIT_ASSERT(log.commit(sequence));
+                    }
+                });
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+    RecordLog log(testDir(), 1);
+    State state;
+    CPPUNIT_ASSERT(log.open(state, apply(state)));
+    CPPUNIT_ASSERT_EQUAL(size_t(200), state.size());
+}
+
+void RecordLogTestSuite::concurrentSnapshot()
+{
+    // records add to a counter, so a lost or a doubled one shows
+    auto add = [](State &state) {
+        return [&state](Deserializer &record) {
+            String key;
+            int value;
+            record >> key >> value;
+            state[key] += value;
+            return true;
+        };
+    };
+    {
+        RecordLog log(testDir(), 1);
+        State state;
+        CPPUNIT_ASSERT(log.open(state, add(state)));
+        std::mutex mutex;
+        std::vector<std::thread> threads;
+        for (int t=0; t<4; ++t) {
+            threads.emplace_back([&log, &state, &mutex, t]() {
+                    const String key = String::format<32>("thread%d", t);
+                    for (int i=0; i<2000; ++i) {
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            ++state[key];
+                            log.append(std::make_pair(key, 1));
+                        }
+                        if (!(i % 100))
+                            CPPUNIT_ASSERT(log.commit());
+                    }
+                });
+        }
+        for (int i=0; i<10; ++i) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                CPPUNIT_ASSERT(log.snapshot(state));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+        CPPUNIT_ASSERT(log.commit());
+        CPPUNIT_ASSERT(log.waitForSnapshot());
+    }
+    RecordLog log(testDir(), 1);
+    State state;
+    CPPUNIT_ASSERT(log.open(state, add(state)));
+    CPPUNIT_ASSERT_EQUAL(size_t(4), state.size());
+    for (const auto &counter : state)
+        CPPUNIT_ASSERT_EQUAL(2000, counter.second);
+}
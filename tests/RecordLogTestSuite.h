@@ -0,0 +1,32 @@
+#ifndef RECORDLOGTESTSUITE_H
+#define RECORDLOGTESTSUITE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class RecordLogTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(RecordLogTestSuite);
+
+    CPPUNIT_TEST(replay);
+    CPPUNIT_TEST(snapshot);
+    CPPUNIT_TEST(tornRecord);
+    CPPUNIT_TEST(groupCommit);
+    CPPUNIT_TEST(concurrentSnapshot);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp();
+    void tearDown();
+
+protected:
+    void replay();
+    void snapshot();
+    void tornRecord();
+    void groupCommit();
+    void concurrentSnapshot();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(RecordLogTestSuite);
+
+#endif /* RECORDLOGTESTSUITE_H */
@@ -0,0 +1,200 @@
+#include "SerializerTestSuite.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+
+template <typename T>
+static size_t serializedSize(const T &value, Serializer::Encoding encoding = Serializer::Native)
+{
+    String out;
+    Serializer serializer(out);
+    serializer.setEncoding(encoding);
+    serializer << value;
+    return out.size();
+}
+
+struct Opaque
+{
+};
+
+void SerializerTestSuite::setUp() {}
+
+void SerializerTestSuite::tearDown() {}
+
+void SerializerTestSuite::encodedSizeOfValues()
+{
+    CPPUNIT_ASSERT_EQUAL(serializedSize(12), encodedSizeOf(12));
+    CPPUNIT_ASSERT_EQUAL(serializedSize(true), encodedSizeOf(true));
+    CPPUNIT_ASSERT_EQUAL(serializedSize(1.5), encodedSizeOf(1.5));
+    const String string("hello world");
+    CPPUNIT_ASSERT_EQUAL(serializedSize(string), encodedSizeOf(string));
+    CPPUNIT_ASSERT_EQUAL(serializedSize(String()), encodedSizeOf(String()));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(String::npos), encodedSizeOf(Opaque()));
+}
+
+void SerializerTestSuite::encodedSizeOfContainers()
+{
+    List<int> ints;
+    for (int i=0; i<10; ++i)
+        ints.append(i);
+    CPPUNIT_ASSERT_EQUAL(serializedSize(ints), encodedSizeOf(ints));
+
+    List<String> strings;
+    strings << "a" << "bc" << String() << "def";
+    CPPUNIT_ASSERT_EQUAL(serializedSize(strings), encodedSizeOf(strings));
+
+    Map<String, List<String> > map;
+    map["one"] = strings;
+    map["two"] = List<String>();
+    CPPUNIT_ASSERT_EQUAL(serializedSize(map), encodedSizeOf(map));
+
+    List<Opaque> opaque;
+    opaque.append(Opaque());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(String::npos), encodedSizeOf(opaque));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(String::npos), encodedSizeOfFields(1, opaque, String()));
+}
+
+void SerializerTestSuite::fieldsRoundTrip()
+{
+    // what RCT_MESSAGE_FIELDS expands to
+    const int number = 42;
+    const bool flag = true;
+    const String name("name");
+    List<String> arguments;
+    arguments << "foo" << "bar";
+    Map<String, int> values;
+    values["x"] = 1;
+    values["y"] = 2;
+
+    String encoded;
+    {
+        Serializer serializer(encoded);
+        serializeFields(serializer, number, flag, name, arguments, values);
+    }
+    CPPUNIT_ASSERT_EQUAL(encoded.size(), encodedSizeOfFields(number, flag, name, arguments, values));
+
+    int decodedNumber = 0;
+    bool decodedFlag = false;
+    String decodedName;
+    List<String> decodedArguments;
+    Map<String, int> decodedValues;
+    Deserializer deserializer(encoded);
+    deserializeFields(deserializer, decodedNumber, decodedFlag, decodedName, decodedArguments, decodedValues);
+    CPPUNIT_ASSERT(deserializer.atEnd());
+    CPPUNIT_ASSERT_EQUAL(number, decodedNumber);
+    CPPUNIT_ASSERT(decodedFlag);
+    CPPUNIT_ASSERT(decodedName == name);
+    CPPUNIT_ASSERT(decodedArguments == arguments);
+    CPPUNIT_ASSERT(decodedValues == values);
+}
+
+void SerializerTestSuite::compactRoundTrip()
+{
+    List<int> ints;
+    ints << 0 << 1 << -1 << 63 << -64 << 64 << INT32_MAX << INT32_MIN;
+    List<unsigned short> shorts;
+    shorts << 0 << 127 << 128 << UINT16_MAX;
+    Map<String, long long> values;
+    values["small"] = 3;
+    values["big"] = INT64_MIN;
+    const uint64_t huge = UINT64_MAX;
+    const double real = 1.5;
+
+    String compact;
+    {
+        Serializer serializer(compact);
+        serializer.setEncoding(Serializer::Compact);
+        serializeFields(serializer, ints, shorts, values, huge, real);
+    }
+    String native;
+    {
+        Serializer serializer(native);
+        serializeFields(serializer, ints, shorts, values, huge, real);
+    }
+    CPPUNIT_ASSERT(compact.size() < native.size());
+
+    // one byte for the size, one for each small value
+    List<int> small;
+    small << 1 << -2 << 3;
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), serializedSize(small, Serializer::Compact));
+
+    List<int> decodedInts;
+    List<unsigned short> decodedShorts;
+    Map<String, long long> decodedValues;
+    uint64_t decodedHuge = 0;
+    double decodedReal = 0;
+    Deserializer deserializer(compact);
+    deserializer.setEncoding(Serializer::Compact);
+    deserializeFields(deserializer, decodedInts, decodedShorts, decodedValues, decodedHuge, decodedReal);
+    CPPUNIT_ASSERT(deserializer.atEnd());
+    CPPUNIT_ASSERT(decodedInts.size() == ints.size());
+    for (size_t i=0; i<ints.size(); ++i)
+        CPPUNIT_ASSERT_EQUAL(ints.at(i), decodedInts.at(i));
+    CPPUNIT_ASSERT(decodedShorts.size() == shorts.size());
+    for (size_t i=0; i<shorts.size(); ++i)
+        CPPUNIT_ASSERT_EQUAL(shorts.at(i), decodedShorts.at(i));
+    CPPUNIT_ASSERT(decodedValues == values);
+    CPPUNIT_ASSERT_EQUAL(huge, decodedHuge);
+    CPPUNIT_ASSERT_EQUAL(real, decodedReal);
+}
+
+void SerializerTestSuite::truncatedView()
+{
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << uint32_t(1000) << int32_t(0);
+    }
+    Deserializer deserializer(data);
+    StringView view("untouched");
+    deserializer >> view;
+    // the length claims more than there is
+    CPPUNIT_ASSERT(view.isEmpty());
+    CPPUNIT_ASSERT(deserializer.atEnd());
+}
+
+void SerializerTestSuite::truncatedList()
+{
+    for (Serializer::Encoding encoding : { Serializer::Native, Serializer::Compact }) {
+        String data;
+        {
+            Serializer serializer(data);
+            serializer.setEncoding(encoding);
+            serializer << uint32_t(0x40000000) << int32_t(0) << int32_t(0);
+        }
+        // would be gigabytes if the count was believed
+        Deserializer deserializer(data);
+        deserializer.setEncoding(encoding);
+        List<int> list;
+        list << 1;
+        deserializer >> list;
+        CPPUNIT_ASSERT(list.isEmpty());
+        CPPUNIT_ASSERT(deserializer.atEnd());
+
+        Deserializer vectorDeserializer(data);
+        vectorDeserializer.setEncoding(encoding);
+        std::vector<uint64_t> vector(1);
+        vectorDeserializer >> vector;
+        CPPUNIT_ASSERT(vector.empty());
+        CPPUNIT_ASSERT(vectorDeserializer.atEnd());
+    }
+
+    // exactly as much as it says is fine
+    String data;
+    {
+        Serializer serializer(data);
+        serializer << uint32_t(2) << int32_t(7) << int32_t(8);
+    }
+    Deserializer deserializer(data);
+    List<int> list;
+    deserializer >> list;
+    CPPUNIT_ASSERT(list.size() == 2 && list.first() == 7 && list.last() == 8);
+    CPPUNIT_ASSERT(deserializer.atEnd());
+}
@@ -0,0 +1,34 @@
+#ifndef SERIALIZERTESTSUITE_H
+#define SERIALIZERTESTSUITE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class SerializerTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(SerializerTestSuite);
+
+    CPPUNIT_TEST(encodedSizeOfValues);
+    CPPUNIT_TEST(encodedSizeOfContainers);
+    CPPUNIT_TEST(fieldsRoundTrip);
+    CPPUNIT_TEST(compactRoundTrip);
+    CPPUNIT_TEST(truncatedView);
+    CPPUNIT_TEST(truncatedList);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp();
+    void tearDown();
+
+protected:
+    void encodedSizeOfValues();
+    void encodedSizeOfContainers();
+    void fieldsRoundTrip();
+    void compactRoundTrip();
+    void truncatedView();
+    void truncatedList();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SerializerTestSuite);
+
+#endif /* SERIALIZERTESTSUITE_H */
@@ -0,0 +1,802 @@
+#include "SocketTestSuite.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+#include <rct/ChunkMessage.h>
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/List.h>
+#include <rct/Map.h>
+#include <rct/Message.h>
+#include <rct/Path.h>
+#include <rct/Rct.h>
+#include <rct/SharedMemoryChannel.h>
+#include <rct/SocketClient.h>
+#include <rct/SocketServer.h>
+
+class TestMessage : public Message
+{
+public:
+    enum { MessageId = 100 };
+
+    TestMessage(const String &text = String(), uint8_t flags = None)
+        : Message(MessageId, flags), mText(text)
+    {}
+
+    const String &text() const { return mText; }
+
+    virtual void encode(Serializer &serializer) const override { serializer << mText; }
+    virtual void decode(Deserializer &deserializer) override { deserializer >> mText; }
+private:
+    String mText;
+};
+
+// wants TestMessage's id
+class ConflictingMessage : public Message
+{
+public:
+    enum { MessageId = TestMessage::MessageId };
+
+    ConflictingMessage()
+        : Message(MessageId)
+    {}
+
+    virtual void encode(Serializer &) const override {}
+    virtual void decode(Deserializer &) override {}
+};
+
+class PooledMessage : public Message
+{
+public:
+    enum { MessageId = 101 };
+
+    PooledMessage(const String &text = String())
+        : Message(MessageId), mText(text)
+    {}
+
+    const String &text() const { return mText; }
+
+    virtual void encode(Serializer &serializer) const override { serializer << mText; }
+    virtual void decode(Deserializer &deserializer) override { deserializer >> mText; }
+private:
+    String mText;
+};
+
+static Path socketPath()
+{
+    return Path::pwd() + "socket.test";
+}
+
+// runs the loop until done() or about a second has passed
+static void runUntil(const std::shared_ptr<EventLoop> &loop, const std::function<bool()> &done)
+{
+    for (int i=0; i<100 && !done(); ++i)
+        loop->exec(10);
+}
+
+// a connected pair of SocketClients
+static void socketPair(std::shared_ptr<SocketClient> &a, std::shared_ptr<SocketClient> &b)
+{
+    int fds[2];
+    CPPUNIT_ASSERT(!::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    a.reset(new SocketClient(fds[0], SocketClient::Unix));
+    b.reset(new SocketClient(fds[1], SocketClient::Unix));
+}
+
+// appends the text of the TestMessages \a connection receives to \a received
+static void receiveText(const std::shared_ptr<Connection> &connection, List<String> &received)
+{
+    connection->newMessage().connect([&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            if (message->messageId() == TestMessage::MessageId)
+                received.append(static_cast<TestMessage *>(message.get())->text());
+        });
+}
+
+void SocketTestSuite::setUp()
+{
+    Path::rm(socketPath());
+}
+
+void SocketTestSuite::tearDown()
+{
+    Path::rm(socketPath());
+}
+
+void SocketTestSuite::newConnectionPerSocket()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    SocketServer server;
+    server.setMaxConnections(3);
+    CPPUNIT_ASSERT(server.listen(socketPath()));
+    int emitted = 0;
+    List<std::shared_ptr<SocketClient> > accepted;
+    server.newConnection().connect([&emitted, &accepted](SocketServer *s) {
+            ++emitted;
+            // a handler that takes one connection per signal
+            if (std::shared_ptr<SocketClient> client = s->nextConnection())
+                accepted.append(client);
+        });
+
+    // all of them are accepted in one go
+    List<std::shared_ptr<SocketClient> > clients;
+    for (int i=0; i<4; ++i) {
+        std::shared_ptr<SocketClient> client(new SocketClient);
+        CPPUNIT_ASSERT(client->connect(socketPath()));
+        clients.append(client);
+    }
+    runUntil(loop, [&server]() { return server.acceptedCount() + server.refusedCount() == 4; });
+    CPPUNIT_ASSERT_EQUAL(3, emitted);
+    CPPUNIT_ASSERT_EQUAL(size_t(3), accepted.size());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), server.refusedCount());
+    CPPUNIT_ASSERT_EQUAL(size_t(3), server.activeConnections());
+
+    accepted.first()->close();
+    CPPUNIT_ASSERT_EQUAL(size_t(2), server.activeConnections());
+    accepted.removeLast();
+    CPPUNIT_ASSERT_EQUAL(size_t(1), server.activeConnections());
+}
+
+void SocketTestSuite::fileDescriptors()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    int pipe[2];
+    CPPUNIT_ASSERT(!::pipe(pipe));
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    CPPUNIT_ASSERT(a->write(String("x"), List<int>() << pipe[1]));
+    runUntil(loop, [&b]() { return b->hasFileDescriptors(); });
+    const List<int> received = b->takeFileDescriptors();
+    CPPUNIT_ASSERT_EQUAL(size_t(1), received.size());
+    CPPUNIT_ASSERT(::write(received.first(), "hi", 2) == 2);
+    ::close(received.first());
+    char buf[2];
+    CPPUNIT_ASSERT(::read(pipe[0], buf, 2) == 2 && !memcmp(buf, "hi", 2));
+
+    // more than the other side takes
+    List<int> tooMany;
+    for (int i=0; i<=SocketClient::MaxFileDescriptors; ++i)
+        tooMany.append(pipe[1]);
+    CPPUNIT_ASSERT(!a->write(String("x"), tooMany));
+
+    // a peer that sends them anyway loses the connection instead of some of
+    // the file descriptors
+    int fds[2];
+    CPPUNIT_ASSERT(!::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    std::shared_ptr<SocketClient> client(new SocketClient(fds[1], SocketClient::Unix));
+    bool failed = false;
+    client->error().connect([&failed](const std::shared_ptr<SocketClient> &, SocketClient::Error error) {
+            failed = error == SocketClient::ReadError;
+        });
+    enum { Count = SocketClient::MaxFileDescriptors * 2 };
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * Count)];
+    } control;
+    memset(&control, 0, sizeof(control));
+    char byte = 'x';
+    iovec iov = { &byte, 1 };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * Count);
+    for (int i=0; i<Count; ++i)
+        memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &pipe[1], sizeof(int));
+    CPPUNIT_ASSERT(::sendmsg(fds[0], &msg, 0) == 1);
+    runUntil(loop, [&client]() { return !client->isConnected(); });
+    CPPUNIT_ASSERT(failed);
+    CPPUNIT_ASSERT(!client->hasFileDescriptors());
+
+    ::close(fds[0]);
+    ::close(pipe[0]);
+    ::close(pipe[1]);
+}
+
+void SocketTestSuite::messageIds()
+{
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+    // registering the same message again is fine
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+    // another one for its id isn't
+    CPPUNIT_ASSERT(!Message::registerMessage<ConflictingMessage>());
+    const std::shared_ptr<const String> frame = TestMessage("test").encodeShared(0);
+    const std::shared_ptr<Message> message = Message::create(0, frame->constData() + sizeof(uint32_t),
+                                                             frame->size() - sizeof(uint32_t));
+    CPPUNIT_ASSERT(message);
+    CPPUNIT_ASSERT(static_cast<TestMessage *>(message.get())->text() == "test");
+    CPPUNIT_ASSERT(static_cast<int>(TestMessage::MessageId) < static_cast<int>(Message::ReservedMessageId));
+    CPPUNIT_ASSERT(static_cast<int>(ChunkMessage::MessageId) >= static_cast<int>(Message::ReservedMessageId));
+
+    const ChunkMessage chunk(1, 0, "data", true);
+    CPPUNIT_ASSERT(chunk.data() == "data");
+}
+
+void SocketTestSuite::flushOnDestroy()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> connection = Connection::create(a);
+    // keep the message in the batch until the connection goes away
+    connection->setWriteCoalescing(true, 64 * 1024, 10 * 1000 * 1000);
+    CPPUNIT_ASSERT(connection->write("hello"));
+    b.reset();
+    a.reset();
+
+    // the flush fails, which must not call back into the dying connection
+    connection.reset();
+    CPPUNIT_ASSERT(!connection);
+}
+
+void SocketTestSuite::cachedMessages()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> sender = Connection::create(a);
+    std::shared_ptr<Connection> receiver = Connection::create(b);
+    int traced = 0;
+    const Connection::TraceHandler handler = [&traced](const std::shared_ptr<Connection> &, const Connection::MessageTrace &) { ++traced; };
+    sender->setTracing(1.0, handler);
+    receiver->setTracing(1.0, handler);
+    sender->setStatisticsEnabled(true);
+    String received;
+    receiver->newMessage().connect([&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            if (message->messageId() == TestMessage::MessageId)
+                received = static_cast<TestMessage *>(message.get())->text();
+        });
+
+    CPPUNIT_ASSERT(sender->send(TestMessage("cached", Message::MessageCache)));
+    runUntil(loop, [&received]() { return !received.isEmpty(); });
+    CPPUNIT_ASSERT(received == "cached");
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), sender->statistics().messagesSent);
+
+    // the receiver learned that the sender understands traced messages
+    receiver->finish();
+    CPPUNIT_ASSERT_EQUAL(1, traced);
+}
+
+// switches a pair of connections to shared memory while both keep sending
+static void sharedMemoryExchange(bool paced)
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> first = Connection::create(a);
+    std::shared_ptr<Connection> second = Connection::create(b);
+    List<String> firstReceived, secondReceived;
+    first->newMessage().connect([&firstReceived](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            firstReceived.append(static_cast<TestMessage *>(message.get())->text());
+        });
+    second->newMessage().connect([&secondReceived](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            secondReceived.append(static_cast<TestMessage *>(message.get())->text());
+        });
+
+    if (paced) {
+        // the handshake has to get past queued frames
+        first->setRateLimit(8000, 0, 1);
+        second->setRateLimit(8000, 0, 1);
+    }
+    if (!first->enableSharedMemory(64 * 1024))
+        return; // not supported here
+    // both sides keep talking while they switch
+    List<String> sent;
+    for (int i=0; i<100; ++i) {
+        sent.append(String::number(i));
+        CPPUNIT_ASSERT(first->send(TestMessage(sent.last())));
+        CPPUNIT_ASSERT(second->send(TestMessage(sent.last())));
+        loop->exec(1);
+    }
+    runUntil(loop, [&]() {
+            return first->isSharedMemory() && second->isSharedMemory()
+                && firstReceived.size() == sent.size() && secondReceived.size() == sent.size();
+        });
+    CPPUNIT_ASSERT(first->isSharedMemory());
+    CPPUNIT_ASSERT(second->isSharedMemory());
+    CPPUNIT_ASSERT(firstReceived == sent);
+    CPPUNIT_ASSERT(secondReceived == sent);
+
+    CPPUNIT_ASSERT(first->send(TestMessage("done")));
+    runUntil(loop, [&]() { return secondReceived.size() > sent.size(); });
+    CPPUNIT_ASSERT(secondReceived.last() == "done");
+}
+
+void SocketTestSuite::sharedMemory()
+{
+    sharedMemoryExchange(false);
+}
+
+void SocketTestSuite::pacedSharedMemory()
+{
+    sharedMemoryExchange(true);
+}
+
+void SocketTestSuite::rejectSharedMemory()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> first = Connection::create(a);
+    std::shared_ptr<Connection> second = Connection::create(b);
+    List<String> received;
+    second->newMessage().connect([&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            received.append(static_cast<TestMessage *>(message.get())->text());
+        });
+
+    // each side turns down the other's setup
+    if (!first->enableSharedMemory(64 * 1024) || !second->enableSharedMemory(64 * 1024))
+        return; // not supported here
+    CPPUNIT_ASSERT(first->send(TestMessage("before")));
+    runUntil(loop, [&received]() { return received.size() == 1; });
+    CPPUNIT_ASSERT(first->send(TestMessage("after")));
+    runUntil(loop, [&received]() { return received.size() == 2; });
+    CPPUNIT_ASSERT(!first->isSharedMemory());
+    CPPUNIT_ASSERT(!second->isSharedMemory());
+    CPPUNIT_ASSERT(received == (List<String>() << "before" << "after"));
+    CPPUNIT_ASSERT(first->isConnected());
+}
+
+void SocketTestSuite::corruptSharedMemory()
+{
+    std::unique_ptr<SharedMemoryChannel> channel = SharedMemoryChannel::create(4096);
+    if (!channel)
+        return; // not supported here
+    List<int> fileDescriptors;
+    for (int fd : channel->fileDescriptors())
+        fileDescriptors.append(::dup(fd));
+    std::unique_ptr<SharedMemoryChannel> peer = SharedMemoryChannel::attach(fileDescriptors, channel->ringSize());
+    CPPUNIT_ASSERT(peer);
+
+    channel->write("hello", 5);
+    Buffer buffer;
+    CPPUNIT_ASSERT(peer->process(buffer));
+    CPPUNIT_ASSERT_EQUAL(size_t(5), buffer.size());
+
+    // a peer claiming more than the ring holds
+    const size_t size = lseek(channel->fileDescriptors().first(), 0, SEEK_END);
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, channel->fileDescriptors().first(), 0);
+    CPPUNIT_ASSERT(memory != MAP_FAILED);
+    const uint64_t head = 1024 * 1024;
+    memcpy(memory, &head, sizeof(head));
+    munmap(memory, size);
+
+    buffer.clear();
+    CPPUNIT_ASSERT(!peer->process(buffer));
+    CPPUNIT_ASSERT(peer->hasError());
+    CPPUNIT_ASSERT(buffer.isEmpty());
+    peer->write("world", 5);
+    CPPUNIT_ASSERT_EQUAL(size_t(0), peer->takeBytesWritten());
+}
+
+void SocketTestSuite::pacing()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> first = Connection::create(a);
+    std::shared_ptr<Connection> second = Connection::create(b);
+    List<String> received;
+    receiveText(second, received);
+
+    // two right away, one every 5ms after that
+    first->setRateLimit(0, 200, 0, 2);
+    CPPUNIT_ASSERT(first->isRateLimited());
+    List<String> sent;
+    for (int i=0; i<10; ++i) {
+        sent.append(String::number(i));
+        CPPUNIT_ASSERT(first->send(TestMessage(sent.last())));
+    }
+    Connection::PacingStats stats = first->pacingStats();
+    CPPUNIT_ASSERT_EQUAL(size_t(8), stats.queuedMessages);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(8), stats.delayedMessages);
+    CPPUNIT_ASSERT(stats.queuedBytes > 0);
+    const uint64_t queued = Rct::monoMs();
+    while (Rct::monoMs() == queued)
+        usleep(1000);
+    CPPUNIT_ASSERT(first->pacingStats().queueDelay > 0);
+
+    runUntil(loop, [&received, &sent]() { return received.size() == sent.size(); });
+    CPPUNIT_ASSERT(received == sent);
+    stats = first->pacingStats();
+    CPPUNIT_ASSERT_EQUAL(size_t(0), stats.queuedMessages);
+    CPPUNIT_ASSERT_EQUAL(size_t(0), stats.queuedBytes);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), stats.queueDelay);
+    CPPUNIT_ASSERT(stats.totalDelay >= 30);
+
+    // turning it off writes out what's still queued
+    first->setRateLimit(0, 1, 0, 1);
+    CPPUNIT_ASSERT(first->send(TestMessage("a")));
+    CPPUNIT_ASSERT(first->send(TestMessage("b")));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), first->pacingStats().queuedMessages);
+    first->setRateLimit(0);
+    CPPUNIT_ASSERT(!first->isRateLimited());
+    CPPUNIT_ASSERT(first->send(TestMessage("c")));
+    sent << "a" << "b" << "c";
+    runUntil(loop, [&received, &sent]() { return received.size() == sent.size(); });
+    CPPUNIT_ASSERT(received == sent);
+}
+
+void SocketTestSuite::tracing()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> first = Connection::create(a);
+    std::shared_ptr<Connection> second = Connection::create(b);
+    List<uint8_t> firstFlags, secondFlags;
+    first->newMessage().connect([&firstFlags](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            firstFlags.append(message->flags());
+        });
+    second->newMessage().connect([&secondFlags](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            secondFlags.append(message->flags());
+        });
+    List<Connection::MessageTrace> firstTraces, secondTraces;
+    first->setTracing(1.0, [&firstTraces](const std::shared_ptr<Connection> &, const Connection::MessageTrace &trace) {
+            firstTraces.append(trace);
+        });
+
+    // the peer hasn't said it understands stamps
+    CPPUNIT_ASSERT(first->send(TestMessage("untraced")));
+    CPPUNIT_ASSERT(second->send(TestMessage("plain")));
+    runUntil(loop, [&]() { return secondFlags.size() == 1 && firstFlags.size() == 1; });
+    CPPUNIT_ASSERT(first->send(TestMessage("untraced")));
+    runUntil(loop, [&]() { return secondFlags.size() == 2; });
+    CPPUNIT_ASSERT_EQUAL(size_t(2), secondFlags.size());
+    for (uint8_t flags : secondFlags) {
+        CPPUNIT_ASSERT(!(flags & Message::Traced));
+        CPPUNIT_ASSERT(flags & Message::TraceCapable);
+    }
+    CPPUNIT_ASSERT(!(firstFlags.first() & Message::TraceCapable));
+    CPPUNIT_ASSERT(firstTraces.isEmpty());
+
+    second->setTracing(1.0, [&secondTraces](const std::shared_ptr<Connection> &, const Connection::MessageTrace &trace) {
+            secondTraces.append(trace);
+        });
+    CPPUNIT_ASSERT(second->send(TestMessage("capable")));
+    runUntil(loop, [&]() { return firstFlags.size() == 2; });
+    CPPUNIT_ASSERT(firstFlags.last() & Message::TraceCapable);
+    firstTraces.clear();
+    secondTraces.clear();
+    CPPUNIT_ASSERT(first->send(TestMessage("traced")));
+    runUntil(loop, [&]() { return secondFlags.size() == 3 && firstTraces.size() == 1 && secondTraces.size() == 1; });
+    CPPUNIT_ASSERT(secondFlags.last() & Message::Traced);
+
+    // ours once it's written
+    CPPUNIT_ASSERT_EQUAL(size_t(1), firstTraces.size());
+    const Connection::MessageTrace &out = firstTraces.first();
+    CPPUNIT_ASSERT(!out.incoming);
+    CPPUNIT_ASSERT_EQUAL(int(TestMessage::MessageId), int(out.messageId));
+    CPPUNIT_ASSERT(out.id && out.size);
+    CPPUNIT_ASSERT(out.sent && out.sent <= out.encoded && out.encoded <= out.written);
+
+    // theirs once the handler returned
+    CPPUNIT_ASSERT_EQUAL(size_t(1), secondTraces.size());
+    const Connection::MessageTrace &in = secondTraces.first();
+    CPPUNIT_ASSERT(in.incoming);
+    CPPUNIT_ASSERT(in.sameClock);
+    CPPUNIT_ASSERT_EQUAL(out.id, in.id);
+    CPPUNIT_ASSERT_EQUAL(out.size, in.size);
+    CPPUNIT_ASSERT_EQUAL(out.sent, in.sent);
+    CPPUNIT_ASSERT_EQUAL(out.encoded, in.encoded);
+    CPPUNIT_ASSERT(in.encoded <= in.read);
+    CPPUNIT_ASSERT(in.read <= in.framed && in.framed <= in.decoded);
+    CPPUNIT_ASSERT(in.decoded <= in.dispatched && in.dispatched <= in.handled);
+
+    // and off again
+    first->setTracing(0, Connection::TraceHandler());
+    CPPUNIT_ASSERT(!first->isTracing());
+    CPPUNIT_ASSERT(first->send(TestMessage("untraced")));
+    runUntil(loop, [&]() { return secondFlags.size() == 4; });
+    CPPUNIT_ASSERT(!(secondFlags.last() & (Message::Traced | Message::TraceCapable)));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), secondTraces.size());
+}
+
+void SocketTestSuite::statistics()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    a->setStatisticsEnabled(true);
+    b->setStatisticsEnabled(true);
+    size_t read = 0;
+    b->readyRead().connect([&read](const std::shared_ptr<SocketClient> &, Buffer &&buffer) {
+            read += buffer.size();
+            buffer.clear();
+        });
+    CPPUNIT_ASSERT(a->write(String("hello world")));
+    CPPUNIT_ASSERT(a->write(String("again")));
+    runUntil(loop, [&read]() { return read == 16; });
+    CPPUNIT_ASSERT_EQUAL(size_t(16), read);
+
+    SocketClient::Statistics stats = a->statistics();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(16), stats.bytesWritten);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), stats.writes);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), stats.bytesRead);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), stats.queuedBytes);
+    stats = b->statistics();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(16), stats.bytesRead);
+    CPPUNIT_ASSERT(stats.reads >= 1);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), stats.bytesWritten);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), stats.writes);
+
+    // turning them on again starts over
+    a->setStatisticsEnabled(true);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), a->statistics().bytesWritten);
+    a->setStatisticsEnabled(false);
+    CPPUNIT_ASSERT(a->write(String("off")));
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), a->statistics().bytesWritten);
+}
+
+void SocketTestSuite::serverStatistics()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    SocketServer server;
+    server.setStatisticsEnabled(true);
+    CPPUNIT_ASSERT(server.listen(socketPath()));
+    List<std::shared_ptr<SocketClient> > accepted;
+    size_t read = 0;
+    server.newConnection().connect([&accepted, &read](SocketServer *s) {
+            while (std::shared_ptr<SocketClient> client = s->nextConnection()) {
+                client->readyRead().connect([&read](const std::shared_ptr<SocketClient> &, Buffer &&buffer) {
+                        read += buffer.size();
+                        buffer.clear();
+                    });
+                accepted.append(client);
+            }
+        });
+
+    List<std::shared_ptr<SocketClient> > clients;
+    for (int i=0; i<2; ++i) {
+        std::shared_ptr<SocketClient> client(new SocketClient);
+        CPPUNIT_ASSERT(client->connect(socketPath()));
+        CPPUNIT_ASSERT(client->write(String(100 * (i + 1), 'x')));
+        clients.append(client);
+    }
+    runUntil(loop, [&read]() { return read == 300; });
+    CPPUNIT_ASSERT_EQUAL(size_t(300), read);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), server.clients().size());
+    CPPUNIT_ASSERT_EQUAL(uint64_t(300), server.statistics().bytesRead);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), server.statistics().bytesWritten);
+    CPPUNIT_ASSERT(accepted.first()->write(String("reply")));
+
+    // destroyed clients still count
+    accepted.clear();
+    CPPUNIT_ASSERT_EQUAL(size_t(0), server.clients().size());
+    const SocketClient::Statistics stats = server.statistics();
+    CPPUNIT_ASSERT_EQUAL(uint64_t(300), stats.bytesRead);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(5), stats.bytesWritten);
+    CPPUNIT_ASSERT(stats.reads >= 2);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), stats.writes);
+}
+
+void SocketTestSuite::pooledMessages()
+{
+    CPPUNIT_ASSERT(Message::registerMessage<PooledMessage>(2));
+    auto create = [](const String &text) {
+        const std::shared_ptr<const String> frame = PooledMessage(text).encodeShared(0);
+        const std::shared_ptr<Message> ret = Message::create(0, frame->constData() + sizeof(uint32_t),
+                                                             frame->size() - sizeof(uint32_t));
+        CPPUNIT_ASSERT(ret);
+        CPPUNIT_ASSERT_EQUAL(int(PooledMessage::MessageId), int(ret->messageId()));
+        CPPUNIT_ASSERT(static_cast<PooledMessage *>(ret.get())->text() == text);
+        return ret;
+    };
+
+    // a freed message's block is handed to the next one
+    std::shared_ptr<Message> message = create("first");
+    const Message *address = message.get();
+    message.reset();
+    message = create("second");
+    CPPUNIT_ASSERT(message.get() == address);
+
+    // the pool holds two, everything beyond that is freed
+    List<std::shared_ptr<Message> > messages;
+    messages.append(message);
+    for (int i=0; i<3; ++i)
+        messages.append(create(String::number(i)));
+    List<const Message *> addresses;
+    for (const std::shared_ptr<Message> &m : messages)
+        addresses.append(m.get());
+    message.reset();
+    messages.clear();
+    for (int i=0; i<2; ++i) {
+        messages.append(create(String::number(i)));
+        CPPUNIT_ASSERT(addresses.contains(messages.last().get()));
+    }
+}
+
+void SocketTestSuite::writeCoalescing()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> first = Connection::create(a);
+    std::shared_ptr<Connection> second = Connection::create(b);
+    List<String> received;
+    receiveText(second, received);
+    first->setStatisticsEnabled(true);
+    first->setWriteCoalescing(true, 256);
+    CPPUNIT_ASSERT(first->isWriteCoalescing());
+
+    List<String> sent;
+    for (int i=0; i<100; ++i) {
+        sent.append(String::number(i));
+        CPPUNIT_ASSERT(first->send(TestMessage(sent.last())));
+    }
+    // full batches go out right away, the rest on the next iteration
+    const SocketClient::Statistics stats = first->statistics().socket;
+    CPPUNIT_ASSERT(stats.writes > 1 && stats.writes < 100);
+    CPPUNIT_ASSERT(first->pendingWrite() > 0);
+    runUntil(loop, [&received, &sent]() { return received.size() == sent.size(); });
+    CPPUNIT_ASSERT(received == sent);
+    CPPUNIT_ASSERT_EQUAL(stats.writes + 1, first->statistics().socket.writes);
+    CPPUNIT_ASSERT_EQUAL(0, first->pendingWrite());
+
+    // what's left when the socket goes away won't be written
+    first->setWriteCoalescing(true, 64 * 1024, 10 * 1000 * 1000);
+    CPPUNIT_ASSERT(first->send(TestMessage("lost")));
+    CPPUNIT_ASSERT(first->pendingWrite() > 0);
+    a->close();
+    CPPUNIT_ASSERT(!first->flush());
+    CPPUNIT_ASSERT_EQUAL(0, first->pendingWrite());
+}
+
+void SocketTestSuite::requests()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+    CPPUNIT_ASSERT(Message::registerMessage<TestMessage>());
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> first = Connection::create(a);
+    std::shared_ptr<Connection> second = Connection::create(b);
+    // the peer holds on to requests until it's told to answer them
+    Map<String, uint32_t> incoming;
+    second->newMessage().connect([&incoming](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            CPPUNIT_ASSERT(message->requestId());
+            incoming[static_cast<TestMessage *>(message.get())->text()] = message->requestId();
+        });
+    auto answer = [&incoming, &second](const String &text) {
+        CPPUNIT_ASSERT(incoming.contains(text));
+        CPPUNIT_ASSERT(second->reply(incoming.value(text), TestMessage("re:" + text)));
+    };
+    List<String> replies;
+    auto request = [&first, &replies](const String &text) {
+        const uint32_t id = first->request(TestMessage(text), [text, &replies](const std::shared_ptr<Message> &message) {
+                replies.append(message ? static_cast<TestMessage *>(message.get())->text() : "none:" + text);
+            });
+        CPPUNIT_ASSERT(id);
+    };
+
+    // two out, the others wait for replies
+    first->setMaxPendingRequests(2);
+    for (int i=0; i<4; ++i)
+        request("r" + String::number(i));
+    CPPUNIT_ASSERT_EQUAL(4, first->pendingRequests());
+    runUntil(loop, [&incoming]() { return incoming.size() == 2; });
+    loop->exec(10);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), incoming.size());
+    CPPUNIT_ASSERT(incoming.contains("r0") && incoming.contains("r1"));
+
+    // answered in the other order
+    answer("r1");
+    answer("r0");
+    runUntil(loop, [&replies, &incoming]() { return replies.size() == 2 && incoming.size() == 4; });
+    CPPUNIT_ASSERT(replies == (List<String>() << "re:r1" << "re:r0"));
+    CPPUNIT_ASSERT_EQUAL(size_t(4), incoming.size());
+    CPPUNIT_ASSERT_EQUAL(2, first->pendingRequests());
+
+    answer("r3");
+    runUntil(loop, [&replies]() { return replies.size() == 3; });
+    CPPUNIT_ASSERT(replies.last() == "re:r3");
+    request("r4");
+    request("r5");
+    CPPUNIT_ASSERT_EQUAL(3, first->pendingRequests());
+    runUntil(loop, [&incoming]() { return incoming.size() == 5; });
+
+    // those still waiting, sent or not, get nothing once the peer is gone
+    second->close();
+    runUntil(loop, [&replies]() { return replies.size() == 6; });
+    CPPUNIT_ASSERT_EQUAL(size_t(6), replies.size());
+    CPPUNIT_ASSERT(replies.mid(3) == (List<String>() << "none:r2" << "none:r4" << "none:r5"));
+    CPPUNIT_ASSERT_EQUAL(0, first->pendingRequests());
+    CPPUNIT_ASSERT(!first->request(TestMessage("late"), [](const std::shared_ptr<Message> &) {}));
+}
+
+void SocketTestSuite::streams()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    std::shared_ptr<SocketClient> a, b;
+    socketPair(a, b);
+    std::shared_ptr<Connection> first = Connection::create(a);
+    std::shared_ptr<Connection> second = Connection::create(b);
+    Map<uint32_t, String> received;
+    List<uint32_t> finished;
+    second->chunk().connect([&received, &finished](const std::shared_ptr<ChunkMessage> &chunk, const std::shared_ptr<Connection> &) {
+            received[chunk->streamId()].append(chunk->data().data(), chunk->data().size());
+            if (chunk->isLast())
+                finished.append(chunk->streamId());
+        });
+
+    String data;
+    for (int i=0; i<1000; ++i)
+        data += String::number(i);
+    size_t produced = 0;
+    auto producer = [&data, &produced](String &chunk, size_t maxSize) {
+        const size_t size = std::min(maxSize, data.size() - produced);
+        chunk.assign(data.constData() + produced, size);
+        produced += size;
+        return produced < data.size();
+    };
+    // two streams interleaved
+    const uint32_t one = first->sendStream(producer, 100, 2);
+    CPPUNIT_ASSERT(one);
+    size_t producedTwo = 0;
+    const uint32_t two = first->sendStream([&producedTwo](String &chunk, size_t) {
+            chunk = "two";
+            return ++producedTwo < 5;
+        }, 10);
+    CPPUNIT_ASSERT(two && two != one);
+    runUntil(loop, [&finished]() { return finished.size() == 2; });
+    CPPUNIT_ASSERT_EQUAL(size_t(2), finished.size());
+    CPPUNIT_ASSERT(received.value(one) == data);
+    CPPUNIT_ASSERT(received.value(two) == "twotwotwotwotwo");
+
+    // the peer may only have so many open at once
+    second->setMaxIncomingStreams(2);
+    CPPUNIT_ASSERT(first->send(ChunkMessage(100, 0, "a")));
+    CPPUNIT_ASSERT(first->send(ChunkMessage(101, 0, "b")));
+    CPPUNIT_ASSERT(first->send(ChunkMessage(102, 0, "c", true)));
+    CPPUNIT_ASSERT(first->send(ChunkMessage(100, 1, "a", true)));
+    runUntil(loop, [&finished]() { return finished.size() == 4; });
+    CPPUNIT_ASSERT(finished.at(2) == 102 && finished.at(3) == 100);
+    CPPUNIT_ASSERT(first->send(ChunkMessage(103, 0, "d")));
+    CPPUNIT_ASSERT(first->send(ChunkMessage(104, 0, "e")));
+    runUntil(loop, [&second]() { return !second->isConnected(); });
+    CPPUNIT_ASSERT(!second->isConnected());
+    CPPUNIT_ASSERT(received.contains(103));
+    CPPUNIT_ASSERT(!received.contains(104));
+}
@@ -0,0 +1,56 @@
+#ifndef SOCKETTESTSUITE_H
+#define SOCKETTESTSUITE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class SocketTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(SocketTestSuite);
+
+    CPPUNIT_TEST(newConnectionPerSocket);
+    CPPUNIT_TEST(fileDescriptors);
+    CPPUNIT_TEST(messageIds);
+    CPPUNIT_TEST(pooledMessages);
+    CPPUNIT_TEST(flushOnDestroy);
+    CPPUNIT_TEST(cachedMessages);
+    CPPUNIT_TEST(sharedMemory);
+    CPPUNIT_TEST(pacedSharedMemory);
+    CPPUNIT_TEST(rejectSharedMemory);
+    CPPUNIT_TEST(corruptSharedMemory);
+    CPPUNIT_TEST(writeCoalescing);
+    CPPUNIT_TEST(requests);
+    CPPUNIT_TEST(streams);
+    CPPUNIT_TEST(pacing);
+    CPPUNIT_TEST(tracing);
+    CPPUNIT_TEST(statistics);
+    CPPUNIT_TEST(serverStatistics);
+
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp();
+    void tearDown();
+
+protected:
+    void newConnectionPerSocket();
+    void fileDescriptors();
+    void messageIds();
+    void pooledMessages();
+    void flushOnDestroy();
+    void cachedMessages();
+    void sharedMemory();
+    void pacedSharedMemory();
+    void rejectSharedMemory();
+    void corruptSharedMemory();
+    void writeCoalescing();
+    void requests();
+    void streams();
+    void pacing();
+    void tracing();
+    void statistics();
+    void serverStatistics();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SocketTestSuite);
+
+#endif /* SOCKETTESTSUITE_H */
@@ -0,0 +1,249 @@
+#include "StringTestSuite.h"
+
+#include <rct/Compression.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/Rct.h>
+#include <rct/String.h>
+#include <rct/StringSearch.h>
+#include <rct/StringView.h>
+
+void StringTestSuite::views()
+{
+    const String str = "  /usr/include/stdio.h\t\n";
+    const StringView trimmed = str.trimmedView();
+    CPPUNIT_ASSERT(trimmed == str.trimmed());
+    CPPUNIT_ASSERT(trimmed.data() == str.constData() + 2);
+    CPPUNIT_ASSERT(str.trimmedView(" \t\n/").startsWith("usr"));
+    CPPUNIT_ASSERT(String("   ").trimmedView().isEmpty());
+
+    CPPUNIT_ASSERT(str.midView(3, 3) == str.mid(3, 3));
+    CPPUNIT_ASSERT(str.midView(3) == str.mid(3));
+    CPPUNIT_ASSERT(str.leftView(5) == str.left(5));
+    CPPUNIT_ASSERT(str.rightView(4) == str.right(4));
+    CPPUNIT_ASSERT(str.midView(str.size()).isEmpty());
+
+    CPPUNIT_ASSERT_EQUAL(size_t(5), trimmed.indexOf("include"));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(StringView::npos), trimmed.indexOf("includes"));
+    CPPUNIT_ASSERT_EQUAL(size_t(12), trimmed.lastIndexOf('/'));
+    CPPUNIT_ASSERT_EQUAL(size_t(4), trimmed.lastIndexOf('/', 11));
+    CPPUNIT_ASSERT(trimmed.endsWith(".H", String::CaseInsensitive));
+    CPPUNIT_ASSERT(!trimmed.endsWith(".H"));
+    CPPUNIT_ASSERT(trimmed.contains('.'));
+
+    const Path path = trimmed.mid(trimmed.lastIndexOf('/') + 1);
+    CPPUNIT_ASSERT(path == "stdio.h");
+}
+
+void StringTestSuite::splitView()
+{
+    List<StringView> parts;
+    for (const char *str : { "a,b,,c", ",a,", "", "abc", ",,," }) {
+        const String string = str;
+        for (unsigned int flags : { String::NoSplitFlag, String::SkipEmpty, String::KeepSeparators }) {
+            const List<String> expected = string.split(',', flags);
+            CPPUNIT_ASSERT_EQUAL(expected.size(), string.splitView(',', parts, flags));
+            for (size_t i=0; i<expected.size(); ++i)
+                CPPUNIT_ASSERT(expected.at(i) == parts.at(i));
+        }
+    }
+}
+
+void StringTestSuite::caseInsensitive()
+{
+    const String str = "xAaAb-aab";
+    // used to miss matches that start inside a partial match
+    CPPUNIT_ASSERT_EQUAL(size_t(2), str.indexOf(String("AAB"), 0, String::CaseInsensitive));
+    CPPUNIT_ASSERT_EQUAL(size_t(6), str.lastIndexOf(String("AAB"), String::npos, String::CaseInsensitive));
+    CPPUNIT_ASSERT_EQUAL(size_t(2), str.lastIndexOf(String("AAB"), 5, String::CaseInsensitive));
+    // used to return from instead of the match
+    CPPUNIT_ASSERT_EQUAL(size_t(7), str.lastIndexOf('A', String::npos, String::CaseInsensitive));
+    CPPUNIT_ASSERT_EQUAL(size_t(3), str.lastIndexOf('a', 4, String::CaseInsensitive));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(String::npos), str.indexOf('x', 1, String::CaseInsensitive));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(String::npos), str.indexOf("aab", 20));
+    CPPUNIT_ASSERT(str.contains("B-A", String::CaseInsensitive));
+
+    String copy = str;
+    CPPUNIT_ASSERT_EQUAL(size_t(5), copy.remove('a', String::CaseInsensitive));
+    CPPUNIT_ASSERT(copy == "xb-b");
+    copy = str;
+    CPPUNIT_ASSERT_EQUAL(size_t(2), copy.replace('A', '_'));
+    CPPUNIT_ASSERT(copy == "x_a_b-aab");
+    CPPUNIT_ASSERT(str.toUpper() == "XAAAB-AAB");
+    CPPUNIT_ASSERT(str.toLower() == "xaaab-aab");
+    CPPUNIT_ASSERT(!String("abc").compare("ABC", String::CaseInsensitive));
+    CPPUNIT_ASSERT(String("ab").compare("ABC", String::CaseInsensitive) != 0);
+    CPPUNIT_ASSERT(str.endsWith(String("-AAB"), String::CaseInsensitive));
+}
+
+static size_t naiveIndexOf(const String &haystack, const String &needle, bool caseInsensitive)
+{
+    const String h = caseInsensitive ? haystack.toLower() : haystack;
+    const String n = caseInsensitive ? needle.toLower() : needle;
+    return h.ref().find(n.ref());
+}
+
+static size_t naiveLastIndexOf(const String &haystack, const String &needle, bool caseInsensitive)
+{
+    const String h = caseInsensitive ? haystack.toLower() : haystack;
+    const String n = caseInsensitive ? needle.toLower() : needle;
+    return h.ref().rfind(n.ref());
+}
+
+void StringTestSuite::searchKernels()
+{
+    const StringSearch::Instructions best = StringSearch::instructions();
+    unsigned int seed = 1;
+    auto random = [&seed](size_t max) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) % max;
+    };
+    const char alphabet[] = "abAB-\x80";
+    for (StringSearch::Instructions instructions : { StringSearch::Portable, StringSearch::SSE2, StringSearch::AVX2 }) {
+        if (!StringSearch::setInstructions(instructions))
+            continue;
+        for (int i=0; i<2000; ++i) {
+            // long enough to cross a few blocks
+            String haystack(random(100), ' ');
+            for (char &ch : haystack)
+                ch = alphabet[random(sizeof(alphabet) - 1)];
+            String needle(random(6) + 1, ' ');
+            for (char &ch : needle)
+                ch = alphabet[random(sizeof(alphabet) - 1)];
+            for (bool ci : { false, true }) {
+                const String::CaseSensitivity cs = ci ? String::CaseInsensitive : String::CaseSensitive;
+                CPPUNIT_ASSERT_EQUAL(naiveIndexOf(haystack, needle, ci), haystack.indexOf(needle, 0, cs));
+                CPPUNIT_ASSERT_EQUAL(naiveLastIndexOf(haystack, needle, ci), haystack.lastIndexOf(needle, String::npos, cs));
+            }
+            String lowered = haystack;
+            for (char &ch : lowered)
+                ch = ch >= 'A' && ch <= 'Z' ? ch + 32 : ch;
+            CPPUNIT_ASSERT(haystack.toLower() == lowered);
+            CPPUNIT_ASSERT(!haystack.compare(lowered, String::CaseInsensitive));
+            String replaced = haystack;
+            const size_t count = replaced.replace('a', '.', String::CaseInsensitive);
+            CPPUNIT_ASSERT_EQUAL(count, String(lowered).remove('a'));
+        }
+    }
+    StringSearch::setInstructions(best);
+}
+
+void StringTestSuite::jsonEscape()
+{
+    CPPUNIT_ASSERT(Rct::jsonEscape("") == "\"\"");
+    CPPUNIT_ASSERT(Rct::jsonEscape("say \"hi\"\n") == "\"say \\\"hi\\\"\\n\"");
+    CPPUNIT_ASSERT(Rct::jsonEscape("C:\\dir\ttab\x01\x7f") == "\"C:\\\\dir\\ttab\\u0001\\u007f\"");
+    // UTF-8 used to come out as \uffff
+    CPPUNIT_ASSERT(Rct::jsonEscape("Äßé最終") == "\"Äßé最終\"");
+
+    const StringSearch::Instructions best = StringSearch::instructions();
+    srand(1);
+    const char special[] = "\"\\\n\x01\x1f\x7f\x80\xff ";
+    for (StringSearch::Instructions instructions : { StringSearch::Portable, StringSearch::SSE2, StringSearch::AVX2 }) {
+        if (!StringSearch::setInstructions(instructions))
+            continue;
+        for (int i=0; i<500; ++i) {
+            String str(rand() % 100, 'x');
+            for (int j=rand() % 4; j>0 && !str.isEmpty(); --j)
+                str[rand() % str.size()] = special[rand() % (sizeof(special) - 1)];
+            String expected = "\"";
+            for (char ch : str) {
+                const unsigned char byte = static_cast<unsigned char>(ch);
+                if (ch == '"' || ch == '\\') {
+                    expected += '\\';
+                    expected += ch;
+                } else if (ch == '\n') {
+                    expected += "\\n";
+                } else if (byte < 0x20 || byte == 0x7f) {
+                    expected += String::format<8>("\\u%04x", byte);
+                } else {
+                    expected += ch;
+                }
+            }
+            expected += '"';
+            CPPUNIT_ASSERT(Rct::jsonEscape(str) == expected);
+        }
+    }
+    StringSearch::setInstructions(best);
+}
+
+void StringTestSuite::uncompressLimit()
+{
+    const String data(1024 * 1024, 'a');
+    const String compressed = data.compress();
+    CPPUNIT_ASSERT(compressed.size() < 4096);
+    CPPUNIT_ASSERT(compressed.uncompress() == data);
+    CPPUNIT_ASSERT(compressed.uncompress(data.size()) == data);
+    CPPUNIT_ASSERT(compressed.uncompress(data.size() - 1).isEmpty());
+
+    const size_t max = Compression::maxUncompressedSize();
+    String out;
+    CPPUNIT_ASSERT(Compression::uncompress(Compression::Zlib, compressed.constData(), compressed.size(), out));
+    Compression::setMaxUncompressedSize(64 * 1024);
+    CPPUNIT_ASSERT(!Compression::uncompress(Compression::Zlib, compressed.constData(), compressed.size(), out));
+    Compression::setMaxUncompressedSize(max);
+}
+
+// run length encoding, pairs of count and byte
+static bool rleCompress(const char *data, size_t size, int, String &out)
+{
+    for (size_t i=0; i<size; ) {
+        size_t run = 1;
+        while (run < 255 && i + run < size && data[i + run] == data[i])
+            ++run;
+        out.append(static_cast<char>(run));
+        out.append(data[i]);
+        i += run;
+    }
+    return true;
+}
+
+static bool rleUncompress(const char *data, size_t size, String &out)
+{
+    out.clear();
+    if (size % 2)
+        return false;
+    for (size_t i=0; i<size; i += 2)
+        out.append(String(static_cast<unsigned char>(data[i]), data[i + 1]));
+    return true;
+}
+
+void StringTestSuite::compressionPolicy()
+{
+    const uint8_t codec = Compression::UserCodec + 1;
+    CPPUNIT_ASSERT(!Compression::isSupported(codec));
+    CPPUNIT_ASSERT(Compression::registerCodec(codec, rleCompress, rleUncompress));
+    CPPUNIT_ASSERT(Compression::isSupported(codec));
+    // codecs stay what they were registered as
+    CPPUNIT_ASSERT(!Compression::registerCodec(codec, rleCompress, rleUncompress));
+
+    Compression::Policy policy;
+    policy.codec = codec;
+    policy.minSize = 100;
+    policy.maxRatio = 0.5;
+
+    const String data(1000, 'a');
+    String compressed, out;
+    CPPUNIT_ASSERT(Compression::compress(policy, data.constData(), data.size(), compressed));
+    CPPUNIT_ASSERT_EQUAL(size_t(1 + 8), compressed.size());
+    CPPUNIT_ASSERT_EQUAL(codec, static_cast<uint8_t>(compressed.at(0)));
+    CPPUNIT_ASSERT(Compression::uncompressTagged(compressed.constData(), compressed.size(), out));
+    CPPUNIT_ASSERT(out == data);
+
+    // too small to bother
+    CPPUNIT_ASSERT(!Compression::compress(policy, data.constData(), policy.minSize - 1, compressed));
+
+    // doesn't get small enough
+    String mixed;
+    for (int i=0; i<1000; ++i)
+        mixed.append(static_cast<char>('a' + (i % 3 ? i % 26 : 0)));
+    CPPUNIT_ASSERT(!Compression::compress(policy, mixed.constData(), mixed.size(), compressed));
+    policy.maxRatio = 3;
+    CPPUNIT_ASSERT(Compression::compress(policy, mixed.constData(), mixed.size(), compressed));
+    CPPUNIT_ASSERT(Compression::uncompressTagged(compressed.constData(), compressed.size(), out));
+    CPPUNIT_ASSERT(out == mixed);
+
+    // unknown codecs fail
+    compressed[0] = static_cast<char>(Compression::UserCodec + 2);
+    CPPUNIT_ASSERT(!Compression::uncompressTagged(compressed.constData(), compressed.size(), out));
+}
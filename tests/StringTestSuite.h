@@ -0,0 +1,32 @@
+#ifndef STRINGTESTSUITE_H
+#define STRINGTESTSUITE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class StringTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(StringTestSuite);
+
+    CPPUNIT_TEST(views);
+    CPPUNIT_TEST(splitView);
+    CPPUNIT_TEST(caseInsensitive);
+    CPPUNIT_TEST(searchKernels);
+    CPPUNIT_TEST(jsonEscape);
+    CPPUNIT_TEST(uncompressLimit);
+    CPPUNIT_TEST(compressionPolicy);
+
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    void views();
+    void splitView();
+    void caseInsensitive();
+    void searchKernels();
+    void jsonEscape();
+    void uncompressLimit();
+    void compressionPolicy();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(StringTestSuite);
+
+#endif /* STRINGTESTSUITE_H */